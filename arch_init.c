@@ -25,6 +25,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #ifndef _WIN32
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
@@ -44,6 +45,12 @@
 
 //classicsong
 #include "migr-vqueue.h"
+#define DUP_PAGE_SIZE TARGET_PAGE_SIZE
+#include "migr-dup.h"
+#include "migr-xbzrle.h"
+#include "migr-numa.h"
+#include "migr-postcopy.h"
+#include "atomic.h"
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -86,7 +93,7 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+#define RAM_SAVE_FLAG_XBZRLE   0x01 /* was RAM_SAVE_FLAG_FULL, obsolete */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -109,21 +116,6 @@ const uint32_t arch_type = QEMU_ARCH;
     do { } while (0)
 #endif
 
-static int is_dup_page(uint8_t *page, uint8_t ch)
-{
-    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
-    uint32_t *array = (uint32_t *)page;
-    int i;
-
-    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
-        if (array[i] != val) {
-            return 0;
-        }
-    }
-
-    return 1;
-}
-
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
 
@@ -196,24 +188,208 @@ static int ram_save_block(QEMUFile *f)
 
 static uint64_t bytes_transferred;
 
+/*
+ * classicsong
+ * hot pages
+ * history keeps, per ram page, the last round the page was found dirty
+ * (5 bits) and how many rounds in a row it was (3 bits). A page dirty
+ * nr_rounds rounds in a row is hot: its dirty bit moves to deferred and it
+ * is not queued. A hot page dirtied again is skipped again, that is a
+ * page not resent; a hot page left clean for a round cooled down and is
+ * queued at once. The last round sends every deferred page.
+ * The first round sends every page, it is not counted.
+ * The round wraps, the pages stamped with the round starting lose their
+ * streak so an old stamp is never taken for the round before
+ */
+#define HOT_ROUND_BITS 5
+#define HOT_STREAK_BITS 3
+#define HOT_STREAK_MAX ((1 << HOT_STREAK_BITS) - 1)
+
+static struct {
+    int nr_rounds;
+    /* rounds scanned so far, hot pages are skipped only while active */
+    int round;
+    int active;
+    uint8_t *history;
+    ram_addr_t nr_pages;
+    unsigned long *deferred;
+    unsigned long nr_words;
+    /* deferred pages, pages not resent in this round and in all */
+    volatile unsigned long pages;
+    volatile unsigned long skipped;
+    unsigned long total_skipped;
+} hot;
+
+static void hot_init(int nr_rounds) {
+    RAMBlock *block;
+    ram_addr_t nr_pages = 0;
+
+    //left from a cancelled migration
+    qemu_free(hot.history);
+    qemu_free(hot.deferred);
+    memset(&hot, 0, sizeof(hot));
+    if (nr_rounds <= 0)
+        return;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next)
+        if (((block->offset + block->length) >> TARGET_PAGE_BITS) > nr_pages)
+            nr_pages = (block->offset + block->length) >> TARGET_PAGE_BITS;
+
+    hot.nr_rounds = nr_rounds;
+    hot.nr_pages = nr_pages;
+    hot.history = qemu_mallocz(nr_pages);
+    hot.nr_words = MIGRATION_DIRTY_WORDS(nr_pages);
+    hot.deferred = qemu_mallocz(hot.nr_words * sizeof(unsigned long));
+    DPRINTF("pages dirty %d rounds in a row are deferred\n", nr_rounds);
+}
+
+/* start a round, the last one takes the deferred pages back */
+static void hot_round_start(int last) {
+    unsigned long word, bits;
+    ram_addr_t page;
+    int cur;
+
+    if (hot.history == NULL)
+        return;
+
+    hot.active = !last && hot.round > 0;
+    hot.round++;
+
+    //a stamp of this round is 1 << HOT_ROUND_BITS rounds old
+    if (hot.round > (1 << HOT_ROUND_BITS)) {
+        cur = (hot.round - 1) & ((1 << HOT_ROUND_BITS) - 1);
+        for (page = 0; page < hot.nr_pages; page++)
+            if ((hot.history[page] >> HOT_STREAK_BITS) == cur)
+                hot.history[page] &= ~HOT_STREAK_MAX;
+    }
+
+    if (!last)
+        return;
+
+    for (word = 0; word < hot.nr_words; word++) {
+        bits = __sync_lock_test_and_set(&hot.deferred[word], 0);
+        migration_dirty_set_bits(word, bits);
+    }
+    hot.pages = 0;
+}
+
+/*
+ * the pages of mask to queue now out of the dirty ones of the word,
+ * the hot ones are deferred instead
+ */
+static unsigned long hot_filter(unsigned long word, unsigned long mask, unsigned long dirty) {
+    unsigned long deferred, hot_bits = 0, send = 0, bits, old;
+    unsigned long skipped = 0;
+    ram_addr_t page;
+    int bit, streak, prev = (hot.round - 2) & ((1 << HOT_ROUND_BITS) - 1);
+    uint8_t h;
+
+    deferred = hot.deferred[word] & mask;
+    bits = dirty | deferred;
+    while (bits) {
+        bit = __builtin_ctzl(bits);
+        bits &= bits - 1;
+        page = word * HOST_LONG_BITS + bit;
+
+        if (dirty & (1UL << bit)) {
+            h = hot.history[page];
+            streak = (h >> HOT_STREAK_BITS) == prev ? (h & HOT_STREAK_MAX) : 0;
+            if (streak < HOT_STREAK_MAX)
+                streak++;
+            hot.history[page] = (((hot.round - 1) & ((1 << HOT_ROUND_BITS) - 1)) << HOT_STREAK_BITS) |
+                streak;
+
+            if (streak >= hot.nr_rounds) {
+                if (deferred & (1UL << bit))
+                    skipped++;
+                hot_bits |= 1UL << bit;
+                continue;
+            }
+        }
+        send |= 1UL << bit;
+    }
+
+    //a word may be shared by two scanners at a block boundary
+    if (deferred & ~hot_bits) {
+        old = __sync_fetch_and_and(&hot.deferred[word], ~(deferred & ~hot_bits));
+        __sync_fetch_and_sub(&hot.pages, __builtin_popcountl(old & deferred & ~hot_bits));
+    }
+    if (hot_bits & ~deferred) {
+        old = __sync_fetch_and_or(&hot.deferred[word], hot_bits & ~deferred);
+        __sync_fetch_and_add(&hot.pages, __builtin_popcountl(hot_bits & ~deferred & ~old));
+    }
+    if (skipped)
+        atomic_add_long(skipped, &hot.skipped);
+
+    return send;
+}
+
+static void hot_report(int last) {
+    if (hot.history == NULL)
+        return;
+
+    hot.total_skipped += hot.skipped;
+    if (last)
+        DPRINTF("hot pages: %lx bytes not resent in total\n",
+                hot.total_skipped * TARGET_PAGE_SIZE);
+    else
+        DPRINTF("hot pages %lx deferred, %lx bytes not resent\n",
+                hot.pages, hot.skipped * TARGET_PAGE_SIZE);
+    hot.skipped = 0;
+}
+
+/*
+ * the number of dirty pages is kept up to date by every set and clear
+ * of the migration bitmap, so this is O(1)
+ * define DEBUG_MIGRATION_DIRTY_COUNT to cross check it with a full scan
+ */
+//#define DEBUG_MIGRATION_DIRTY_COUNT
+
+#ifdef DEBUG_MIGRATION_DIRTY_COUNT
+/* count the set bits of the migration bitmap in [page, end) */
+static ram_addr_t migration_dirty_count(ram_addr_t page, ram_addr_t end)
+{
+    ram_addr_t count = 0;
+    unsigned long word, mask;
+
+    while (page < end) {
+        word = MIGRATION_DIRTY_WORD(page);
+        mask = ~0UL << (page % HOST_LONG_BITS);
+        if (end - word * HOST_LONG_BITS < HOST_LONG_BITS)
+            mask &= ~0UL >> (HOST_LONG_BITS - end % HOST_LONG_BITS);
+        count += __builtin_popcountl(ram_list.migration_dirty[word] & mask);
+        page = (word + 1) * HOST_LONG_BITS;
+    }
+
+    return count;
+}
+#endif
+
 static ram_addr_t ram_save_remaining(void)
 {
+    /*
+     * a clear may be counted before the set it races with,
+     * so the counter can be briefly negative
+     */
+    long dirty = ram_list.migration_dirty_pages;
+#ifdef DEBUG_MIGRATION_DIRTY_COUNT
     RAMBlock *block;
     ram_addr_t count = 0;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-//            DPRINTF("->cpu_physical_memory_get_dirty@ram_save_remaining\n");
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-//                DPRINTF("<-cpu_physical_memory_get_dirty@ram_save_remaining\n");
-                count++;
-            }
-        }
+        count += migration_dirty_count(block->offset >> TARGET_PAGE_BITS,
+                                       (block->offset + block->length) >> TARGET_PAGE_BITS);
     }
 
-    return count;
+    if ((long)count != dirty)
+        fprintf(stderr, "dirty page counter mismatch: counter %ld, scan %ld\n",
+                dirty, (long)count);
+#endif
+
+    if (dirty < 0)
+        dirty = 0;
+    //a hot page dirtied again since the last scan is counted twice
+    return dirty + hot.pages;
 }
 
 uint64_t ram_bytes_remaining(void)
@@ -272,15 +448,183 @@ static void sort_ram_list(void)
 }
 
 
+/*
+ * classicsong
+ * XBZRLE page cache
+ * a bounded direct mapped cache of the last version sent of the pages
+ * that are resent after the first iteration, keyed by host address.
+ * a page resent while its previous version is cached goes out as a delta.
+ * As a page is sent at most once per iteration and the iterations run in
+ * strict mode with the cache on (an iteration is queued only when every
+ * dest acked the previous one), the dest always holds the cached version
+ * when the delta arrives. Every send of a page updates or drops its entry.
+ */
+#define XBZRLE_MAX_ENCODED (TARGET_PAGE_SIZE / 2)
+
+struct xbzrle_slot {
+    disk_spinlock_t lock;
+    unsigned long key;      /* host page number, 0 for an empty slot */
+};
+
+static struct {
+    unsigned long nr_slots;
+    struct xbzrle_slot *slots;
+    uint8_t *data;
+    /* statistics, reset every iteration */
+    volatile unsigned long pages;
+    volatile unsigned long bytes;
+    volatile unsigned long misses;
+} xbzrle_cache;
+
+/*
+ * called on every migration, the cache of an earlier one holds versions
+ * the new dest never got
+ */
+static void xbzrle_cache_init(unsigned long size_in_mb) {
+    unsigned long i;
+
+    if (xbzrle_cache.nr_slots) {
+        qemu_free(xbzrle_cache.slots);
+        qemu_vfree(xbzrle_cache.data);
+    }
+    memset(&xbzrle_cache, 0, sizeof(xbzrle_cache));
+
+    xbzrle_cache.nr_slots = (size_in_mb << 20) >> TARGET_PAGE_BITS;
+    if (xbzrle_cache.nr_slots == 0)
+        return;
+
+    xbzrle_cache.slots = qemu_mallocz(xbzrle_cache.nr_slots * sizeof(struct xbzrle_slot));
+    xbzrle_cache.data = qemu_vmalloc(xbzrle_cache.nr_slots << TARGET_PAGE_BITS);
+    for (i = 0; i < xbzrle_cache.nr_slots; i++)
+        disk_spin_lock_init(&xbzrle_cache.slots[i].lock);
+
+    DPRINTF("XBZRLE cache of %lx pages\n", xbzrle_cache.nr_slots);
+}
+
+static inline struct xbzrle_slot *xbzrle_slot_of(unsigned long key) {
+    return &xbzrle_cache.slots[(key * 0x9E3779B97F4A7C15UL) % xbzrle_cache.nr_slots];
+}
+
+static inline uint8_t *xbzrle_data_of(struct xbzrle_slot *slot) {
+    return xbzrle_cache.data + ((slot - xbzrle_cache.slots) << TARGET_PAGE_BITS);
+}
+
+/* the page is sent in some other form, forget its cached version */
+static void xbzrle_cache_drop(uint8_t *p) {
+    unsigned long key = (unsigned long)p >> TARGET_PAGE_BITS;
+    struct xbzrle_slot *slot;
+
+    if (xbzrle_cache.nr_slots == 0)
+        return;
+
+    slot = xbzrle_slot_of(key);
+    if (slot->key != key)
+        return;
+
+    disk_spin_lock(&slot->lock);
+    if (slot->key == key)
+        slot->key = 0;
+    disk_spin_unlock(&slot->lock);
+}
+
+/*
+ * send a page not found to be a dup page
+ * returns the bytes put on the stream for the page data
+ */
+static unsigned long ram_put_page(QEMUFile *f, ram_addr_t offset, uint8_t *p,
+                                  RAMBlock *block, int mem_vnum) {
+    unsigned long key = (unsigned long)p >> TARGET_PAGE_BITS;
+    int cont = block == NULL ? RAM_SAVE_FLAG_CONTINUE : 0;
+    struct xbzrle_slot *slot;
+    uint8_t *cached;
+    uint8_t snap[TARGET_PAGE_SIZE];
+    uint8_t encoded[XBZRLE_MAX_ENCODED];
+    int len;
+
+    /*
+     * the bulk iteration and pages that are not in the cache are sent in full
+     */
+    if (xbzrle_cache.nr_slots == 0 || mem_vnum == 0) {
+        qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE | (mem_vnum << MEM_VNUM_OFFSET));
+        if (block) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr,
+                            strlen(block->idstr));
+        }
+        //no copy, the guest page is read when the slave flushes the batch
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+
+        return TARGET_PAGE_SIZE;
+    }
+
+    slot = xbzrle_slot_of(key);
+    cached = xbzrle_data_of(slot);
+    disk_spin_lock(&slot->lock);
+
+    /*
+     * the guest keeps writing, so work on a snapshot: the dest must end
+     * up with exactly the bytes kept in the cache
+     */
+    memcpy(snap, p, TARGET_PAGE_SIZE);
+
+    if (slot->key == key) {
+        len = xbzrle_encode(cached, snap, TARGET_PAGE_SIZE, encoded, XBZRLE_MAX_ENCODED);
+        if (len >= 0) {
+            memcpy(cached, snap, TARGET_PAGE_SIZE);
+            disk_spin_unlock(&slot->lock);
+
+            qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_XBZRLE | (mem_vnum << MEM_VNUM_OFFSET));
+            if (block) {
+                qemu_put_byte(f, strlen(block->idstr));
+                qemu_put_buffer(f, (uint8_t *)block->idstr,
+                                strlen(block->idstr));
+            }
+            qemu_put_be16(f, len);
+            qemu_put_buffer(f, encoded, len);
+
+            atomic_add_long(1, &xbzrle_cache.pages);
+            atomic_add_long(len + 2, &xbzrle_cache.bytes);
+            return len + 2;
+        }
+    } else
+        atomic_add_long(1, &xbzrle_cache.misses);
+
+    /* (re)fill the slot with the version sent now */
+    slot->key = key;
+    memcpy(cached, snap, TARGET_PAGE_SIZE);
+    disk_spin_unlock(&slot->lock);
+
+    qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE | (mem_vnum << MEM_VNUM_OFFSET));
+    if (block) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr,
+                        strlen(block->idstr));
+    }
+    qemu_put_buffer(f, snap, TARGET_PAGE_SIZE);
+
+    return TARGET_PAGE_SIZE;
+}
+
+static void xbzrle_report(void) {
+    if (xbzrle_cache.nr_slots == 0)
+        return;
+
+    DPRINTF("XBZRLE pages %lx, sent %lx bytes instead of %lx, cache misses %lx\n",
+            xbzrle_cache.pages, xbzrle_cache.bytes,
+            xbzrle_cache.pages * TARGET_PAGE_SIZE, xbzrle_cache.misses);
+    xbzrle_cache.pages = 0;
+    xbzrle_cache.bytes = 0;
+    xbzrle_cache.misses = 0;
+}
+
 unsigned long ram_save_block_slave(ram_addr_t offset, uint8_t *p, void *block_p,
-                         struct FdMigrationStateSlave *s, int mem_vnum);
+                         QEMUFile *f, int mem_vnum);
 
 //classicsong
 unsigned long
 ram_save_block_slave(ram_addr_t offset, uint8_t *p, void *block_p, 
-                     struct FdMigrationStateSlave *s, int mem_vnum) {
+                     QEMUFile *f, int mem_vnum) {
     RAMBlock *block = (RAMBlock *)block_p;
-    QEMUFile *f = s->file;
 
     if (is_dup_page(p, *p)) {
         qemu_put_be64(f, offset | (block == NULL ? RAM_SAVE_FLAG_CONTINUE : 0) | 
@@ -291,107 +635,366 @@ ram_save_block_slave(ram_addr_t offset, uint8_t *p, void *block_p,
                             strlen(block->idstr));
         }
         qemu_put_byte(f, *p);
+        xbzrle_cache_drop(p);
 
         return 1;
     } else {
-        qemu_put_be64(f, offset | (block == NULL ? RAM_SAVE_FLAG_CONTINUE : 0) | RAM_SAVE_FLAG_PAGE | (mem_vnum << MEM_VNUM_OFFSET));
-        if (block) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr,
-                            strlen(block->idstr));
-        }
-        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-
-        return TARGET_PAGE_SIZE;
+        return ram_put_page(f, offset, p, block, mem_vnum);
     }
 }
 
-static unsigned long
-ram_save_block_master(struct migration_task_queue *task_queue) {
-    RAMBlock *block = QLIST_FIRST(&ram_list.blocks);
-    RAMBlock *last_block = NULL;
-    ram_addr_t offset = 0;
-    ram_addr_t current_addr;
-    unsigned long bytes_sent = 0;
-    struct task_body *body = NULL;
-    int body_len = 0;
+/*
+ * classicsong
+ * parallel dirty bitmap scanning
+ * the RAMBlock list is cut into nr_scanners page ranges of equal size,
+ * each range is scanned by its own thread over ram_list.migration_dirty,
+ * it batches the dirty pages and pushes them to the (lock-free) task queue
+ */
+#define SCAN_WORD_PAGES HOST_LONG_BITS
 
-    current_addr = block->offset + offset;
+static int nr_scanners = 1;
 
-    //DPRINTF("Start ram_save_block_master %d\n", DEFAULT_MEM_BATCH_LEN);
-    do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-            int cont;
+/*
+ * NUMA mode: node backing every NUMA_GRANULE_SIZE of the sorted block
+ * list, refreshed once per iteration, and the shards (slaves) of every node
+ */
+#define NUMA_GRANULE_PAGES (NUMA_GRANULE_SIZE >> TARGET_PAGE_BITS)
+
+static struct {
+    signed char *node;
+    void **addr;
+    int *status;
+    unsigned long nr_granules;
+    int nr_node_shards[MAX_NUMA_NODES];
+    int *node_shards[MAX_NUMA_NODES];
+} numa_map;
+
+struct ram_scanner {
+    struct migration_task_queue *task_queue;
+    unsigned long start_page;
+    unsigned long end_page;
+    /* shard mode: pages per slave shard, 0 without sharding */
+    unsigned long shard_pages;
+    /*
+     * batch under construction and the shard it goes to, the pages are
+     * copied into a body of the right size class when it is pushed
+     */
+    RAMBlock *last_block;
+    struct task_page *pages;
+    int body_len;
+    int shard;
+};
 
-            if (block == last_block)
-                cont = RAM_SAVE_FLAG_CONTINUE;
-            else {
-                last_block = block;
-                cont = 0;
-            }
+static void scanner_push_batch(struct ram_scanner *sc) {
+    struct task_body *body;
 
-            //DPRINTF("reset dirty %lx, %lx\n", current_addr, block->offset);
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
-            p = block->host + offset;
+    body = task_body_new(TASK_TYPE_MEM, sc->body_len, sc->task_queue->iter_num);
+    memcpy(body->pages, sc->pages, sc->body_len * sizeof(struct task_page));
+    body->len = sc->body_len;
+
+    //finish one batch, for next batch, the RAM_SAVE_FLAG_CONTINUE should not be set
+    sc->last_block = NULL;
+    sc->body_len = 0;
+
+    if (queue_push_body(sc->task_queue, sc->shard, body) < 0)
+        fprintf(stderr, "Enqueue task error\n");
+}
+
+/*
+ * shard of the page index, in NUMA mode a slave on the node backing the
+ * page, the granules of a node are spread over its slaves; the same page
+ * goes to the same slave as long as it is not moved to another node
+ */
+static int scanner_page_shard(struct ram_scanner *sc, unsigned long index) {
+    unsigned long granule;
+    int node;
+
+    if (numa_map.node == NULL)
+        return index / sc->shard_pages;
 
+    granule = index / NUMA_GRANULE_PAGES;
+    node = numa_map.node[granule];
+    if (node >= 0 && numa_map.nr_node_shards[node] > 0)
+        return numa_map.node_shards[node][granule % numa_map.nr_node_shards[node]];
+
+    return granule % sc->task_queue->nr_shards;
+}
+
+/* index is the page number counted over the sorted block list */
+static void scanner_add_page(struct ram_scanner *sc, RAMBlock *block, ram_addr_t offset,
+                             unsigned long index) {
+    int cont;
+
+    /*
+     * stealing mode: the batches go to the shards in turn
+     * shard mode: a batch never spans two shards
+     */
+    if (sc->task_queue->steal) {
+        if (sc->body_len == 0)
+            sc->shard = (sc->shard + 1) % sc->task_queue->nr_shards;
+    } else if (sc->shard_pages) {
+        int shard = scanner_page_shard(sc, index);
+
+        if (sc->body_len > 0 && shard != sc->shard)
+            scanner_push_batch(sc);
+        sc->shard = shard;
+    }
+
+    if (block == sc->last_block)
+        cont = RAM_SAVE_FLAG_CONTINUE;
+    else {
+        sc->last_block = block;
+        cont = 0;
+    }
+
+    /*
+     * batch and add new task
+     */
+    sc->pages[sc->body_len].ptr = block->host + offset;
+    sc->pages[sc->body_len].block = (cont == 0 ? block : NULL);
+    sc->pages[sc->body_len].addr = offset;
+    sc->body_len ++;
+
+    if (sc->body_len >= queue_batch_len(sc->task_queue, sc->shard))
+        scanner_push_batch(sc);
+}
+
+/*
+ * [from, to) are page indexes inside the block
+ * whole bitmap words are fetched and cleared with one atomic op,
+ * the dirty pages inside a word are found with ctz
+ */
+static void scanner_scan_block(struct ram_scanner *sc, RAMBlock *block,
+                               unsigned long index, unsigned long from, unsigned long to) {
+    ram_addr_t base = block->offset >> TARGET_PAGE_BITS;
+    ram_addr_t page = base + from;
+    ram_addr_t end = base + to;
+    unsigned long word, mask, bits;
+    int bit;
+
+    while (page < end) {
+        word = MIGRATION_DIRTY_WORD(page);
+        mask = ~0UL << (page % HOST_LONG_BITS);
+        if (end - word * HOST_LONG_BITS < HOST_LONG_BITS)
+            mask &= ~0UL >> (HOST_LONG_BITS - end % HOST_LONG_BITS);
+
+        bits = migration_dirty_fetch_and_clear(word, mask);
+        if (hot.active)
+            bits = hot_filter(word, mask, bits);
+        while (bits) {
+            bit = __builtin_ctzl(bits);
+            bits &= bits - 1;
+            page = word * HOST_LONG_BITS + bit;
             /*
-             * batch and add new task
+             * without kvm the softmmu tlb has to be reset
+             * so that the next write marks the page dirty again
              */
-            if (body_len == 0) {
-                body = (struct task_body *)malloc(sizeof(struct task_body));
-                body->type = TASK_TYPE_MEM;
-                body->iter_num = task_queue->iter_num;
-            }
+            if (!kvm_enabled())
+                cpu_physical_memory_reset_dirty(page << TARGET_PAGE_BITS,
+                                                (page + 1) << TARGET_PAGE_BITS,
+                                                MIGRATION_DIRTY_FLAG);
+            scanner_add_page(sc, block, (page - base) << TARGET_PAGE_BITS,
+                             index + page - base);
+        }
 
-            if ((offset & 0xfff) != 0) 
-                fprintf(stderr, "error offset %lx, %p\n", offset, p);
+        page = (word + 1) * HOST_LONG_BITS;
+    }
+}
 
-            body->pages[body_len].ptr = p;
-            body->pages[body_len].block = (cont == 0 ? block : NULL);
-            body->pages[body_len].addr = offset;
-            body_len ++;
+static void *ram_scanner_thread(void *data) {
+    struct ram_scanner *sc = (struct ram_scanner *)data;
+    RAMBlock *block;
+    unsigned long base = 0;
 
-            if (body_len == DEFAULT_MEM_BATCH_LEN) {
-                body->len = body_len;
+    sc->last_block = NULL;
+    sc->pages = qemu_malloc(DEFAULT_MEM_BATCH_LEN * sizeof(struct task_page));
+    sc->body_len = 0;
 
-                //finish one batch, for next batch, the RAM_SAVE_FLAG_CONTINUE should not be set
-                last_block = NULL;
-                body_len = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long pages = block->length >> TARGET_PAGE_BITS;
+        unsigned long from, to;
 
-                if (queue_push_task(task_queue, body) < 0)
-                    fprintf(stderr, "Enqueue task error\n");
-            }
-        }
+        if (base >= sc->end_page)
+            break;
 
-        offset += TARGET_PAGE_SIZE;
-         
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            //hit the iteration end
-            if (!block) {
-                DPRINTF("Hit memory iteration end\n");
-                break;
-            }
+        if (base + pages > sc->start_page) {
+            from = (sc->start_page > base ? sc->start_page : base) - base;
+            to = (sc->end_page < base + pages ? sc->end_page : base + pages) - base;
+            scanner_scan_block(sc, block, base, from, to);
         }
 
-        current_addr = block->offset + offset;
-    } while (1);
+        base += pages;
+    }
 
     /*
      * handle last task this iteration
      */
-    if (body_len > 0) {
-        body->len = body_len;
+    if (sc->body_len > 0)
+        scanner_push_batch(sc);
 
-        if (queue_push_task(task_queue, body) < 0)
-            fprintf(stderr, "Enqueue task error\n");
+    qemu_free(sc->pages);
+    return NULL;
+}
+
+/*
+ * the scanner threads live as long as the migration, the master lets
+ * them scan a round and waits for the end of it at scan_pool.barr
+ */
+static struct {
+    struct ram_scanner scanners[MAX_SCAN_THREADS];
+    pthread_t tids[MAX_SCAN_THREADS];
+    pthread_barrier_t barr;
+    /* threads of the pool with the master, 0 without a pool */
+    int nr;
+    volatile int quit;
+} scan_pool;
+
+void ram_scanners_stop(void);
+
+static void *ram_scanner_loop(void *data) {
+    struct ram_scanner *sc = (struct ram_scanner *)data;
+
+    for (;;) {
+        pthread_barrier_wait(&scan_pool.barr);
+        if (scan_pool.quit)
+            break;
+        ram_scanner_thread(sc);
+        pthread_barrier_wait(&scan_pool.barr);
     }
 
-    return bytes_sent;
+    return NULL;
+}
+
+static void ram_scanners_start(void) {
+    int i;
+
+    //left from a cancelled migration
+    ram_scanners_stop();
+    if (nr_scanners <= 1)
+        return;
+
+    scan_pool.quit = 0;
+    pthread_barrier_init(&scan_pool.barr, NULL, nr_scanners);
+    for (i = 1; i < nr_scanners; i++)
+        pthread_create(&scan_pool.tids[i], NULL, ram_scanner_loop, &scan_pool.scanners[i]);
+    scan_pool.nr = nr_scanners;
+}
+
+/* called by the memory master once it scanned the last round */
+void ram_scanners_stop(void) {
+    int i;
+
+    if (scan_pool.nr == 0)
+        return;
+
+    scan_pool.quit = 1;
+    pthread_barrier_wait(&scan_pool.barr);
+    for (i = 1; i < scan_pool.nr; i++)
+        pthread_join(scan_pool.tids[i], NULL);
+    pthread_barrier_destroy(&scan_pool.barr);
+    scan_pool.nr = 0;
+}
+
+/*
+ * look up the node of every granule of the guest memory with move_pages,
+ * the guest may have touched new memory or the kernel moved it since
+ * the last iteration
+ */
+static void ram_numa_map_update(struct migration_task_queue *task_queue,
+                                unsigned long total_pages) {
+    RAMBlock *block;
+    unsigned long base = 0, nr = 0, granule;
+    int i, node;
+
+    if (numa_map.node == NULL) {
+        numa_map.nr_granules = (total_pages + NUMA_GRANULE_PAGES - 1) / NUMA_GRANULE_PAGES;
+        numa_map.node = qemu_malloc(numa_map.nr_granules);
+        numa_map.addr = qemu_malloc(numa_map.nr_granules * sizeof(void *));
+        numa_map.status = qemu_malloc(numa_map.nr_granules * sizeof(int));
+
+        for (i = 0; i < task_queue->nr_shards; i++) {
+            node = task_queue->shard_node[i];
+            if (node < 0)
+                continue;
+            numa_map.node_shards[node] = qemu_realloc(numa_map.node_shards[node],
+                                                      (numa_map.nr_node_shards[node] + 1) * sizeof(int));
+            numa_map.node_shards[node][numa_map.nr_node_shards[node]++] = i;
+        }
+    }
+
+    /* a granule across two blocks takes the node of its first page */
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long pages = block->length >> TARGET_PAGE_BITS;
+
+        for (granule = (base + NUMA_GRANULE_PAGES - 1) / NUMA_GRANULE_PAGES;
+             granule * NUMA_GRANULE_PAGES < base + pages &&
+                 nr < numa_map.nr_granules; granule++) {
+            numa_map.addr[nr++] = block->host +
+                ((granule * NUMA_GRANULE_PAGES - base) << TARGET_PAGE_BITS);
+        }
+
+        base += pages;
+    }
+
+    numa_page_nodes(numa_map.addr, numa_map.status, nr);
+    for (granule = 0; granule < numa_map.nr_granules; granule++)
+        numa_map.node[granule] = granule < nr ? numa_map.status[granule] : -1;
+}
+
+static unsigned long
+ram_save_block_master(struct migration_task_queue *task_queue, int last) {
+    struct ram_scanner *scanners = scan_pool.scanners;
+    unsigned long total_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
+    unsigned long range, shard_pages = 0;
+    //the scanners of the pool, or the master alone without one
+    int nr = scan_pool.nr ? scan_pool.nr : 1;
+    int i;
+
+    /*
+     * keep every range a multiple of SCAN_WORD_PAGES, a bitmap word
+     * shared by two scanners at a block boundary is cleared atomically
+     */
+    range = (total_pages + nr - 1) / nr;
+    range = (range + SCAN_WORD_PAGES - 1) & ~(SCAN_WORD_PAGES - 1);
+
+    /*
+     * shard mode: slave i owns the i-th of nr_shards equal page ranges,
+     * computed like the scanner ranges, so with as many scanners as
+     * slaves every scanner feeds exactly one shard
+     */
+    if (task_queue->nr_shards > 0) {
+        shard_pages = (total_pages + task_queue->nr_shards - 1) / task_queue->nr_shards;
+        shard_pages = (shard_pages + SCAN_WORD_PAGES - 1) & ~(SCAN_WORD_PAGES - 1);
+    }
+
+    if (task_queue->shard_node)
+        ram_numa_map_update(task_queue, total_pages);
+
+    hot_round_start(last);
+
+    for (i = 0; i < nr; i++) {
+        scanners[i].task_queue = task_queue;
+        scanners[i].shard_pages = shard_pages;
+        //in stealing mode the scanners start dealing at different shards
+        scanners[i].shard = task_queue->nr_shards > 0 ? i % task_queue->nr_shards : 0;
+        scanners[i].start_page = i * range;
+        scanners[i].end_page = (i + 1) * range;
+        if (scanners[i].end_page > total_pages)
+            scanners[i].end_page = total_pages;
+    }
+
+    //the master scans the first range itself
+    if (scan_pool.nr)
+        pthread_barrier_wait(&scan_pool.barr);
+
+    ram_scanner_thread(&scanners[0]);
+
+    if (scan_pool.nr)
+        pthread_barrier_wait(&scan_pool.barr);
+
+    DPRINTF("Hit memory iteration end\n");
+
+    return 0;
 }
 
 unsigned long ram_save_iter(int stage, struct migration_task_queue *task_queue, QEMUFile *f);
@@ -402,14 +1005,20 @@ unsigned long
 ram_save_iter(int stage, struct migration_task_queue *task_queue, QEMUFile *f) {
     unsigned long bytes_transferred = 0;
 
+    //numbers of the previous iteration
+    xbzrle_report();
+    hot_report(0);
+
     if (stage == 3) {
         /* flush all remaining blocks regardless of rate limiting */ 
-        bytes_transferred = ram_save_block_master(task_queue);
+        bytes_transferred = ram_save_block_master(task_queue, 1);
         DPRINTF("Total memory sent last iter %lx\n", bytes_transferred);
         cpu_physical_memory_set_dirty_tracking(0);
+        ram_scanners_stop();
+        hot_report(1);
     } else {
         /* try transferring iterative blocks of memory */
-        bytes_transferred = ram_save_block_master(task_queue);
+        bytes_transferred = ram_save_block_master(task_queue, 0);
     }
 
     return bytes_transferred;
@@ -479,6 +1088,22 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque) //opaque i
         DPRINTF("Finish memory negotiation start memory master, total memory %lx\n", 
                 ram_bytes_total());
 
+        //the cache is on only when this migration asks for it
+        xbzrle_cache_init(((FdMigrationState *)opaque)->para_config != NULL ?
+                          ((FdMigrationState *)opaque)->para_config->xbzrle_cache : 0);
+        /*
+         * the hot pages too, called anyway so none of a previous migration
+         * is left, post-copy sends the dirty pages of the first round after
+         * the switch
+         */
+        hot_init(((FdMigrationState *)opaque)->para_config != NULL &&
+                 !((FdMigrationState *)opaque)->para_config->postcopy ?
+                 ((FdMigrationState *)opaque)->para_config->hot_rounds : 0);
+        if (((FdMigrationState *)opaque)->para_config != NULL)
+            nr_scanners = ((FdMigrationState *)opaque)->para_config->num_scanners;
+        DPRINTF("Dirty bitmap scanned by %d threads\n", nr_scanners);
+        ram_scanners_start();
+
         create_host_memory_master(opaque);
 
         return 0;
@@ -681,6 +1306,60 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
              * now we release the page
              */
             release_page(vnum_p, mem_vnum);
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            void *host;
+            uint32_t mem_vnum = ((flags & MEM_VNUM_MASK) >> MEM_VNUM_OFFSET);
+            uint32_t curr_vnum;
+            volatile uint32_t *vnum_p;
+            unsigned long index = 0;
+            uint8_t encoded[XBZRLE_MAX_ENCODED];
+            int len;
+
+            host = host_from_stream_offset(f, addr, flags, &index);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be16(f);
+            if (len > XBZRLE_MAX_ENCODED) {
+                fprintf(stderr, "XBZRLE encoding too long %d\n", len);
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, encoded, len);
+
+            assert(index < se->total_size);
+            vnum_p = &(se->version_queue[index]);
+        re_check_xbzrle:
+            curr_vnum = *vnum_p;
+
+            /*
+             * some one is holding the page
+             */
+            while (curr_vnum % 2 == 1) {
+                curr_vnum = *vnum_p;
+            }
+
+            /*
+             * the delta is against the version sent in the previous
+             * iteration, a newer version makes it useless
+             */
+            if (curr_vnum > mem_vnum * 2) {
+                DPRINTF("skip xbzrle patch %d, %d\n", curr_vnum, mem_vnum * 2);
+                goto end;
+            }
+
+            if (hold_page(vnum_p, curr_vnum, mem_vnum)) {
+                /* fail holding the page */
+                goto re_check_xbzrle;
+            }
+
+            if (xbzrle_decode(encoded, len, host, TARGET_PAGE_SIZE) < 0) {
+                fprintf(stderr, "XBZRLE decode error at %lx\n", addr);
+                release_page(vnum_p, mem_vnum);
+                return -EINVAL;
+            }
+
+            release_page(vnum_p, mem_vnum);
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
             uint32_t mem_vnum = ((flags & MEM_VNUM_MASK) >> MEM_VNUM_OFFSET);
@@ -723,8 +1402,7 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
              */
             if (curr_vnum > mem_vnum * 2) {
                 /* the memory data is sent at host end so we must receive it */
-                uint8_t buf[TARGET_PAGE_SIZE];
-                qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+                qemu_skip_buffer(f, TARGET_PAGE_SIZE);
                 DPRINTF("skip page patch %d, %d\n", curr_vnum, mem_vnum * 2);
                 goto end;
             }
@@ -737,7 +1415,8 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 goto re_check_nor;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            //the part not buffered yet is received into the guest page
+            qemu_get_buffer_direct(f, host, TARGET_PAGE_SIZE);
 
             /*
              * now we release the page
@@ -754,6 +1433,512 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+/***********************************************************/
+/* classicsong post-copy, see migr-postcopy.h */
+
+/* end of the ram offsets, the size of the migration bitmap in pages */
+static ram_addr_t ram_last_page(void)
+{
+    RAMBlock *block;
+    ram_addr_t last = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next)
+        if (block->offset + block->length > last)
+            last = block->offset + block->length;
+
+    return last >> TARGET_PAGE_BITS;
+}
+
+unsigned long ram_postcopy_remaining(void);
+int ram_postcopy_claim(uint64_t addr);
+unsigned long ram_postcopy_save_page(QEMUFile *f, uint64_t addr, uint8_t *p);
+void ram_postcopy_put_eos(QEMUFile *f);
+void ram_postcopy_save_map(QEMUFile *f);
+void ram_postcopy_push(struct migration_task_queue *task_queue,
+                       struct migration_barrier *barr);
+
+/* source: pages nobody took yet, their migration bits are still set */
+unsigned long ram_postcopy_remaining(void)
+{
+    return ram_save_remaining();
+}
+
+/* source: take the page at addr, 0 if it is taken already */
+int ram_postcopy_claim(uint64_t addr)
+{
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+
+    if (page >= ram_last_page())
+        return 0;
+
+    return migration_dirty_fetch_and_clear(MIGRATION_DIRTY_WORD(page),
+                                           1UL << (page % HOST_LONG_BITS)) != 0;
+}
+
+/* source: p is the page at addr, NULL to look it up */
+unsigned long ram_postcopy_save_page(QEMUFile *f, uint64_t addr, uint8_t *p)
+{
+    if (p == NULL)
+        p = qemu_get_ram_ptr(addr);
+
+    qemu_put_be64(f, addr);
+    qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+
+    return TARGET_PAGE_SIZE;
+}
+
+void ram_postcopy_put_eos(QEMUFile *f)
+{
+    qemu_put_be64(f, POSTCOPY_EOS);
+}
+
+/*
+ * source: the blocks with their ram offsets and the migration bitmap,
+ * the set pages are the ones the dest drops
+ */
+void ram_postcopy_save_map(QEMUFile *f)
+{
+    RAMBlock *block;
+    ram_addr_t nr_pages = ram_last_page();
+    ram_addr_t word;
+    int nr_blocks = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next)
+        nr_blocks++;
+
+    qemu_put_be32(f, nr_blocks);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->offset);
+        qemu_put_be64(f, block->length);
+    }
+
+    qemu_put_be64(f, nr_pages);
+    for (word = 0; word < MIGRATION_DIRTY_WORDS(nr_pages); word++)
+        qemu_put_be64(f, ram_list.migration_dirty[word]);
+
+    DPRINTF("post-copy map of %d blocks, %lx pages left\n", nr_blocks,
+            (unsigned long)ram_save_remaining());
+}
+
+static void postcopy_push_batch(struct migration_task_queue *task_queue,
+                                struct task_page *pages, int len, int shard) {
+    struct task_body *body;
+
+    body = task_body_new(TASK_TYPE_MEM, len, task_queue->iter_num);
+    memcpy(body->pages, pages, len * sizeof(struct task_page));
+    body->len = len;
+
+    if (queue_push_task_shard(task_queue, shard, body) < 0)
+        fprintf(stderr, "Enqueue post-copy task error\n");
+}
+
+/*
+ * source: queue the pages left to the slaves but slave 0, in batches of
+ * POSTCOPY_BATCH_LEN and at most two batches per slave ahead, so a fault
+ * moves the push before long
+ */
+void ram_postcopy_push(struct migration_task_queue *task_queue,
+                       struct migration_barrier *barr)
+{
+    struct task_page pages[POSTCOPY_BATCH_LEN];
+    ram_addr_t nr_pages = ram_last_page();
+    ram_addr_t page = 0, word;
+    unsigned long bits, hint, nr_faults = 0;
+    int len = 0, shard = 0, bit;
+
+    while (ram_save_remaining() > 0) {
+        hint = __sync_lock_test_and_set(&barr->fault_hint, 0);
+        //go on after the faulting page, slave 0 sends that one
+        if (hint) {
+            page = hint;
+            nr_faults++;
+        }
+        if (page >= nr_pages)
+            page = 0;
+
+        word = MIGRATION_DIRTY_WORD(page);
+        bits = migration_dirty_fetch_and_clear(word, ~0UL << (page % HOST_LONG_BITS));
+        while (bits) {
+            bit = __builtin_ctzl(bits);
+            bits &= bits - 1;
+            page = word * HOST_LONG_BITS + bit;
+
+            pages[len].addr = page << TARGET_PAGE_BITS;
+            pages[len].ptr = qemu_get_ram_ptr(page << TARGET_PAGE_BITS);
+            pages[len].block = NULL;
+            if (++len < POSTCOPY_BATCH_LEN)
+                continue;
+
+            queue_wait_space(task_queue, 2 * (barr->nr_slaves - 1));
+            if (task_queue->nr_shards > 1)
+                shard = shard % (task_queue->nr_shards - 1) + 1;
+            postcopy_push_batch(task_queue, pages, len, shard);
+            len = 0;
+        }
+
+        page = (word + 1) * HOST_LONG_BITS;
+    }
+
+    if (len > 0) {
+        if (task_queue->nr_shards > 1)
+            shard = shard % (task_queue->nr_shards - 1) + 1;
+        postcopy_push_batch(task_queue, pages, len, shard);
+    }
+
+    DPRINTF("post-copy pages queued, moved to %lu faults\n", nr_faults);
+    barr->postcopy_pushed = 1;
+    task_event_notify(&barr->event);
+}
+
+/*
+ * dest: the source blocks mapped to the blocks here, the pages dropped
+ * and not placed yet, and the ones asked for, by source page
+ */
+struct postcopy_block {
+    RAMBlock *block;
+    ram_addr_t offset;
+};
+
+static struct {
+    int nr_blocks;
+    struct postcopy_block *blocks;
+    ram_addr_t nr_pages;
+    unsigned long *missing;
+    unsigned long *requested;
+    volatile long remaining;
+    int uffd;
+    int req_fd;
+    /* 0 until the guest memory is registered, -1 if that failed */
+    volatile int state;
+    struct task_event event;
+    pthread_t fault_tid;
+    /* the fault thread and the disk filter share req_fd */
+    pthread_mutex_t req_lock;
+} postcopy = {
+    .req_fd = -1,
+    .req_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void postcopy_set_channel(int fd);
+int ram_postcopy_load_map(QEMUFile *f);
+int ram_postcopy_start(void);
+void ram_postcopy_cancel(void);
+int ram_postcopy_load(QEMUFile *f, int fd);
+
+//from block-migration.c
+extern long blk_postcopy_remaining(void);
+extern int blk_postcopy_load_chunk(QEMUFile *f, uint64_t key);
+
+/* dest: the connection of slave 0, where the faults are asked for */
+void postcopy_set_channel(int fd)
+{
+    postcopy.req_fd = fd;
+}
+
+/* dest: ask slave 0 for a page or, with POSTCOPY_DISK, a disk chunk */
+int postcopy_send_request(uint64_t key)
+{
+    uint64_t req = cpu_to_be64(key);
+    int ret = 0;
+
+    pthread_mutex_lock(&postcopy.req_lock);
+    if (write(postcopy.req_fd, &req, sizeof(req)) != sizeof(req))
+        ret = -EIO;
+    pthread_mutex_unlock(&postcopy.req_lock);
+
+    if (ret < 0)
+        fprintf(stderr, "post-copy request of %lx failed\n", (unsigned long)key);
+    return ret;
+}
+
+static void *postcopy_host(ram_addr_t addr)
+{
+    int i;
+
+    for (i = 0; i < postcopy.nr_blocks; i++)
+        if (addr - postcopy.blocks[i].offset < postcopy.blocks[i].block->length)
+            return postcopy.blocks[i].block->host + (addr - postcopy.blocks[i].offset);
+
+    return NULL;
+}
+
+/* dest: the map of ram_postcopy_save_map */
+int ram_postcopy_load_map(QEMUFile *f)
+{
+    RAMBlock *block;
+    char id[256];
+    ram_addr_t word, length;
+    uint8_t len;
+    int i;
+
+    task_event_init(&postcopy.event);
+    postcopy.nr_blocks = qemu_get_be32(f);
+    postcopy.blocks = qemu_mallocz(postcopy.nr_blocks * sizeof(struct postcopy_block));
+    for (i = 0; i < postcopy.nr_blocks; i++) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        postcopy.blocks[i].offset = qemu_get_be64(f);
+        length = qemu_get_be64(f);
+
+        QLIST_FOREACH(block, &ram_list.blocks, next)
+            if (!strncmp(id, block->idstr, sizeof(id)))
+                break;
+
+        if (block == NULL || block->length != length) {
+            fprintf(stderr, "post-copy block %s does not match\n", id);
+            postcopy.state = -1;
+            return -EINVAL;
+        }
+        postcopy.blocks[i].block = block;
+    }
+
+    postcopy.nr_pages = qemu_get_be64(f);
+    postcopy.missing = qemu_mallocz(MIGRATION_DIRTY_WORDS(postcopy.nr_pages) * sizeof(unsigned long));
+    postcopy.requested = qemu_mallocz(MIGRATION_DIRTY_WORDS(postcopy.nr_pages) * sizeof(unsigned long));
+    postcopy.remaining = 0;
+    for (word = 0; word < MIGRATION_DIRTY_WORDS(postcopy.nr_pages); word++) {
+        postcopy.missing[word] = qemu_get_be64(f);
+        postcopy.remaining += __builtin_popcountl(postcopy.missing[word]);
+    }
+
+    postcopy.state = qemu_file_has_error(f) ? -1 : 0;
+    DPRINTF("post-copy of %ld pages\n", postcopy.remaining);
+
+    return postcopy.state < 0 ? -EIO : 0;
+}
+
+#ifdef HAVE_USERFAULTFD
+/* a guest access to host stopped at a page not placed */
+static void postcopy_fault(void *host)
+{
+    ram_addr_t addr = 0, page;
+    unsigned long mask;
+    int i;
+
+    for (i = 0; i < postcopy.nr_blocks; i++) {
+        RAMBlock *block = postcopy.blocks[i].block;
+
+        if ((uint8_t *)host >= block->host && (uint8_t *)host < block->host + block->length) {
+            addr = postcopy.blocks[i].offset + ((uint8_t *)host - block->host);
+            break;
+        }
+    }
+    if (i == postcopy.nr_blocks)
+        return;
+
+    /*
+     * a page not dropped and not there is one of zeroes, the dropped ones
+     * are asked for once, the bit is cleared only after UFFDIO_COPY
+     */
+    page = addr >> TARGET_PAGE_BITS;
+    mask = 1UL << (page % HOST_LONG_BITS);
+    if (!(postcopy.missing[MIGRATION_DIRTY_WORD(page)] & mask)) {
+        uffd_zeropage(postcopy.uffd, host, TARGET_PAGE_SIZE);
+        return;
+    }
+
+    if (__sync_fetch_and_or(&postcopy.requested[MIGRATION_DIRTY_WORD(page)], mask) & mask)
+        return;
+
+    postcopy_send_request(addr);
+}
+
+static void *postcopy_fault_thread(void *data)
+{
+    struct uffd_msg msg[16];
+    struct pollfd pfd;
+    unsigned long nr_faults = 0;
+    int i, n;
+
+    pfd.fd = postcopy.uffd;
+    pfd.events = POLLIN;
+
+    while (postcopy.remaining > 0) {
+        if (poll(&pfd, 1, POSTCOPY_POLL_MS) <= 0)
+            continue;
+
+        n = read(postcopy.uffd, msg, sizeof(msg));
+        for (i = 0; i < n / (int)sizeof(msg[0]); i++) {
+            if (msg[i].event != UFFD_EVENT_PAGEFAULT)
+                continue;
+            postcopy_fault((void *)(unsigned long)
+                           (msg[i].arg.pagefault.address & ~(uint64_t)(TARGET_PAGE_SIZE - 1)));
+            nr_faults++;
+        }
+    }
+
+    //closing it unregisters the guest memory
+    close(postcopy.uffd);
+    DPRINTF("post-copy done, %lu faults\n", nr_faults);
+    return NULL;
+}
+#endif
+
+/*
+ * dest: called before the guest resumes, once every slave got the map or
+ * EOF, drop the pages left and register the guest memory
+ */
+int ram_postcopy_start(void)
+{
+#ifdef HAVE_USERFAULTFD
+    ram_addr_t page, run;
+    int i, ret;
+#endif
+
+    if (postcopy.state < 0)
+        return -1;
+    //no page left, the slaves may only have disk chunks to place
+    if (postcopy.missing == NULL) {
+        postcopy.state = 1;
+        task_event_notify(&postcopy.event);
+        return 0;
+    }
+
+#ifdef HAVE_USERFAULTFD
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "post-copy needs host pages of %d bytes\n", TARGET_PAGE_SIZE);
+        goto fail;
+    }
+
+    for (i = 0; i < postcopy.nr_blocks; i++) {
+        RAMBlock *block = postcopy.blocks[i].block;
+        ram_addr_t first = postcopy.blocks[i].offset >> TARGET_PAGE_BITS;
+        ram_addr_t end = first + (block->length >> TARGET_PAGE_BITS);
+
+        for (page = first; page < end; page += run) {
+            for (run = 0; page + run < end &&
+                     (postcopy.missing[MIGRATION_DIRTY_WORD(page + run)] &
+                      (1UL << ((page + run) % HOST_LONG_BITS))); run++)
+                ;
+            if (run == 0) {
+                run = 1;
+                continue;
+            }
+            qemu_madvise(block->host + ((page - first) << TARGET_PAGE_BITS),
+                         run << TARGET_PAGE_BITS, QEMU_MADV_DONTNEED);
+        }
+    }
+
+    postcopy.uffd = uffd_open();
+    if (postcopy.uffd < 0) {
+        fprintf(stderr, "userfaultfd error %d\n", -postcopy.uffd);
+        goto fail;
+    }
+
+    for (i = 0; i < postcopy.nr_blocks; i++) {
+        RAMBlock *block = postcopy.blocks[i].block;
+
+        ret = uffd_register(postcopy.uffd, block->host, block->length);
+        if (ret < 0) {
+            fprintf(stderr, "userfaultfd can not register block %s: %d\n",
+                    block->idstr, -ret);
+            close(postcopy.uffd);
+            goto fail;
+        }
+    }
+
+    pthread_create(&postcopy.fault_tid, NULL, postcopy_fault_thread, NULL);
+    postcopy.state = 1;
+    task_event_notify(&postcopy.event);
+    DPRINTF("post-copy started, %ld pages left\n", postcopy.remaining);
+    return 0;
+
+fail:
+#else
+    fprintf(stderr, "post-copy needs userfaultfd\n");
+#endif
+    postcopy.state = -1;
+    task_event_notify(&postcopy.event);
+    return -1;
+}
+
+/* dest: the disks could not be set up, the slaves give up */
+void ram_postcopy_cancel(void)
+{
+    postcopy.state = -1;
+    task_event_notify(&postcopy.event);
+}
+
+/*
+ * dest: place the pages and disk chunks a slave receives after the
+ * switch, the slave asking for the faults also waits for the fault thread
+ * to end and for the last chunk
+ */
+int ram_postcopy_load(QEMUFile *f, int fd)
+{
+    uint64_t addr;
+#ifdef HAVE_USERFAULTFD
+    ram_addr_t page;
+    unsigned long mask;
+    void *host;
+#endif
+    uint8_t *buf;
+    int seq, ret = 0;
+
+    for (;;) {
+        seq = task_event_prepare(&postcopy.event);
+        if (postcopy.state != 0)
+            break;
+        task_event_wait(&postcopy.event, seq, TASK_EVENT_TIMEOUT_NS);
+    }
+    if (postcopy.state < 0)
+        return -1;
+
+    buf = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    while ((addr = qemu_get_be64(f)) != POSTCOPY_EOS) {
+        if (addr & POSTCOPY_DISK) {
+            ret = blk_postcopy_load_chunk(f, addr);
+            if (ret < 0)
+                break;
+            continue;
+        }
+
+#ifdef HAVE_USERFAULTFD
+        host = postcopy_host(addr);
+        if (qemu_file_has_error(f) || host == NULL) {
+            fprintf(stderr, "bad post-copy page %lx\n", (unsigned long)addr);
+            ret = -EINVAL;
+            break;
+        }
+
+        qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+        ret = uffd_copy(postcopy.uffd, host, buf, TARGET_PAGE_SIZE);
+        if (ret < 0 && ret != -EEXIST) {
+            fprintf(stderr, "post-copy of page %lx failed %d\n", (unsigned long)addr, -ret);
+            break;
+        }
+        ret = 0;
+
+        page = addr >> TARGET_PAGE_BITS;
+        mask = 1UL << (page % HOST_LONG_BITS);
+        if (__sync_fetch_and_and(&postcopy.missing[MIGRATION_DIRTY_WORD(page)], ~mask) & mask)
+            __sync_fetch_and_sub(&postcopy.remaining, 1);
+#else
+        fprintf(stderr, "post-copy page %lx without userfaultfd\n", (unsigned long)addr);
+        ret = -EINVAL;
+        break;
+#endif
+    }
+    qemu_vfree(buf);
+
+    if (ret < 0 || fd != postcopy.req_fd)
+        return ret;
+
+#ifdef HAVE_USERFAULTFD
+    //the fault thread writes to fd until the last page is placed
+    if (postcopy.missing)
+        pthread_join(postcopy.fault_tid, NULL);
+#endif
+    //and the disk filters until the last chunk is
+    while (blk_postcopy_remaining() > 0)
+        usleep(POSTCOPY_POLL_MS * 1000);
+
+    return ret;
+}
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
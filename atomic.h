@@ -1,3 +1,6 @@
+#ifndef QEMU_ATOMIC_H
+#define QEMU_ATOMIC_H
+
 typedef struct {
     volatile int counter;
 } atomic_t;
@@ -11,7 +14,7 @@ typedef struct {
  */
 static inline void atomic_add(int i, atomic_t *v)
 {
-    asm volatile("lock" "addl %1,%0"
+    asm volatile("lock " "addl %1,%0"
                  : "+m" (v->counter)
                  : "ir" (i));
 }
@@ -47,6 +50,18 @@ static inline void atomic_inc(atomic_t *v)
                  : "+m" (v->counter));
 }
 
+/**
+ * atomic_dec - decrement atomic variable
+ * @v: pointer of type atomic_t
+ *
+ * Atomically decrements @v by 1.
+ */
+static inline void atomic_dec(atomic_t *v)
+{
+    asm volatile("lock " "decl %0"
+                 : "+m" (v->counter));
+}
+
 static inline int atomic_read(atomic_t *v) 
 {
     return v->counter;
@@ -101,3 +116,41 @@ static inline int disk_spin_trylock(disk_spinlock_t *lock)
 {
     return !test_and_set_bit(1, lock);
 }
+
+/**
+ * atomic_add_long - add long integer to a long variable
+ * @i: integer value to add
+ * @p: pointer to the variable
+ *
+ * Atomically adds @i to *@p.
+ */
+static inline void atomic_add_long(long i, volatile unsigned long *p)
+{
+    asm volatile("lock; addq %1,%0"
+                 : "+m" (*p)
+                 : "er" (i) : "memory");
+}
+
+/**
+ * atomic_cmpxchg_long - compare and exchange a long variable
+ * @p: pointer to the variable
+ * @old: expected value
+ * @new: value to store
+ *
+ * Atomically stores @new into *@p if *@p equals @old.
+ * Returns the value of *@p before the operation.
+ * It also implies a memory barrier.
+ */
+static inline unsigned long atomic_cmpxchg_long(volatile unsigned long *p,
+                                                unsigned long old,
+                                                unsigned long new)
+{
+    unsigned long prev;
+
+    asm volatile("lock; cmpxchgq %2,%1"
+                 : "=a" (prev), "+m" (*p)
+                 : "r" (new), "0" (old) : "memory");
+    return prev;
+}
+
+#endif
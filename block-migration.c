@@ -21,15 +21,27 @@
 #include "migration.h"
 #include "blockdev.h"
 #include <assert.h>
+#include <signal.h>
 
 //classicsong
 #include "migr-vqueue.h"
+#include "migr-dup.h"
+#include "migr-postcopy.h"
+#include "block/migr-fetch.h"
 
 #define BLOCK_SIZE (BDRV_SECTORS_PER_DIRTY_CHUNK << BDRV_SECTOR_BITS)
 
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+/*
+ * classicsong
+ * a chunk of zeroes, nothing follows the device name
+ * the vnum takes the sector bits above the 3 flag bits, so it is a
+ * device block with the progress bit set
+ */
+#define BLK_MIG_FLAG_ZERO_BLOCK         (BLK_MIG_FLAG_DEVICE_BLOCK | \
+                                         BLK_MIG_FLAG_PROGRESS)
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -61,6 +73,7 @@ typedef struct BlkMigDevState {
     int64_t completed_sectors;
     int64_t total_sectors;
     int64_t dirty;
+    int index; /* in bmds_list, the device of a disk post-copy key */
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
     unsigned long *aio_bitmap;
 } BlkMigDevState;
@@ -88,6 +101,7 @@ typedef struct BlkMigState {
     int read_done;
     int transferred;
     int64_t total_sector_sum;
+    int nr_devs;
     int prev_progress;
     int bulk_completed;
     long double total_time;
@@ -96,6 +110,23 @@ typedef struct BlkMigState {
 
 static BlkMigState block_mig_state;
 
+/*
+ * classicsong
+ * the chunk buffers of the sync paths, on the source and on the dest,
+ * and the BlkMigBlock of the source come from pools. At most MAX_DATA_BUF
+ * of chunk buffers are out, zero chunks have no buffer, so there may be
+ * twice as many blocks
+ */
+#define DISK_CHUNK_POOL_MAX (MAX_DATA_BUF / BLOCK_SIZE)
+static struct migr_pool chunk_pool;
+static struct migr_pool blk_pool;
+
+static void blk_free(BlkMigBlock *blk) {
+    if (blk->buf)
+        pool_put(&chunk_pool, blk->buf);
+    pool_put(&blk_pool, blk);
+}
+
 uint64_t blk_read_remaining(void);
 
 uint64_t 
@@ -122,18 +153,20 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 }
 
 unsigned long disk_save_block_slave(void *ptr, int iter_num, QEMUFile *f);
+void disk_free_block_slave(void *ptr);
 //classicsong
 unsigned long
 disk_save_block_slave(void *ptr, int iter_num, QEMUFile *f) {
     int len;
     BlkMigBlock *blk = (BlkMigBlock *)ptr;
+    int flags = blk->buf ? BLK_MIG_FLAG_DEVICE_BLOCK : BLK_MIG_FLAG_ZERO_BLOCK;
 
     //DPRINTF("put disk data, %lx\n", blk->sector);
     /* sector number and flags 
      * and iter number (classicsong)
      */
     qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-		  | BLK_MIG_FLAG_DEVICE_BLOCK | (iter_num << DISK_VNUM_OFFSET));
+		  | flags | (iter_num << DISK_VNUM_OFFSET));
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
@@ -141,14 +174,24 @@ disk_save_block_slave(void *ptr, int iter_num, QEMUFile *f) {
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 //    DPRINTF("device name %s\n", blk->bmds->bs->device_name);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    /* zero chunk, only the header goes out */
+    if (blk->buf == NULL)
+        return 9 + len;
 
-    qemu_free(blk->buf);
-    qemu_free(blk);
+    /*
+     * the data is not copied, the slave frees the block with
+     * disk_free_block_slave after flushing f
+     */
+    qemu_put_buffer_async(f, blk->buf, BLOCK_SIZE);
 
     return BLOCK_SIZE;
 }
 
+void
+disk_free_block_slave(void *ptr) {
+    blk_free((BlkMigBlock *)ptr);
+}
+
 int blk_mig_active(void)
 {
     return !QSIMPLEQ_EMPTY(&block_mig_state.bmds_list);
@@ -374,6 +417,7 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
         bmds->total_sectors = sectors;
         bmds->completed_sectors = 0;
         bmds->shared_base = block_mig_state.shared_base;
+        bmds->index = block_mig_state.nr_devs++;
         alloc_aio_bitmap(bmds);
         drive_get_ref(drive_get_by_blockdev(bs));
         bdrv_set_in_use(bs, 1);
@@ -410,6 +454,7 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
     block_mig_state.read_done = 0;
     block_mig_state.transferred = 0;
     block_mig_state.total_sector_sum = 0;
+    block_mig_state.nr_devs = 0;
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
@@ -424,97 +469,328 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
 unsigned long total_disk_read = 0UL;
 unsigned long total_disk_put_task = 0UL;
 
+/*
+ * classicsong
+ * source disk read pipeline
+ * the disk master hands the chunks to read to a pool of reader threads and
+ * keeps up to depth reads in flight. Every chunk that lands is put into the
+ * current task body, so the slaves send it while the next reads are still
+ * on the disk. bdrv_aio_readv completes only in the main loop, hence the
+ * threads doing bdrv_read
+ */
+#define DISK_READ_RING_SLOTS 64 /* power of two above MAX_DISK_READ_DEPTH */
+
+static struct blk_read_pipe {
+    struct task_ring req;   /* master -> readers */
+    struct task_ring done;  /* readers -> master */
+    struct task_event req_event;
+    struct task_event done_event;
+    pthread_t *readers;
+    int nr_readers;
+    volatile int stop;
+    /* owned by the disk master */
+    int inflight;
+    /* full bodies queued before the disk master waits for the slaves */
+    unsigned long max_pending;
+    int error;
+    /* post-copy push: a chunk failing to read is sent as lost */
+    int postcopy;
+    unsigned long nr_chunks;
+    unsigned long nr_zero;
+    struct task_body *body;
+    struct migration_task_queue *task_q;
+} read_pipe;
+
+/*
+ * the image formats update their metadata on the fly, so they are read by
+ * one thread at a time, the raw drivers by several readers
+ */
+static pthread_mutex_t blk_format_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int blk_raw_format(BlkMigDevState *bmds) {
+    const char *format = bmds->bs->drv->format_name;
+
+    return !strcmp(format, "raw") || !strcmp(format, "file") ||
+        !strcmp(format, "host_device");
+}
+
+/* the fault reads of the disk post-copy run next to the readers */
+static int blk_read_chunk(BlkMigDevState *bmds, int64_t sector, uint8_t *buf,
+                          int nr_sectors) {
+    int raw = blk_raw_format(bmds);
+    int ret;
+
+    if (!raw)
+        pthread_mutex_lock(&blk_format_lock);
+    ret = bdrv_read(bmds->bs, sector, buf, nr_sectors);
+    if (!raw)
+        pthread_mutex_unlock(&blk_format_lock);
+
+    return ret;
+}
+
+/* a chunk of zeroes, checked a page at a time by is_dup_page */
+static int blk_is_zero(BlkMigBlock *blk) {
+    int len = blk->nr_sectors << BDRV_SECTOR_BITS;
+    int i;
+
+    for (i = 0; i + DUP_PAGE_SIZE <= len; i += DUP_PAGE_SIZE)
+        if (!is_dup_page(blk->buf + i, 0))
+            return 0;
+
+    for (; i < len; i++)
+        if (blk->buf[i])
+            return 0;
+
+    return 1;
+}
+
+static void *blk_reader(void *opaque) {
+    BlkMigBlock *blk;
+    sigset_t set;
+    int seq;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGIO);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    while (!read_pipe.stop) {
+        seq = task_event_prepare(&read_pipe.req_event);
+        if (task_ring_pop(&read_pipe.req, (void **)&blk) < 0) {
+            if (!read_pipe.stop)
+                task_event_wait(&read_pipe.req_event, seq, TASK_EVENT_TIMEOUT_NS);
+            continue;
+        }
+
+        blk->time = qemu_get_clock_ns(rt_clock);
+        blk->ret = blk_read_chunk(blk->bmds, blk->sector, blk->buf, blk->nr_sectors);
+        blk->time = qemu_get_clock_ns(rt_clock) - blk->time;
+
+        if (blk->ret >= 0 && blk_is_zero(blk)) {
+            pool_put(&chunk_pool, blk->buf);
+            blk->buf = NULL;
+        }
+
+        while (task_ring_push(&read_pipe.done, blk) < 0)
+            sched_yield();
+        task_event_notify(&read_pipe.done_event);
+    }
+
+    return NULL;
+}
+
+void blk_mig_start_readers(int nr_readers);
+void blk_mig_start_readers(int nr_readers) {
+    int i;
+
+    if (read_pipe.readers != NULL)
+        return;
+
+    task_ring_init(&read_pipe.req, DISK_READ_RING_SLOTS);
+    task_ring_init(&read_pipe.done, DISK_READ_RING_SLOTS);
+    task_event_init(&read_pipe.req_event);
+    task_event_init(&read_pipe.done_event);
+    read_pipe.stop = 0;
+    read_pipe.inflight = 0;
+    read_pipe.nr_readers = nr_readers;
+    read_pipe.readers = (pthread_t *)malloc(nr_readers * sizeof(pthread_t));
+    for (i = 0; i < nr_readers; i++)
+        pthread_create(&read_pipe.readers[i], NULL, blk_reader, NULL);
+
+    DPRINTF("%d disk readers started\n", nr_readers);
+}
+
+static void blk_mig_stop_readers(void) {
+    int i;
+
+    if (read_pipe.readers == NULL)
+        return;
+
+    read_pipe.stop = 1;
+    task_event_notify(&read_pipe.req_event);
+    for (i = 0; i < read_pipe.nr_readers; i++)
+        pthread_join(read_pipe.readers[i], NULL);
+
+    free(read_pipe.readers);
+    free(read_pipe.req.slots);
+    free(read_pipe.done.slots);
+    read_pipe.readers = NULL;
+}
+
+/* reads in flight for bmds, see blk_raw_format */
+static int blk_read_depth(BlkMigDevState *bmds) {
+    return blk_raw_format(bmds) ? read_pipe.nr_readers : 1;
+}
+
+static void blk_read_begin(struct migration_task_queue *task_q) {
+    read_pipe.task_q = task_q;
+    read_pipe.body = task_body_new(TASK_TYPE_DISK, DEFAULT_DISK_BATCH_LEN, task_q->iter_num);
+    read_pipe.max_pending = MAX_TASK_PENDING;
+    read_pipe.error = 0;
+    read_pipe.postcopy = 0;
+    read_pipe.nr_chunks = 0;
+    read_pipe.nr_zero = 0;
+}
+
+/* put blk into the current task body, push the body when full */
+static void blk_read_put(BlkMigBlock *blk) {
+    unsigned long time_delta;
+
+    read_pipe.nr_chunks++;
+    if (blk->buf == NULL)
+        read_pipe.nr_zero++;
+
+    read_pipe.body->blocks[read_pipe.body->len++].ptr = blk;
+    if (read_pipe.body->len == DEFAULT_DISK_BATCH_LEN) {
+        time_delta = qemu_get_clock_ns(rt_clock);
+        queue_wait_space(read_pipe.task_q, read_pipe.max_pending);
+        if (queue_push_body(read_pipe.task_q, 0, read_pipe.body) < 0)
+            fprintf(stderr, "Enqueue task error\n");
+        read_pipe.body = task_body_new(TASK_TYPE_DISK, DEFAULT_DISK_BATCH_LEN,
+                                       read_pipe.task_q->iter_num);
+        total_disk_put_task += (qemu_get_clock_ns(rt_clock) - time_delta);
+    }
+}
+
+/*
+ * move the chunks that landed into the task bodies, a full body is
+ * pushed once the slaves have room for it
+ * if wait, sleep until at least one chunk landed
+ */
+static void blk_read_collect(int wait) {
+    BlkMigBlock *blk;
+    int seq, nr = 0;
+
+    for (;;) {
+        seq = task_event_prepare(&read_pipe.done_event);
+        while (task_ring_pop(&read_pipe.done, (void **)&blk) > 0) {
+            read_pipe.inflight--;
+            nr++;
+
+            if (blk->ret < 0) {
+                fprintf(stderr, "Error reading block device %s sector %"PRId64"\n",
+                        blk->bmds->bs->device_name, blk->sector);
+                //the chunk is claimed, nobody else sends it
+                if (read_pipe.postcopy) {
+                    pool_put(&chunk_pool, blk->buf);
+                    blk->buf = NULL;
+                    blk_read_put(blk);
+                    continue;
+                }
+                read_pipe.error = 1;
+                blk_free(blk);
+                continue;
+            }
+            total_disk_read += blk->time;
+            blk_read_put(blk);
+        }
+
+        if (nr > 0 || !wait)
+            return;
+        task_event_wait(&read_pipe.done_event, seq, TASK_EVENT_TIMEOUT_NS);
+    }
+}
+
+/*
+ * queue a read of the chunk at sector, at most depth reads are in flight
+ * the chunk is clean from now on, a guest write racing with the read
+ * dirties it again for the next iteration
+ * a chunk in a hole of the image is not read, it goes out as a zero chunk
+ */
+static void blk_read_submit(BlkMigDevState *bmds, int64_t sector, int depth) {
+    BlkMigBlock *blk;
+    int nr_sectors, n;
+
+    /* with depth 1 nothing is in flight below, as the formats want */
+    while (read_pipe.inflight >= depth)
+        blk_read_collect(1);
+
+    if (bmds->total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK)
+        nr_sectors = bmds->total_sectors - sector;
+    else
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+    blk = pool_get(&blk_pool);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    blk->done = 0;
+    blk->ret = 0;
+
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+
+    if (bdrv_is_hole(bmds->bs, sector, nr_sectors, &n) && n >= nr_sectors) {
+        blk->buf = NULL;
+        blk_read_put(blk);
+        return;
+    }
+
+    blk->buf = pool_get(&chunk_pool);
+
+    read_pipe.inflight++;
+    while (task_ring_push(&read_pipe.req, blk) < 0)
+        sched_yield();
+    task_event_notify(&read_pipe.req_event);
+
+    //pick up what already landed without waiting
+    blk_read_collect(0);
+}
+
+/*
+ * wait for the reads in flight and push the last partial task
+ * return -1 if a read failed
+ */
+static int blk_read_end(void) {
+    while (read_pipe.inflight > 0)
+        blk_read_collect(1);
+
+    DPRINTF("disk chunks queued %lu, zero %lu\n",
+            read_pipe.nr_chunks, read_pipe.nr_zero);
+
+    if (read_pipe.body->len != 0) {
+        DPRINTF("additional disk task %d\n", read_pipe.body->len);
+        queue_wait_space(read_pipe.task_q, read_pipe.max_pending);
+        if (queue_push_body(read_pipe.task_q, 0, read_pipe.body) < 0)
+            fprintf(stderr, "Enqueue task error\n");
+    } else
+        task_body_free(read_pipe.body);
+    read_pipe.body = NULL;
+
+    return read_pipe.error ? -1 : 0;
+}
+
 static unsigned long blk_mig_save_bulked_block_sync(Monitor *mon, QEMUFile *f, 
                                                     struct migration_task_queue *task_q)
 {
     int64_t completed_sector_sum = 0;
-    int64_t total_sectors;
     int64_t sector;
-    int nr_sectors;
     BlkMigDevState *bmds;
-    BlkMigBlock *blk;
     int progress;
+    int depth;
     unsigned long data_sent = 0;
-    struct task_body *body;
-    struct timespec sleep = {0, 100000000}; //sleep 100ms
-    unsigned long time_delta;
 
     monitor_printf(mon, "disk bulk, transfer all disk data\n");
 
-    body = (struct task_body *)malloc(sizeof(struct task_body));
-    body->type = TASK_TYPE_DISK;
-    body->len = 0;
-    body->iter_num = task_q->iter_num;
-
     DPRINTF("Start disk sync ops, first iteration\n");
+    blk_read_begin(task_q);
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        total_sectors = bmds->total_sectors;
-
         if (bmds->bulk_completed == 0) {
             if (bmds->shared_base) {
                 fprintf(stderr, "has not consider shared based case\n");
-                return 0;
+                break;
             }
 
+            depth = blk_read_depth(bmds);
             //DPRINTF("handle bmds %p, sector [%lx:%lx]\n", bmds, bmds->cur_sector, bmds->total_sectors);
             for (sector = bmds->cur_sector; sector < bmds->total_sectors;) {
-                if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                    nr_sectors = total_sectors - sector;
-                } else {
-                    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-                }
-
-                blk = qemu_malloc(sizeof(BlkMigBlock));
-                blk->buf = qemu_malloc(BLOCK_SIZE);
-                blk->bmds = bmds;
-                blk->sector = sector;
-                blk->nr_sectors = nr_sectors;
-                blk->done = 0;
-    
-
-                time_delta = qemu_get_clock_ns(rt_clock);
-                if (bdrv_read(bmds->bs, sector, blk->buf,
-                              nr_sectors) < 0) {
-                    fprintf(stderr, "Error reading block device");
-                    return -1;
-                }
-                total_disk_read += (qemu_get_clock_ns(rt_clock) - time_delta);
-
-                /*
-                 * classicsong create task
-                 */
-                body->blocks[body->len++].ptr = blk;
-                
-                bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-
-                if (body->len == DEFAULT_DISK_BATCH_LEN) {
-                    time_delta = qemu_get_clock_ns(rt_clock);
-                    while (task_q->task_pending > MAX_TASK_PENDING) {
-                        nanosleep(&sleep, NULL);
-                    }
-
-                    if (queue_push_task(task_q, body) < 0)
-                        fprintf(stderr, "Enqueue task error\n");
-
-                    body = (struct task_body *)malloc(sizeof(struct task_body));
-                    body->type = TASK_TYPE_DISK;
-                    body->len = 0;
-                    body->iter_num = task_q->iter_num;
-                    total_disk_put_task += (qemu_get_clock_ns(rt_clock) - time_delta);
-                }
+                blk_read_submit(bmds, sector, depth);
 
                 sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
                 bmds->cur_dirty = sector;
             }
-
-            if (body->len != 0) {
-                DPRINTF("additional disk task %d\n", body->len);
-                if (queue_push_task(task_q, body) < 0)
-                    fprintf(stderr, "Enqueue task error\n");
-            } else {
-                free(body);
-            }
         }
 
         bmds->bulk_completed = 1;
@@ -542,6 +818,9 @@ static unsigned long blk_mig_save_bulked_block_sync(Monitor *mon, QEMUFile *f,
         */
     }
 
+    if (blk_read_end() < 0)
+        qemu_file_set_error(f);
+
     block_mig_state.bulk_completed = 1;
 
     return data_sent;
@@ -761,13 +1040,50 @@ static int is_stage2_completed(void)
     return 0;
 }
 
+/*
+ * classicsong
+ * disk post-copy, see migr-postcopy.h
+ * the chunks left by device, in the order of bmds_list, on the source the
+ * ones nobody took yet, on the dest the ones that did not arrive yet
+ */
+struct blk_postcopy_dev {
+    BlkMigDevState *bmds; /* source */
+    BlockDriverState *bs;
+    int64_t total_sectors;
+    int64_t nr_chunks;
+    unsigned long *missing;
+};
+
+static struct {
+    int nr_devs;
+    struct blk_postcopy_dev *devs;
+    volatile long remaining;
+} blk_postcopy;
+
+#define BLK_WORD_BITS (sizeof(unsigned long) * 8)
+#define BLK_CHUNK_WORDS(nr_chunks) (((nr_chunks) + BLK_WORD_BITS - 1) / BLK_WORD_BITS)
+
+static void blk_postcopy_free_map(void)
+{
+    int i;
+
+    for (i = 0; i < blk_postcopy.nr_devs; i++)
+        qemu_free(blk_postcopy.devs[i].missing);
+    qemu_free(blk_postcopy.devs);
+    blk_postcopy.devs = NULL;
+    blk_postcopy.nr_devs = 0;
+}
+
 static void blk_mig_cleanup(Monitor *mon)
 {
     BlkMigDevState *bmds;
     BlkMigBlock *blk;
 
+    blk_mig_stop_readers();
     set_dirty_tracking(0);
 
+    blk_postcopy_free_map();
+
     while ((bmds = QSIMPLEQ_FIRST(&block_mig_state.bmds_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.bmds_list, entry);
         bdrv_set_in_use(bmds->bs, 0);
@@ -818,10 +1134,7 @@ flush_blks_master(struct migration_task_queue *task_q, QEMUFile *f, int last) {
     else if (block_mig_state.read_done < DEFAULT_DISK_BATCH_MIN_LEN)
         return 0;
 
-    body = (struct task_body *)malloc(sizeof(struct task_body));
-    body->type = TASK_TYPE_DISK;
-    body->len = 0;
-    body->iter_num = task_q->iter_num;
+    body = task_body_new(TASK_TYPE_DISK, DEFAULT_DISK_BATCH_LEN, task_q->iter_num);
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
         if (blk->ret < 0) {
@@ -841,7 +1154,7 @@ flush_blks_master(struct migration_task_queue *task_q, QEMUFile *f, int last) {
             break;
     }
 
-    if (queue_push_task(task_q, body) < 0)
+    if (queue_push_body(task_q, 0, body) < 0)
         fprintf(stderr, "Enqueue task error\n");
 
     DPRINTF("%s Exit submitted %d read_done %d transferred %d\n", __FUNCTION__,
@@ -857,23 +1170,16 @@ flush_blks_master(struct migration_task_queue *task_q, QEMUFile *f, int last) {
 static int 
 mig_save_device_dirty_sync(Monitor *mon, QEMUFile *f,
                            BlkMigDevState *bmds, struct migration_task_queue *task_q) {
-    BlkMigBlock *blk;
-    int64_t total_sectors = bmds->total_sectors;
     int64_t sector;
-    int nr_sectors;
     unsigned long data_sent = 0;
-    struct task_body *body;
-    struct timespec sleep = {0, 100000000}; //sleep 100ms
+    int depth = blk_read_depth(bmds);
 
     monitor_printf(mon, "last iteration for disk");
     //data_sent += flush_blks_master(task_q, f, 1);
 
-    body = (struct task_body *)malloc(sizeof(struct task_body));
-    body->type = TASK_TYPE_DISK;
-    body->len = 0;
-    body->iter_num = task_q->iter_num;
-
     DPRINTF("Start disk sync ops, last iteration\n");
+    blk_read_begin(task_q);
+
     /*
      * the for loop will handle all dirty pages in this sector
      */
@@ -883,57 +1189,16 @@ mig_save_device_dirty_sync(Monitor *mon, QEMUFile *f,
             qemu_aio_flush();
         }
         if (bdrv_get_dirty(bmds->bs, sector)) {
-
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = qemu_malloc(sizeof(BlkMigBlock));
-            blk->buf = qemu_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-            blk->done = 0;
-    
-            if (bdrv_read(bmds->bs, sector, blk->buf,
-                          nr_sectors) < 0) {
-                fprintf(stderr, "Error reading block device");
-                return -1;
-            }
-     
-            /*
-             * classicsong create task
-             */
-            body->blocks[body->len++].ptr = blk;
-
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+            blk_read_submit(bmds, sector, depth);
             data_sent += BLOCK_SIZE;
-
-            if (body->len == DEFAULT_DISK_BATCH_LEN) {
-                while (task_q->task_pending > MAX_TASK_PENDING) {
-                    nanosleep(&sleep, NULL);
-                }
-
-                if (queue_push_task(task_q, body) < 0)
-                    fprintf(stderr, "Enqueue task error\n");
-
-                body = (struct task_body *)malloc(sizeof(struct task_body));
-                body->type = TASK_TYPE_DISK;
-                body->len = 0;
-                body->iter_num = task_q->iter_num;
-            }
         }
 
         sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
         bmds->cur_dirty = sector;
     }
 
-    if (body->len != 0) {
-        if (queue_push_task(task_q, body) < 0)
-            fprintf(stderr, "Enqueue task error\n");
-    } else
-        free(body);
+    if (blk_read_end() < 0)
+        qemu_file_set_error(f);
             
     return data_sent;
 }
@@ -1014,6 +1279,242 @@ block_save_iter(int stage, Monitor *mon,
     return bytes_transferred;
 }
 
+
+unsigned long block_save_background(Monitor *mon, struct migration_task_queue *task_q,
+                                    QEMUFile *f, volatile int *stop, int max_pending);
+void blk_postcopy_prepare(void);
+void blk_postcopy_save_map(QEMUFile *f);
+long blk_postcopy_remaining(void);
+unsigned long blk_postcopy_save_chunk(QEMUFile *f, uint64_t key);
+unsigned long blk_postcopy_save_block(void *ptr, QEMUFile *f);
+void blk_postcopy_push(struct migration_task_queue *task_q,
+                       struct migration_barrier *barr);
+
+/*
+ * source: read the disks once while the memory iterates, until stop is
+ * set, with at most max_pending bodies queued so the slaves send the
+ * memory first. What is not read by then or dirtied since is left to
+ * the post-copy
+ */
+unsigned long
+block_save_background(Monitor *mon, struct migration_task_queue *task_q,
+                      QEMUFile *f, volatile int *stop, int max_pending) {
+    BlkMigDevState *bmds;
+    unsigned long data_sent = 0;
+    int depth;
+
+    monitor_printf(mon, "disk bulk in the background\n");
+    blk_read_begin(task_q);
+    read_pipe.max_pending = max_pending;
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        depth = blk_read_depth(bmds);
+        while (bmds->cur_sector < bmds->total_sectors && !*stop) {
+            blk_read_submit(bmds, bmds->cur_sector, depth);
+            bmds->cur_sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
+            data_sent += BLOCK_SIZE;
+        }
+
+        if (bmds->cur_sector >= bmds->total_sectors) {
+            bmds->cur_sector = bmds->completed_sectors = bmds->total_sectors;
+            bmds->bulk_completed = 1;
+        }
+        if (*stop)
+            break;
+    }
+
+    if (blk_read_end() < 0)
+        qemu_file_set_error(f);
+
+    DPRINTF("disk background read of %lx bytes%s\n", data_sent,
+            *stop ? ", stopped" : "");
+    return data_sent;
+}
+
+/* source: the guest is stopped, the chunks left are the map */
+void blk_postcopy_prepare(void) {
+    BlkMigDevState *bmds;
+    struct blk_postcopy_dev *d;
+    int64_t chunk, sector;
+
+    blk_postcopy.nr_devs = block_mig_state.nr_devs;
+    blk_postcopy.devs = qemu_mallocz(blk_postcopy.nr_devs * sizeof(struct blk_postcopy_dev));
+    blk_postcopy.remaining = 0;
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        d = &blk_postcopy.devs[bmds->index];
+        d->bmds = bmds;
+        d->bs = bmds->bs;
+        d->total_sectors = bmds->total_sectors;
+        d->nr_chunks = (bmds->total_sectors + BDRV_SECTORS_PER_DIRTY_CHUNK - 1) /
+            BDRV_SECTORS_PER_DIRTY_CHUNK;
+        d->missing = qemu_mallocz(BLK_CHUNK_WORDS(d->nr_chunks) * sizeof(unsigned long));
+
+        for (chunk = 0; chunk < d->nr_chunks; chunk++) {
+            sector = chunk * BDRV_SECTORS_PER_DIRTY_CHUNK;
+            if ((!bmds->bulk_completed && sector >= bmds->cur_sector) ||
+                bdrv_get_dirty(bmds->bs, sector)) {
+                d->missing[chunk / BLK_WORD_BITS] |= 1UL << (chunk % BLK_WORD_BITS);
+                blk_postcopy.remaining++;
+            }
+        }
+    }
+
+    DPRINTF("disk post-copy of %ld chunks\n", blk_postcopy.remaining);
+}
+
+/* source: name, sectors and the bitmap of the chunks left by device */
+void blk_postcopy_save_map(QEMUFile *f) {
+    struct blk_postcopy_dev *d;
+    int64_t word;
+    int i, len;
+
+    qemu_put_be32(f, blk_postcopy.nr_devs);
+    for (i = 0; i < blk_postcopy.nr_devs; i++) {
+        d = &blk_postcopy.devs[i];
+        len = strlen(d->bs->device_name);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)d->bs->device_name, len);
+        qemu_put_be64(f, d->total_sectors);
+        for (word = 0; word < BLK_CHUNK_WORDS(d->nr_chunks); word++)
+            qemu_put_be64(f, d->missing[word]);
+    }
+}
+
+long blk_postcopy_remaining(void) {
+    return blk_postcopy.remaining;
+}
+
+/* source: take the chunk, 0 if it is taken already */
+static int blk_postcopy_claim(int dev, int64_t chunk) {
+    struct blk_postcopy_dev *d;
+    unsigned long mask;
+
+    if (dev >= blk_postcopy.nr_devs)
+        return 0;
+    d = &blk_postcopy.devs[dev];
+    if (chunk < 0 || chunk >= d->nr_chunks)
+        return 0;
+
+    mask = 1UL << (chunk % BLK_WORD_BITS);
+    if (!(d->missing[chunk / BLK_WORD_BITS] & mask) ||
+        !(__sync_fetch_and_and(&d->missing[chunk / BLK_WORD_BITS], ~mask) & mask))
+        return 0;
+
+    __sync_fetch_and_sub(&blk_postcopy.remaining, 1);
+    return 1;
+}
+
+/*
+ * source, slave 0: read and send the chunk of key the dest asked for,
+ * unless it is taken already
+ */
+unsigned long blk_postcopy_save_chunk(QEMUFile *f, uint64_t key) {
+    struct blk_postcopy_dev *d;
+    int dev = POSTCOPY_KEY_DEV(key);
+    int64_t chunk = POSTCOPY_KEY_CHUNK(key);
+    int nr_sectors;
+    uint8_t *buf;
+
+    if (!blk_postcopy_claim(dev, chunk))
+        return 0;
+
+    d = &blk_postcopy.devs[dev];
+    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    if (d->total_sectors - chunk * BDRV_SECTORS_PER_DIRTY_CHUNK < nr_sectors)
+        nr_sectors = d->total_sectors - chunk * BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+    buf = pool_get(&chunk_pool);
+    //the chunk is claimed, the dest learns it is lost instead of waiting
+    if (blk_read_chunk(d->bmds, chunk * BDRV_SECTORS_PER_DIRTY_CHUNK, buf, nr_sectors) < 0) {
+        fprintf(stderr, "Error reading block device %s chunk %"PRId64"\n",
+                d->bs->device_name, chunk);
+        pool_put(&chunk_pool, buf);
+        qemu_put_be64(f, POSTCOPY_DISK_KEY(dev, chunk) | POSTCOPY_EIO);
+        return 8;
+    }
+
+    qemu_put_be64(f, POSTCOPY_DISK_KEY(dev, chunk));
+    qemu_put_buffer(f, buf, BLOCK_SIZE);
+    pool_put(&chunk_pool, buf);
+
+    return BLOCK_SIZE;
+}
+
+/*
+ * source, other slaves: a chunk of the disk master, sent by reference,
+ * freed with disk_free_block_slave after the flush
+ */
+unsigned long blk_postcopy_save_block(void *ptr, QEMUFile *f) {
+    BlkMigBlock *blk = (BlkMigBlock *)ptr;
+    uint64_t key = POSTCOPY_DISK_KEY(blk->bmds->index,
+                                     blk->sector / BDRV_SECTORS_PER_DIRTY_CHUNK);
+
+    //not read, see blk_read_collect
+    if (blk->ret < 0) {
+        qemu_put_be64(f, key | POSTCOPY_EIO);
+        return 8;
+    }
+
+    if (blk->buf == NULL) {
+        qemu_put_be64(f, key | POSTCOPY_ZERO);
+        return 8;
+    }
+
+    qemu_put_be64(f, key);
+    qemu_put_buffer_async(f, blk->buf, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+/*
+ * source: read the chunks left to the slaves but slave 0, two bodies per
+ * slave ahead, going on after the chunk asked for last
+ */
+void blk_postcopy_push(struct migration_task_queue *task_q,
+                       struct migration_barrier *barr) {
+    struct blk_postcopy_dev *d;
+    unsigned long nr_faults = 0;
+    uint64_t hint;
+    int64_t chunk = 0;
+    int dev = 0;
+
+    blk_read_begin(task_q);
+    read_pipe.max_pending = 2 * (barr->nr_slaves - 1);
+    read_pipe.postcopy = 1;
+
+    while (blk_postcopy.remaining > 0) {
+        hint = __sync_lock_test_and_set(&barr->disk_fault_hint, 0);
+        if (hint) {
+            dev = POSTCOPY_KEY_DEV(hint);
+            chunk = POSTCOPY_KEY_CHUNK(hint) + 1;
+            nr_faults++;
+        }
+        if (dev >= blk_postcopy.nr_devs) {
+            dev = 0;
+            chunk = 0;
+        }
+
+        d = &blk_postcopy.devs[dev];
+        if (chunk >= d->nr_chunks) {
+            dev = (dev + 1) % blk_postcopy.nr_devs;
+            chunk = 0;
+            continue;
+        }
+
+        if (blk_postcopy_claim(dev, chunk))
+            blk_read_submit(d->bmds, chunk * BDRV_SECTORS_PER_DIRTY_CHUNK,
+                            blk_read_depth(d->bmds));
+        chunk++;
+    }
+
+    if (blk_read_end() < 0)
+        fprintf(stderr, "Error reading the disk post-copy chunks\n");
+
+    DPRINTF("disk post-copy chunks queued, moved to %lu requests\n", nr_faults);
+    barr->disk_pushed = 1;
+    task_event_notify(&barr->event);
+}
+
 //modified by classicsong
 static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
@@ -1061,7 +1562,11 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     //return ((stage == 2) && is_stage2_completed());
 }
 
-unsigned long total_disk_write = 0UL;
+/*
+ * ns spent in bdrv_write and bytes written, summed over the disk writers
+ */
+volatile unsigned long total_disk_write = 0UL;
+volatile unsigned long total_disk_bytes = 0UL;
 extern struct migration_task_queue *reduce_q;
 
 int disk_write(void *bs_p, int64_t addr, void *buf_p, int nr_sectors);
@@ -1074,13 +1579,117 @@ disk_write(void *bs_p, int64_t addr, void *buf_p, int nr_sectors) {
 
     time_delta = qemu_get_clock_ns(rt_clock);
     ret = bdrv_write(bs, addr, buf, nr_sectors);
-    total_disk_write += (qemu_get_clock_ns(rt_clock) - time_delta);
+    atomic_add_long(qemu_get_clock_ns(rt_clock) - time_delta, &total_disk_write);
+    atomic_add_long((long)nr_sectors << BDRV_SECTOR_BITS, &total_disk_bytes);
 
-    qemu_free(buf);
+    pool_put(&chunk_pool, buf);
 
     return ret;
 };
 
+/*
+ * classicsong
+ * called by the writer of the chunk before writing it, the iterations
+ * overlap so an older version of the chunk may arrive after a newer one
+ * sent on another connection. version_queue holds the vnum + 1 of the last
+ * version taken, an older task is freed and 1 is returned. The versions of
+ * a chunk all go to one writer, so no lock is needed
+ */
+int disk_task_stale(struct disk_task *task);
+int
+disk_task_stale(struct disk_task *task) {
+    BlockDriverState *bs = task->bs;
+    uint32_t *vnum_p;
+
+    if (bs->version_queue == NULL)
+        return 0;
+
+    vnum_p = &bs->version_queue[task->addr];
+    if (*vnum_p > task->vnum) {
+        if (task->buf)
+            pool_put(&chunk_pool, task->buf);
+        free(task);
+        return 1;
+    }
+
+    *vnum_p = task->vnum + 1;
+    return 0;
+}
+
+/*
+ * write a zero chunk, nothing is written when the range already reads as
+ * zeroes, e.g. a freshly created sparse image
+ */
+static uint8_t zero_chunk[BLOCK_SIZE] __attribute__((aligned(4096)));
+
+int disk_write_zeroes(void *bs_p, int64_t addr, int nr_sectors);
+int
+disk_write_zeroes(void *bs_p, int64_t addr, int nr_sectors) {
+    BlockDriverState *bs = bs_p;
+    int ret, n;
+    unsigned long time_delta;
+
+    if (bdrv_is_hole(bs, addr, nr_sectors, &n) && n >= nr_sectors)
+        return 0;
+
+    time_delta = qemu_get_clock_ns(rt_clock);
+    ret = bdrv_write(bs, addr, zero_chunk, nr_sectors);
+    atomic_add_long(qemu_get_clock_ns(rt_clock) - time_delta, &total_disk_write);
+    atomic_add_long((long)nr_sectors << BDRV_SECTOR_BITS, &total_disk_bytes);
+
+    return ret;
+}
+
+/*
+ * write nr_sectors at addr from the chunk buffers in iov and put them back
+ */
+int disk_writev(void *bs_p, int64_t addr, struct iovec *iov, int niov, int nr_sectors);
+int
+disk_writev(void *bs_p, int64_t addr, struct iovec *iov, int niov, int nr_sectors) {
+    BlockDriverState *bs = bs_p;
+    void *bufs[DISK_COALESCE_CHUNKS];
+    QEMUIOVector qiov;
+    int i, ret;
+    unsigned long time_delta;
+
+    //the driver may move the iov bases on short writes
+    for (i = 0; i < niov; i++)
+        bufs[i] = iov[i].iov_base;
+
+    qemu_iovec_init_external(&qiov, iov, niov);
+    time_delta = qemu_get_clock_ns(rt_clock);
+    ret = bdrv_writev(bs, addr, &qiov, nr_sectors);
+    atomic_add_long(qemu_get_clock_ns(rt_clock) - time_delta, &total_disk_write);
+    atomic_add_long((long)nr_sectors << BDRV_SECTOR_BITS, &total_disk_bytes);
+
+    for (i = 0; i < niov; i++)
+        pool_put(&chunk_pool, bufs[i]);
+
+    return ret;
+}
+
+/*
+ * classicsong
+ * the disk writer of a chunk, the versions of a chunk always go to the same
+ * writer so they are written in order, and DISK_COALESCE_CHUNKS neighbours
+ * share the writer so it can merge them. Only the raw drivers write to the
+ * file in place, image formats update metadata on write, so all chunks of
+ * such a device go to one writer
+ */
+static int disk_chunk_writer(BlockDriverState *bs, int64_t addr) {
+    unsigned long key = (unsigned long)bs / sizeof(BlockDriverState);
+    const char *format = bs->drv->format_name;
+
+    if (reduce_q->nr_shards <= 1)
+        return 0;
+
+    if (!strcmp(format, "raw") || !strcmp(format, "file") ||
+        !strcmp(format, "host_device"))
+        key += addr / (BDRV_SECTORS_PER_DIRTY_CHUNK * DISK_COALESCE_CHUNKS);
+
+    return key % reduce_q->nr_shards;
+}
+
 static int block_load(QEMUFile *f, void *opaque, int version_id)
 {
     static int banner_printed;
@@ -1117,7 +1726,6 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
             //uint32_t curr_vnum;
             //volatile uint32_t *vnum_p;
             struct disk_task *task;
-            struct timespec sleep = {0, 10000000}; //sleep 10ms
 
             /* get device name */
             len = qemu_get_byte(f);
@@ -1151,9 +1759,12 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = qemu_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
+            if ((flags & BLK_MIG_FLAG_ZERO_BLOCK) == BLK_MIG_FLAG_ZERO_BLOCK) {
+                buf = NULL;
+            } else {
+                buf = pool_get(&chunk_pool);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+            }
 
             /*
         re_check_nor:
@@ -1183,10 +1794,10 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
             task->addr = addr;
             task->buf = buf;
             task->nr_sectors = nr_sectors;
-            while (reduce_q->task_pending > MAX_TASK_PENDING) 
-                nanosleep(&sleep, NULL);
+            task->vnum = iter_num;
+            queue_wait_space(reduce_q, MAX_TASK_PENDING);
 
-            queue_push_task(reduce_q, task);
+            queue_push_task_shard(reduce_q, disk_chunk_writer(bs, addr), task);
             /*
              * now we release the block
              */
@@ -1232,6 +1843,136 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+//from arch_init.c
+//from migration-master.c
+extern void dest_disk_wait(struct banner *banner);
+
+int blk_postcopy_load_map(QEMUFile *f);
+int blk_postcopy_start(struct banner *banner);
+int blk_postcopy_load_chunk(QEMUFile *f, uint64_t key);
+
+/* dest: the map of blk_postcopy_save_map */
+int blk_postcopy_load_map(QEMUFile *f) {
+    struct blk_postcopy_dev *d;
+    char device_name[256];
+    uint32_t nr_devs;
+    int64_t word;
+    int i, len;
+
+    nr_devs = qemu_get_be32(f);
+    if (nr_devs > POSTCOPY_MAX_DEVS) {
+        fprintf(stderr, "disk post-copy of %u devices\n", nr_devs);
+        return -EINVAL;
+    }
+
+    blk_postcopy.nr_devs = nr_devs;
+    blk_postcopy.devs = qemu_mallocz(blk_postcopy.nr_devs * sizeof(struct blk_postcopy_dev));
+    blk_postcopy.remaining = 0;
+    for (i = 0; i < blk_postcopy.nr_devs; i++) {
+        d = &blk_postcopy.devs[i];
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)device_name, len);
+        device_name[len] = '\0';
+        d->total_sectors = qemu_get_be64(f);
+        d->nr_chunks = (d->total_sectors + BDRV_SECTORS_PER_DIRTY_CHUNK - 1) /
+            BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+        d->bs = bdrv_find(device_name);
+        if (!d->bs || bdrv_getlength(d->bs) >> BDRV_SECTOR_BITS != d->total_sectors) {
+            fprintf(stderr, "Error block device %s does not match\n", device_name);
+            blk_postcopy_free_map();
+            return -EINVAL;
+        }
+
+        d->missing = qemu_mallocz(BLK_CHUNK_WORDS(d->nr_chunks) * sizeof(unsigned long));
+        for (word = 0; word < BLK_CHUNK_WORDS(d->nr_chunks); word++) {
+            d->missing[word] = qemu_get_be64(f);
+            blk_postcopy.remaining += __builtin_popcountl(d->missing[word]);
+        }
+    }
+
+    if (qemu_file_has_error(f)) {
+        blk_postcopy_free_map();
+        return -EIO;
+    }
+
+    DPRINTF("disk post-copy of %ld chunks\n", blk_postcopy.remaining);
+    return 0;
+}
+
+/* called in the main loop, under the lock of the filter */
+static int blk_postcopy_request(void *opaque, int64_t chunk) {
+    return postcopy_send_request(POSTCOPY_DISK_KEY((long)opaque, chunk));
+}
+
+static void blk_postcopy_free(void *buf) {
+    pool_put(&chunk_pool, buf);
+}
+
+/*
+ * dest: called before the guest resumes, once the chunks of the pre-copy
+ * are written, put the filter in front of the disks
+ */
+int blk_postcopy_start(struct banner *banner) {
+    struct blk_postcopy_dev *d;
+    int i;
+
+    if (blk_postcopy.nr_devs == 0)
+        return 0;
+
+    dest_disk_wait(banner);
+
+    for (i = 0; i < blk_postcopy.nr_devs; i++) {
+        d = &blk_postcopy.devs[i];
+        if (migr_fetch_attach(d->bs, d->missing, blk_postcopy_request,
+                              blk_postcopy_free, (void *)(long)i) < 0) {
+            fprintf(stderr, "can not fetch the chunks of %s\n", d->bs->device_name);
+            return -1;
+        }
+        d->missing = NULL;
+    }
+
+    return 0;
+}
+
+/* dest: a chunk of the post-copy stream, key is read already */
+int blk_postcopy_load_chunk(QEMUFile *f, uint64_t key) {
+    struct blk_postcopy_dev *d;
+    int dev = POSTCOPY_KEY_DEV(key);
+    int64_t chunk = POSTCOPY_KEY_CHUNK(key);
+    uint8_t *buf = NULL;
+
+    if (dev >= blk_postcopy.nr_devs || chunk >= blk_postcopy.devs[dev].nr_chunks) {
+        fprintf(stderr, "bad disk post-copy chunk %d:%"PRId64"\n", dev, chunk);
+        return -EINVAL;
+    }
+    d = &blk_postcopy.devs[dev];
+
+    if (key & POSTCOPY_EIO) {
+        fprintf(stderr, "disk post-copy chunk %d:%"PRId64" lost on the source\n",
+                dev, chunk);
+        if (d->bs->fetch != NULL)
+            migr_fetch_fail(d->bs, chunk);
+        __sync_fetch_and_sub(&blk_postcopy.remaining, 1);
+        return 0;
+    }
+
+    if (!(key & POSTCOPY_ZERO)) {
+        buf = pool_get(&chunk_pool);
+        qemu_get_buffer(f, buf, BLOCK_SIZE);
+    }
+
+    //the device was closed meanwhile
+    if (d->bs->fetch == NULL) {
+        if (buf)
+            pool_put(&chunk_pool, buf);
+    } else
+        migr_fetch_put(d->bs, chunk, buf);
+
+    __sync_fetch_and_sub(&blk_postcopy.remaining, 1);
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
 static void block_set_params(int blk_enable, int shared_base, void *opaque)
 {
     block_mig_state.blk_enable = blk_enable;
@@ -1246,6 +1987,9 @@ void blk_mig_init(void)
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
 
+    pool_init(&chunk_pool, BLOCK_SIZE, TARGET_PAGE_SIZE, DISK_CHUNK_POOL_MAX);
+    pool_init(&blk_pool, sizeof(BlkMigBlock), 0, 2 * DISK_CHUNK_POOL_MAX);
+
     register_savevm_live(NULL, "block", 0, 1, block_set_params,
                          block_save_live, NULL, block_load, &block_mig_state);
 }
@@ -994,6 +994,45 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
 
+/*
+ * synchronous write of a vector, every element holds whole sectors.
+ * Drivers without bdrv_writev get one bdrv_write per element
+ */
+int bdrv_writev(BlockDriverState *bs, int64_t sector_num,
+                QEMUIOVector *qiov, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+    int i, ret;
+
+    if (!bs->drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_writev) {
+        for (i = 0; i < qiov->niov; i++) {
+            int n = qiov->iov[i].iov_len >> BDRV_SECTOR_BITS;
+
+            ret = bdrv_write(bs, sector_num, qiov->iov[i].iov_base, n);
+            if (ret < 0)
+                return ret;
+            sector_num += n;
+        }
+        return 0;
+    }
+    if (bs->read_only)
+        return -EACCES;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
+        bs->wr_highest_sector = sector_num + nb_sectors - 1;
+    }
+
+    return drv->bdrv_writev(bs, sector_num, qiov, nb_sectors);
+}
+
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count1)
 {
@@ -1565,6 +1604,35 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Returns true iff the specified sector reads as zeroes without being stored:
+ * a hole of a sparse file, or a part of an image with no backing file that
+ * was never allocated. Drivers knowing neither are assumed to store all
+ * their sectors.
+ *
+ * 'pnum' is set like in bdrv_is_allocated.
+ */
+int bdrv_is_hole(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
+                 int *pnum)
+{
+    int64_t n;
+
+    if (!bs->drv) {
+        *pnum = 0;
+        return 0;
+    }
+    if (bs->drv->bdrv_is_hole) {
+        return bs->drv->bdrv_is_hole(bs, sector_num, nb_sectors, pnum);
+    }
+    if (bs->drv->bdrv_is_allocated && !bs->backing_hd) {
+        return !bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+    }
+
+    n = bs->total_sectors - sector_num;
+    *pnum = (n < 0) ? 0 : (n < nb_sectors) ? n : nb_sectors;
+    return 0;
+}
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read)
 {
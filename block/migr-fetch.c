@@ -0,0 +1,712 @@
+/*
+ * Block filter fetching the chunks of a disk on demand, for the disk
+ * post-copy of the migration destination
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * classicsong
+ * The guest resumes before the chunks of its disks left on the source
+ * arrived. migr_fetch_attach puts this driver in front of the image driver
+ * of bs, bs->opaque stays the one of the image. A request touching only
+ * chunks that are there goes straight to the image driver, the others wait
+ * here and the chunks they miss are asked for. The chunks arrive on the
+ * migration threads, a bottom half writes them to the image in the main
+ * loop and resubmits the requests that are complete then. A chunk is
+ * written only while it is missing and the guest writes to it wait for it,
+ * so the guest data is never overwritten by the older chunk of the source.
+ * A chunk the source failed to read, or that could not be asked for, stays
+ * missing and the requests on it fail with -EIO. Once the last chunk is written the image driver is put
+ * back.
+ * Snapshots, truncation and compressed writes are refused until then
+ */
+
+#include <pthread.h>
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "block_int.h"
+#include "block/migr-fetch.h"
+
+#define CHUNK_SECTORS BDRV_SECTORS_PER_DIRTY_CHUNK
+#define BITS_PER_WORD (sizeof(unsigned long) * 8)
+
+typedef struct MigrFetchState MigrFetchState;
+
+typedef struct MigrFetchChunk {
+    MigrFetchState *s;
+    int64_t chunk;
+    void *buf;
+    int failed;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    QSIMPLEQ_ENTRY(MigrFetchChunk) entry;
+} MigrFetchChunk;
+
+typedef struct MigrFetchAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int is_write;
+    /* the request of the image driver, once submitted */
+    BlockDriverAIOCB *real;
+    QLIST_ENTRY(MigrFetchAIOCB) entry;
+} MigrFetchAIOCB;
+
+struct MigrFetchState {
+    BlockDriverState *bs;
+    BlockDriver *drv;
+    int64_t nr_chunks;
+    /* main loop only */
+    unsigned long *missing;
+    /* missing chunks that will not arrive */
+    unsigned long *failed;
+    int64_t remaining;
+    int writing;
+    int sync_waiters;
+    QLIST_HEAD(, MigrFetchAIOCB) waiting;
+    uint8_t *zeroes;
+    QEMUBH *bh;
+    MigrFetchRequestFunc *request;
+    MigrFetchFreeFunc *free_buf;
+    void *opaque;
+    /*
+     * under lock, the chunks put and not written yet, and the chunks asked
+     * for or put, so a chunk is asked for at most once and never after
+     * it arrived
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QSIMPLEQ_HEAD(, MigrFetchChunk) arrived;
+    unsigned long *requested;
+};
+
+static BlockDriver bdrv_migr_fetch;
+
+static void migr_fetch_aio_cancel(BlockDriverAIOCB *blockacb);
+
+static AIOPool migr_fetch_aio_pool = {
+    .aiocb_size = sizeof(MigrFetchAIOCB),
+    .cancel     = migr_fetch_aio_cancel,
+};
+
+static int chunk_test(unsigned long *bitmap, int64_t chunk)
+{
+    return !!(bitmap[chunk / BITS_PER_WORD] & (1UL << (chunk % BITS_PER_WORD)));
+}
+
+static void chunk_set(unsigned long *bitmap, int64_t chunk, int set)
+{
+    if (set) {
+        bitmap[chunk / BITS_PER_WORD] |= 1UL << (chunk % BITS_PER_WORD);
+    } else {
+        bitmap[chunk / BITS_PER_WORD] &= ~(1UL << (chunk % BITS_PER_WORD));
+    }
+}
+
+/* whether a chunk of the range is missing */
+static int migr_fetch_missing(MigrFetchState *s, int64_t sector_num, int nb_sectors)
+{
+    int64_t chunk, end;
+
+    if (nb_sectors <= 0) {
+        return 0;
+    }
+
+    end = (sector_num + nb_sectors - 1) / CHUNK_SECTORS;
+    for (chunk = sector_num / CHUNK_SECTORS; chunk <= end && chunk < s->nr_chunks; chunk++) {
+        if (chunk_test(s->missing, chunk)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* whether a chunk of the range will not arrive */
+static int migr_fetch_failed(MigrFetchState *s, int64_t sector_num, int nb_sectors)
+{
+    int64_t chunk, end;
+
+    if (nb_sectors <= 0) {
+        return 0;
+    }
+
+    end = (sector_num + nb_sectors - 1) / CHUNK_SECTORS;
+    for (chunk = sector_num / CHUNK_SECTORS; chunk <= end && chunk < s->nr_chunks; chunk++) {
+        if (chunk_test(s->failed, chunk)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* ask for the missing chunks of the range */
+static void migr_fetch_request(MigrFetchState *s, int64_t sector_num, int nb_sectors)
+{
+    int64_t chunk, end;
+
+    end = (sector_num + nb_sectors - 1) / CHUNK_SECTORS;
+    for (chunk = sector_num / CHUNK_SECTORS; chunk <= end && chunk < s->nr_chunks; chunk++) {
+        if (!chunk_test(s->missing, chunk)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (!chunk_test(s->requested, chunk)) {
+            chunk_set(s->requested, chunk, 1);
+            /* never asked for again, unless it comes on its own */
+            if (s->request(s->opaque, chunk) < 0) {
+                chunk_set(s->failed, chunk, 1);
+                qemu_bh_schedule(s->bh);
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void migr_fetch_detach(MigrFetchState *s)
+{
+    BlockDriverState *bs = s->bs;
+
+    bs->drv = s->drv;
+    bs->fetch = NULL;
+
+    qemu_bh_delete(s->bh);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    qemu_vfree(s->zeroes);
+    qemu_free(s->missing);
+    qemu_free(s->failed);
+    qemu_free(s->requested);
+    qemu_free(s);
+}
+
+/* put the image driver back once nothing is left to fetch */
+static void migr_fetch_maybe_detach(MigrFetchState *s)
+{
+    if (s->remaining > 0 || s->writing > 0 || s->sync_waiters > 0 ||
+        !QLIST_EMPTY(&s->waiting)) {
+        return;
+    }
+
+    fprintf(stderr, "migr-fetch: all chunks of %s are there\n", s->bs->device_name);
+    migr_fetch_detach(s);
+}
+
+static void migr_fetch_aio_cb(void *opaque, int ret)
+{
+    MigrFetchAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static void migr_fetch_submit(MigrFetchState *s, MigrFetchAIOCB *acb)
+{
+    if (acb->is_write) {
+        acb->real = s->drv->bdrv_aio_writev(s->bs, acb->sector_num, acb->qiov,
+                                            acb->nb_sectors, migr_fetch_aio_cb, acb);
+    } else {
+        acb->real = s->drv->bdrv_aio_readv(s->bs, acb->sector_num, acb->qiov,
+                                           acb->nb_sectors, migr_fetch_aio_cb, acb);
+    }
+
+    if (acb->real == NULL) {
+        acb->common.cb(acb->common.opaque, -EIO);
+        qemu_aio_release(acb);
+    }
+}
+
+/*
+ * submit the waiting requests whose chunks are all there, fail those on a
+ * chunk that will not arrive
+ */
+static void migr_fetch_kick(MigrFetchState *s)
+{
+    MigrFetchAIOCB *acb, *next;
+
+    QLIST_FOREACH_SAFE(acb, &s->waiting, entry, next) {
+        if (migr_fetch_failed(s, acb->sector_num, acb->nb_sectors)) {
+            QLIST_REMOVE(acb, entry);
+            acb->common.cb(acb->common.opaque, -EIO);
+            qemu_aio_release(acb);
+        } else if (!migr_fetch_missing(s, acb->sector_num, acb->nb_sectors)) {
+            QLIST_REMOVE(acb, entry);
+            migr_fetch_submit(s, acb);
+        }
+    }
+}
+
+static void migr_fetch_chunk_done(MigrFetchChunk *c, int ret)
+{
+    MigrFetchState *s = c->s;
+
+    if (ret < 0) {
+        fprintf(stderr, "migr-fetch: writing chunk %" PRId64 " of %s failed %d\n",
+                c->chunk, s->bs->device_name, ret);
+    }
+
+    chunk_set(s->missing, c->chunk, 0);
+    chunk_set(s->failed, c->chunk, 0);
+    s->remaining--;
+    s->writing--;
+
+    if (c->buf) {
+        s->free_buf(c->buf);
+    }
+    qemu_free(c);
+}
+
+static void migr_fetch_chunk_cb(void *opaque, int ret)
+{
+    MigrFetchState *s = ((MigrFetchChunk *)opaque)->s;
+
+    migr_fetch_chunk_done(opaque, ret);
+    migr_fetch_kick(s);
+    migr_fetch_maybe_detach(s);
+}
+
+/* write the chunks that arrived to the image */
+static void migr_fetch_write_chunks(MigrFetchState *s)
+{
+    QSIMPLEQ_HEAD(, MigrFetchChunk) arrived = QSIMPLEQ_HEAD_INITIALIZER(arrived);
+    MigrFetchChunk *c;
+    int nb_sectors;
+
+    pthread_mutex_lock(&s->lock);
+    QSIMPLEQ_CONCAT(&arrived, &s->arrived);
+    pthread_mutex_unlock(&s->lock);
+
+    while ((c = QSIMPLEQ_FIRST(&arrived)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&arrived, entry);
+
+        if (c->chunk >= s->nr_chunks || !chunk_test(s->missing, c->chunk)) {
+            fprintf(stderr, "migr-fetch: chunk %" PRId64 " of %s was not missing\n",
+                    c->chunk, s->bs->device_name);
+            if (c->buf) {
+                s->free_buf(c->buf);
+            }
+            qemu_free(c);
+            continue;
+        }
+
+        /* it stays missing, so the filter never reads the stale image */
+        if (c->failed) {
+            fprintf(stderr, "migr-fetch: chunk %" PRId64 " of %s is lost\n",
+                    c->chunk, s->bs->device_name);
+            chunk_set(s->failed, c->chunk, 1);
+            qemu_free(c);
+            continue;
+        }
+
+        nb_sectors = CHUNK_SECTORS;
+        if (s->bs->total_sectors - c->chunk * CHUNK_SECTORS < CHUNK_SECTORS) {
+            nb_sectors = s->bs->total_sectors - c->chunk * CHUNK_SECTORS;
+        }
+
+        c->iov.iov_base = c->buf ? c->buf : s->zeroes;
+        c->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&c->qiov, &c->iov, 1);
+
+        s->writing++;
+        if (s->drv->bdrv_aio_writev(s->bs, c->chunk * CHUNK_SECTORS, &c->qiov,
+                                    nb_sectors, migr_fetch_chunk_cb, c) == NULL) {
+            migr_fetch_chunk_done(c, -EIO);
+        }
+    }
+}
+
+static void migr_fetch_bh(void *opaque)
+{
+    MigrFetchState *s = opaque;
+
+    migr_fetch_write_chunks(s);
+    migr_fetch_kick(s);
+    migr_fetch_maybe_detach(s);
+}
+
+/*
+ * the synchronous requests wait in place, writing the chunks that arrive
+ * until the range is complete or a chunk of it will not arrive
+ */
+static int migr_fetch_wait(MigrFetchState *s, int64_t sector_num, int nb_sectors)
+{
+    migr_fetch_request(s, sector_num, nb_sectors);
+
+    while (migr_fetch_missing(s, sector_num, nb_sectors)) {
+        migr_fetch_write_chunks(s);
+        if (migr_fetch_failed(s, sector_num, nb_sectors)) {
+            return -EIO;
+        }
+        if (s->writing > 0) {
+            qemu_aio_wait();
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        if (QSIMPLEQ_EMPTY(&s->arrived)) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return 0;
+}
+
+static int migr_fetch_read(BlockDriverState *bs, int64_t sector_num,
+                           uint8_t *buf, int nb_sectors)
+{
+    MigrFetchState *s = bs->fetch;
+    int ret;
+
+    s->sync_waiters++;
+    ret = migr_fetch_wait(s, sector_num, nb_sectors);
+    if (ret == 0) {
+        ret = s->drv->bdrv_read(bs, sector_num, buf, nb_sectors);
+    }
+    s->sync_waiters--;
+    migr_fetch_maybe_detach(s);
+
+    return ret;
+}
+
+static int migr_fetch_write(BlockDriverState *bs, int64_t sector_num,
+                            const uint8_t *buf, int nb_sectors)
+{
+    MigrFetchState *s = bs->fetch;
+    int ret;
+
+    s->sync_waiters++;
+    ret = migr_fetch_wait(s, sector_num, nb_sectors);
+    if (ret == 0) {
+        ret = s->drv->bdrv_write(bs, sector_num, buf, nb_sectors);
+    }
+    s->sync_waiters--;
+    migr_fetch_maybe_detach(s);
+
+    return ret;
+}
+
+static BlockDriverAIOCB *migr_fetch_aio_rw(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    MigrFetchState *s = bs->fetch;
+    MigrFetchAIOCB *acb;
+
+    if (!migr_fetch_missing(s, sector_num, nb_sectors)) {
+        if (is_write) {
+            return s->drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors, cb, opaque);
+        }
+        return s->drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors, cb, opaque);
+    }
+    if (migr_fetch_failed(s, sector_num, nb_sectors)) {
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&migr_fetch_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->is_write = is_write;
+    acb->real = NULL;
+    QLIST_INSERT_HEAD(&s->waiting, acb, entry);
+
+    migr_fetch_request(s, sector_num, nb_sectors);
+
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *migr_fetch_aio_readv(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return migr_fetch_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+}
+
+static BlockDriverAIOCB *migr_fetch_aio_writev(BlockDriverState *bs,
+    int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return migr_fetch_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
+}
+
+static void migr_fetch_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    MigrFetchAIOCB *acb = container_of(blockacb, MigrFetchAIOCB, common);
+
+    if (acb->real) {
+        bdrv_aio_cancel(acb->real);
+    } else {
+        QLIST_REMOVE(acb, entry);
+    }
+    qemu_aio_release(acb);
+}
+
+static BlockDriverAIOCB *migr_fetch_aio_flush(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_aio_flush(bs, cb, opaque);
+}
+
+/*
+ * the rest goes to the image driver, the defaults of block.c stand in for
+ * the callbacks it does not have
+ */
+static void migr_fetch_close(BlockDriverState *bs)
+{
+    MigrFetchState *s = bs->fetch;
+    MigrFetchAIOCB *acb, *next;
+    MigrFetchChunk *c;
+
+    while (s->writing > 0) {
+        qemu_aio_wait();
+    }
+
+    QLIST_FOREACH_SAFE(acb, &s->waiting, entry, next) {
+        QLIST_REMOVE(acb, entry);
+        acb->common.cb(acb->common.opaque, -EIO);
+        qemu_aio_release(acb);
+    }
+    while ((c = QSIMPLEQ_FIRST(&s->arrived)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->arrived, entry);
+        if (c->buf) {
+            s->free_buf(c->buf);
+        }
+        qemu_free(c);
+    }
+
+    if (s->drv->bdrv_close) {
+        s->drv->bdrv_close(bs);
+    }
+    migr_fetch_detach(s);
+}
+
+static int migr_fetch_flush(BlockDriverState *bs)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_flush ? s->drv->bdrv_flush(bs) : 0;
+}
+
+static int migr_fetch_discard(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors)
+{
+    MigrFetchState *s = bs->fetch;
+
+    /* a chunk written later overwrites it, discard is a hint only */
+    return s->drv->bdrv_discard ? s->drv->bdrv_discard(bs, sector_num, nb_sectors) : 0;
+}
+
+static int64_t migr_fetch_getlength(BlockDriverState *bs)
+{
+    MigrFetchState *s = bs->fetch;
+
+    if (!s->drv->bdrv_getlength) {
+        return bs->total_sectors * BDRV_SECTOR_SIZE;
+    }
+    return s->drv->bdrv_getlength(bs);
+}
+
+static int migr_fetch_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors, int *pnum)
+{
+    MigrFetchState *s = bs->fetch;
+    int64_t n;
+
+    if (!s->drv->bdrv_is_allocated) {
+        n = bs->total_sectors - sector_num;
+        *pnum = (n < 0) ? 0 : (n < nb_sectors) ? n : nb_sectors;
+        return n > 0;
+    }
+    return s->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+}
+
+/* a missing chunk holds data, whatever the image says */
+static int migr_fetch_is_hole(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors, int *pnum)
+{
+    MigrFetchState *s = bs->fetch;
+    int64_t n;
+
+    if (migr_fetch_missing(s, sector_num, nb_sectors)) {
+        n = bs->total_sectors - sector_num;
+        *pnum = (n < 0) ? 0 : (n < nb_sectors) ? n : nb_sectors;
+        return 0;
+    }
+    if (s->drv->bdrv_is_hole) {
+        return s->drv->bdrv_is_hole(bs, sector_num, nb_sectors, pnum);
+    }
+    if (s->drv->bdrv_is_allocated && !bs->backing_hd) {
+        return !s->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+    }
+
+    n = bs->total_sectors - sector_num;
+    *pnum = (n < 0) ? 0 : (n < nb_sectors) ? n : nb_sectors;
+    return 0;
+}
+
+static int migr_fetch_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_get_info ? s->drv->bdrv_get_info(bs, bdi) : -ENOTSUP;
+}
+
+static int migr_fetch_is_inserted(BlockDriverState *bs)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_is_inserted ? s->drv->bdrv_is_inserted(bs) : !bs->tray_open;
+}
+
+static int migr_fetch_media_changed(BlockDriverState *bs)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_media_changed ? s->drv->bdrv_media_changed(bs) : -ENOTSUP;
+}
+
+static int migr_fetch_eject(BlockDriverState *bs, int eject_flag)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_eject ? s->drv->bdrv_eject(bs, eject_flag) : -ENOTSUP;
+}
+
+static int migr_fetch_set_locked(BlockDriverState *bs, int locked)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_set_locked ? s->drv->bdrv_set_locked(bs, locked) : -ENOTSUP;
+}
+
+static int migr_fetch_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_ioctl ? s->drv->bdrv_ioctl(bs, req, buf) : -ENOTSUP;
+}
+
+static BlockDriverAIOCB *migr_fetch_aio_ioctl(BlockDriverState *bs,
+    unsigned long int req, void *buf,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    MigrFetchState *s = bs->fetch;
+
+    return s->drv->bdrv_aio_ioctl ?
+        s->drv->bdrv_aio_ioctl(bs, req, buf, cb, opaque) : NULL;
+}
+
+/* not registered, it is only put in front of an image by migr_fetch_attach */
+static BlockDriver bdrv_migr_fetch = {
+    .format_name        = "migr-fetch",
+
+    .bdrv_read          = migr_fetch_read,
+    .bdrv_write         = migr_fetch_write,
+    .bdrv_close         = migr_fetch_close,
+    .bdrv_flush         = migr_fetch_flush,
+    .bdrv_discard       = migr_fetch_discard,
+    .bdrv_getlength     = migr_fetch_getlength,
+    .bdrv_is_allocated  = migr_fetch_is_allocated,
+    .bdrv_is_hole       = migr_fetch_is_hole,
+    .bdrv_get_info      = migr_fetch_get_info,
+
+    .bdrv_aio_readv     = migr_fetch_aio_readv,
+    .bdrv_aio_writev    = migr_fetch_aio_writev,
+    .bdrv_aio_flush     = migr_fetch_aio_flush,
+
+    .bdrv_is_inserted   = migr_fetch_is_inserted,
+    .bdrv_media_changed = migr_fetch_media_changed,
+    .bdrv_eject         = migr_fetch_eject,
+    .bdrv_set_locked    = migr_fetch_set_locked,
+    .bdrv_ioctl         = migr_fetch_ioctl,
+    .bdrv_aio_ioctl     = migr_fetch_aio_ioctl,
+};
+
+int migr_fetch_attach(BlockDriverState *bs, unsigned long *missing,
+                      MigrFetchRequestFunc *request, MigrFetchFreeFunc *free_buf,
+                      void *opaque)
+{
+    MigrFetchState *s;
+    int64_t nr_chunks, words, i;
+
+    if (bs->drv == NULL || bs->fetch != NULL) {
+        return -EINVAL;
+    }
+
+    nr_chunks = (bs->total_sectors + CHUNK_SECTORS - 1) / CHUNK_SECTORS;
+    words = (nr_chunks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    s = qemu_mallocz(sizeof(MigrFetchState));
+    s->bs = bs;
+    s->drv = bs->drv;
+    s->nr_chunks = nr_chunks;
+    s->missing = missing;
+    s->failed = qemu_mallocz(words * sizeof(unsigned long));
+    s->requested = qemu_mallocz(words * sizeof(unsigned long));
+    s->remaining = 0;
+    for (i = 0; i < nr_chunks; i++) {
+        s->remaining += chunk_test(missing, i);
+    }
+    QLIST_INIT(&s->waiting);
+    QSIMPLEQ_INIT(&s->arrived);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->zeroes = qemu_blockalign(bs, CHUNK_SECTORS * BDRV_SECTOR_SIZE);
+    memset(s->zeroes, 0, CHUNK_SECTORS * BDRV_SECTOR_SIZE);
+    s->bh = qemu_bh_new(migr_fetch_bh, s);
+    s->request = request;
+    s->free_buf = free_buf;
+    s->opaque = opaque;
+
+    if (s->remaining == 0) {
+        migr_fetch_detach(s);
+        return 0;
+    }
+
+    bs->fetch = s;
+    bs->drv = &bdrv_migr_fetch;
+
+    return 0;
+}
+
+static void migr_fetch_arrived(BlockDriverState *bs, int64_t chunk, void *buf,
+                               int failed)
+{
+    MigrFetchState *s = bs->fetch;
+    MigrFetchChunk *c;
+
+    c = qemu_mallocz(sizeof(MigrFetchChunk));
+    c->s = s;
+    c->chunk = chunk;
+    c->buf = buf;
+    c->failed = failed;
+
+    pthread_mutex_lock(&s->lock);
+    if (chunk < s->nr_chunks) {
+        chunk_set(s->requested, chunk, 1);
+    }
+    QSIMPLEQ_INSERT_TAIL(&s->arrived, c, entry);
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    qemu_bh_schedule(s->bh);
+}
+
+void migr_fetch_put(BlockDriverState *bs, int64_t chunk, void *buf)
+{
+    migr_fetch_arrived(bs, chunk, buf, 0);
+}
+
+void migr_fetch_fail(BlockDriverState *bs, int64_t chunk)
+{
+    migr_fetch_arrived(bs, chunk, NULL, 1);
+}
@@ -0,0 +1,34 @@
+/*
+ * Block filter fetching the chunks of a disk on demand, for the disk
+ * post-copy of the migration destination
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_MIGR_FETCH_H
+#define BLOCK_MIGR_FETCH_H
+
+#include "block_int.h"
+
+/*
+ * classicsong
+ * chunks are BDRV_SECTORS_PER_DIRTY_CHUNK sectors, as the dirty tracking.
+ * request is called in the main loop the first time a chunk not there is
+ * needed, it returns < 0 when the chunk can not be asked for and the
+ * requests on it fail. free_buf gets the buffers handed in with
+ * migr_fetch_put once they are written
+ */
+typedef int MigrFetchRequestFunc(void *opaque, int64_t chunk);
+typedef void MigrFetchFreeFunc(void *buf);
+
+/* missing has a bit per chunk of bs, the filter owns it from now on */
+int migr_fetch_attach(BlockDriverState *bs, unsigned long *missing,
+                      MigrFetchRequestFunc *request, MigrFetchFreeFunc *free_buf,
+                      void *opaque);
+/* any thread: chunk arrived, buf NULL for a chunk of zeroes */
+void migr_fetch_put(BlockDriverState *bs, int64_t chunk, void *buf);
+/* any thread: chunk will not arrive, the requests on it fail */
+void migr_fetch_fail(BlockDriverState *bs, int64_t chunk);
+
+#endif
@@ -512,6 +512,64 @@ static int raw_write(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
+static int qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov);
+
+/*
+ * one pwritev for the whole vector, O_DIRECT files with unaligned
+ * buffers go through raw_write element by element
+ */
+static int raw_writev(BlockDriverState *bs, int64_t sector_num,
+                      QEMUIOVector *qiov, int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    struct iovec *iov = qiov->iov;
+    int niov = qiov->niov;
+    ssize_t ret;
+    int i;
+
+#ifdef CONFIG_PREADV
+    if (s->aligned_buf == NULL || qiov_is_aligned(bs, qiov)) {
+        int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+
+        ret = fd_open(bs);
+        if (ret < 0)
+            return -errno;
+
+        /* pwritev may stop early, the iovec is not needed afterwards */
+        while (niov > 0) {
+            ret = pwritev(s->fd, iov, niov, offset);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            }
+
+            offset += ret;
+            while (niov > 0 && ret >= (ssize_t)iov->iov_len) {
+                ret -= iov->iov_len;
+                iov++;
+                niov--;
+            }
+            if (niov > 0) {
+                iov->iov_base = (uint8_t *)iov->iov_base + ret;
+                iov->iov_len -= ret;
+            }
+        }
+        return 0;
+    }
+#endif
+
+    for (i = 0; i < niov; i++) {
+        int n = iov[i].iov_len >> BDRV_SECTOR_BITS;
+
+        ret = raw_write(bs, sector_num, iov[i].iov_base, n);
+        if (ret < 0)
+            return ret;
+        sector_num += n;
+    }
+    return 0;
+}
+
 /*
  * Check if all memory in this vector is sector aligned.
  */
@@ -787,6 +845,46 @@ static int raw_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     return 0;
 }
 
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+/*
+ * holes of a sparse file, found with SEEK_DATA/SEEK_HOLE
+ * a filesystem without support reports the whole file as data
+ */
+static int raw_is_hole(BlockDriverState *bs, int64_t sector_num,
+                       int nb_sectors, int *pnum)
+{
+    BDRVRawState *s = bs->opaque;
+    off_t start = sector_num * BDRV_SECTOR_SIZE;
+    off_t data, hole;
+    int64_t n;
+
+    *pnum = nb_sectors;
+
+    data = lseek(s->fd, start, SEEK_DATA);
+    if (data < 0) {
+        /* ENXIO: only a hole up to the end of the file */
+        return errno == ENXIO;
+    }
+
+    n = (data - start) / BDRV_SECTOR_SIZE;
+    if (n > 0) {
+        if (n < nb_sectors) {
+            *pnum = n;
+        }
+        return 1;
+    }
+
+    hole = lseek(s->fd, start, SEEK_HOLE);
+    if (hole > start) {
+        n = (hole - start + BDRV_SECTOR_SIZE - 1) / BDRV_SECTOR_SIZE;
+        if (n < nb_sectors) {
+            *pnum = n;
+        }
+    }
+    return 0;
+}
+#endif
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -804,10 +902,14 @@ static BlockDriver bdrv_file = {
     .bdrv_file_open = raw_open,
     .bdrv_read = raw_read,
     .bdrv_write = raw_write,
+    .bdrv_writev = raw_writev,
     .bdrv_close = raw_close,
     .bdrv_create = raw_create,
     .bdrv_flush = raw_flush,
     .bdrv_discard = raw_discard,
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    .bdrv_is_hole = raw_is_hole,
+#endif
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -1082,6 +1184,7 @@ static BlockDriver bdrv_host_device = {
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
+    .bdrv_writev        = raw_writev,
     .bdrv_getlength	= raw_getlength,
 
     /* generic scsi device */
@@ -21,6 +21,12 @@ static int raw_write(BlockDriverState *bs, int64_t sector_num,
     return bdrv_write(bs->file, sector_num, buf, nb_sectors);
 }
 
+static int raw_writev(BlockDriverState *bs, int64_t sector_num,
+                      QEMUIOVector *qiov, int nb_sectors)
+{
+    return bdrv_writev(bs->file, sector_num, qiov, nb_sectors);
+}
+
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
     int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
     BlockDriverCompletionFunc *cb, void *opaque)
@@ -70,6 +76,12 @@ static int raw_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     return bdrv_discard(bs->file, sector_num, nb_sectors);
 }
 
+static int raw_is_hole(BlockDriverState *bs, int64_t sector_num,
+                       int nb_sectors, int *pnum)
+{
+    return bdrv_is_hole(bs->file, sector_num, nb_sectors, pnum);
+}
+
 static int raw_is_inserted(BlockDriverState *bs)
 {
     return bdrv_is_inserted(bs->file);
@@ -127,6 +139,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_close         = raw_close,
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
+    .bdrv_writev        = raw_writev,
     .bdrv_flush         = raw_flush,
     .bdrv_probe         = raw_probe,
     .bdrv_getlength     = raw_getlength,
@@ -136,6 +149,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush     = raw_aio_flush,
     .bdrv_discard       = raw_discard,
+    .bdrv_is_hole       = raw_is_hole,
 
     .bdrv_is_inserted   = raw_is_inserted,
     .bdrv_eject         = raw_eject,
@@ -57,11 +57,17 @@ struct BlockDriver {
                      uint8_t *buf, int nb_sectors);
     int (*bdrv_write)(BlockDriverState *bs, int64_t sector_num,
                       const uint8_t *buf, int nb_sectors);
+    /* synchronous vectored write, optional */
+    int (*bdrv_writev)(BlockDriverState *bs, int64_t sector_num,
+                       QEMUIOVector *qiov, int nb_sectors);
     void (*bdrv_close)(BlockDriverState *bs);
     int (*bdrv_create)(const char *filename, QEMUOptionParameter *options);
     int (*bdrv_flush)(BlockDriverState *bs);
     int (*bdrv_is_allocated)(BlockDriverState *bs, int64_t sector_num,
                              int nb_sectors, int *pnum);
+    /* sectors reading as zeroes without being stored, optional */
+    int (*bdrv_is_hole)(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, int *pnum);
     int (*bdrv_set_key)(BlockDriverState *bs, const char *key);
     int (*bdrv_make_empty)(BlockDriverState *bs);
     /* aio */
@@ -203,6 +209,8 @@ struct BlockDriverState {
     QTAILQ_ENTRY(BlockDriverState) list;
     void *private;
     uint32_t *version_queue;
+    /* classicsong, disk post-copy on the dest, see block/migr-fetch.c */
+    struct MigrFetchState *fetch;
 };
 
 #define CHANGE_MEDIA	0x01
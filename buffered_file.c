@@ -21,11 +21,13 @@
 
 //classicsong
 #include <assert.h>
+#include "migr-rate.h"
 
 //classicsong add budget for this buffer
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
+    BufferedWritevFunc *writev_buffer;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
@@ -40,18 +42,13 @@ typedef struct QEMUFileBuffered
     size_t buffer_capacity;
     QEMUTimer *timer;
     /*
-     * budget data
+     * budget data, the bucket shared by the slaves of the migration
+     * and the reserve of this slave
      */
-    int budget;
-    int burst_time_us;
-    struct timeval last_put;
+    struct token_bucket *bucket;
+    struct token_bucket *reserve;
 } QEMUFileBuffered;
 
-/* scaling factor to convert between Mb/s and time in usecs, copy from xen*/
-#define RATE_TO_BTU 781250
-/* Amount in bytes we allow ourselves to send in a burst */
-#define BURST_BUDGET (100 * 1024)
-
 //#define DEBUG_BUFFERED_FILE
 #ifdef DEBUG_BUFFERED_FILE
 #define DPRINTF(fmt, ...) \
@@ -124,12 +121,15 @@ static void buffered_flush(QEMUFileBuffered *s)
 
 /*
  * classicsong
- * get time delta
+ * rate control of the slaves, wait until size bytes may be sent
  */
-static uint64_t 
-tv_delta(struct timeval *new, struct timeval *old) {
-    return (((new->tv_sec - old->tv_sec) * 1000000) + 
-            (new->tv_usec - old->tv_usec));
+static void buffered_wait_budget_slave(QEMUFileBuffered *s, int size)
+{
+    unsigned long wait_ns = token_take(s->bucket, s->reserve, size);
+    struct timespec delay = {wait_ns / 1000000000, wait_ns % 1000000000};
+
+    while (wait_ns > 0 && nanosleep(&delay, &delay) < 0 && errno == EINTR)
+        ;
 }
 
 /*
@@ -141,9 +141,6 @@ static int buffered_put_buffer_slave(void *opaque, const uint8_t *buf, int64_t p
     QEMUFileBuffered *s = opaque;
     int offset = 0;
     ssize_t ret;
-    struct timeval now;
-    struct timespec delay;
-    long long delta;
 
     DPRINTF("slave putting %d bytes at %" PRId64 "\n", size, pos);
 
@@ -160,47 +157,7 @@ static int buffered_put_buffer_slave(void *opaque, const uint8_t *buf, int64_t p
 
     buffered_flush(s);
 
-    /*
-     * rate control here
-     */
-    s->budget -= size;
-
-    /*
-     * wait for budget here
-     */
-    if (s->budget < 0) {
-        s->burst_time_us = 10000; //RATE_TO_BTU / s->xfer_limit;
-
-        if (s->last_put.tv_sec == 0) {
-            s->budget += s->xfer_limit;
-            gettimeofday(&s->last_put, NULL);
-        }
-        else 
-        {
-            while (s->budget < 0) {
-                gettimeofday(&now, NULL);
-                delta = tv_delta(&now, &s->last_put);
-                while (delta > s->burst_time_us) {
-                    s->budget += s->xfer_limit;
-                    s->last_put.tv_usec += s->burst_time_us;
-                    if (s->last_put.tv_usec > 1000000) {
-                        s->last_put.tv_usec -= 1000000;
-                        s->last_put.tv_sec++;
-                    }
-
-                    delta -= s->burst_time_us;
-                }
-                if (s->budget > 0)
-                    break;
-
-                delay.tv_sec = 0;
-                delay.tv_nsec = 1000 * (s->burst_time_us - delta);
-                while ( delay.tv_nsec > 0)
-                    if (nanosleep(&delay, &delay) == 0)
-                        break;
-            }
-        }
-    }
+    buffered_wait_budget_slave(s, size);
 
     /*
      * we have budget now
@@ -300,6 +257,52 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
     return offset;
 }
 
+/*
+ * classicsong
+ * send the buffers queued by qemu_put_buffer_async with as few syscalls
+ * as possible, a short write continues from where it stopped
+ */
+static ssize_t buffered_writev_buffer_slave(void *opaque, struct iovec *iov, int iovcnt)
+{
+    QEMUFileBuffered *s = opaque;
+    ssize_t size = 0, ret;
+    int i;
+
+    if (s->has_error) {
+        DPRINTF("flush when error, bailing\n");
+        return -EINVAL;
+    }
+
+    s->freeze_output = 0;
+    buffered_flush(s);
+
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    buffered_wait_budget_slave(s, size);
+
+    while (iovcnt > 0) {
+        ret = s->writev_buffer(s->opaque, iov, iovcnt);
+        if (ret <= 0) {
+            fprintf(stderr, "error putting %zd\n", ret);
+            s->has_error = 1;
+            return -EINVAL;
+        }
+
+        while (iovcnt > 0 && ret >= (ssize_t)iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return size;
+}
+
 //classicsong
 static int buffered_close_slave(void *opaque)
 {
@@ -410,7 +413,10 @@ static void buffered_rate_tick(void *opaque)
 QEMUFile *
 qemu_fopen_ops_buffered_slave(void *opaque,
                               size_t bits_per_sec,
+                              struct token_bucket *bucket,
+                              struct token_bucket *reserve,
                               BufferedPutFunc *put_buffer,
+                              BufferedWritevFunc *writev_buffer,
                               BufferedPutReadyFunc *put_ready,
                               BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                               BufferedCloseFunc *close)
@@ -422,18 +428,19 @@ qemu_fopen_ops_buffered_slave(void *opaque,
     s->opaque = opaque;
     s->xfer_limit = bits_per_sec / 1024;
     s->put_buffer = put_buffer;
+    s->writev_buffer = writev_buffer;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
-    s->budget = 0;
-    s->burst_time_us = -1;
-    s->last_put.tv_sec = 0;
-    s->last_put.tv_usec = 0;
+    s->bucket = bucket;
+    s->reserve = reserve;
 
     s->file = qemu_fopen_ops(s, buffered_put_buffer_slave, NULL,
                              buffered_close_slave, buffered_rate_limit,
                              buffered_set_rate_limit,
                              buffered_get_rate_limit);
+    if (writev_buffer)
+        qemu_file_set_writev(s->file, buffered_writev_buffer_slave);
     return s->file;
 }
 
@@ -15,8 +15,10 @@
 #define QEMU_BUFFERED_FILE_H
 
 #include "hw/hw.h"
+#include "migr-rate.h"
 
 typedef ssize_t (BufferedPutFunc)(void *opaque, const void *data, size_t size);
+typedef ssize_t (BufferedWritevFunc)(void *opaque, struct iovec *iov, int iovcnt);
 typedef void (BufferedPutReadyFunc)(void *opaque);
 typedef void (BufferedWaitForUnfreezeFunc)(void *opaque);
 typedef int (BufferedCloseFunc)(void *opaque);
@@ -30,7 +32,10 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque, size_t xfer_limit,
 QEMUFile *
 qemu_fopen_ops_buffered_slave(void *opaque,
                               size_t bytes_per_sec,
+                              struct token_bucket *bucket,
+                              struct token_bucket *reserve,
                               BufferedPutFunc *put_buffer,
+                              BufferedWritevFunc *writev_buffer,
                               BufferedPutReadyFunc *put_ready,
                               BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                               BufferedCloseFunc *close);
@@ -876,6 +876,10 @@ typedef struct RAMBlock {
 
 typedef struct RAMList {
     uint8_t *phys_dirty;
+    /* one bit per page, authoritative for MIGRATION_DIRTY_FLAG */
+    unsigned long *migration_dirty;
+    /* number of bits set in migration_dirty */
+    long migration_dirty_pages;
     QLIST_HEAD(ram, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
@@ -905,32 +909,108 @@ extern int mem_prealloc;
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
 
-/* read dirty bit (return 0 or 1) */
-static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
+/* migration dirty bitmap, indexed by ram page number */
+#define MIGRATION_DIRTY_WORD(page) ((page) / HOST_LONG_BITS)
+#define MIGRATION_DIRTY_BIT(page)  (1UL << ((page) % HOST_LONG_BITS))
+#define MIGRATION_DIRTY_WORDS(nr_pages) \
+    (((nr_pages) + HOST_LONG_BITS - 1) / HOST_LONG_BITS)
+
+static inline int migration_dirty_test(ram_addr_t page)
+{
+    return (ram_list.migration_dirty[MIGRATION_DIRTY_WORD(page)] &
+            MIGRATION_DIRTY_BIT(page)) != 0;
+}
+
+static inline void migration_dirty_set(ram_addr_t page)
+{
+    unsigned long *p = &ram_list.migration_dirty[MIGRATION_DIRTY_WORD(page)];
+
+    if (!(*p & MIGRATION_DIRTY_BIT(page)) &&
+        !(__sync_fetch_and_or(p, MIGRATION_DIRTY_BIT(page)) & MIGRATION_DIRTY_BIT(page)))
+        __sync_fetch_and_add(&ram_list.migration_dirty_pages, 1);
+}
+
+/* atomically clear the bits of mask in one word, return the bits that were set */
+static inline unsigned long migration_dirty_fetch_and_clear(unsigned long word,
+                                                            unsigned long mask)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] == 0xff;
+    unsigned long *p = &ram_list.migration_dirty[word];
+    unsigned long old;
+
+    if (!(*p & mask))
+        return 0;
+    if (mask == ~0UL)
+        old = __sync_lock_test_and_set(p, 0);
+    else
+        old = __sync_fetch_and_and(p, ~mask) & mask;
+    if (old)
+        __sync_fetch_and_sub(&ram_list.migration_dirty_pages, __builtin_popcountl(old));
+    return old;
+}
+
+/* atomically set the bits of bits in one word */
+static inline void migration_dirty_set_bits(unsigned long word, unsigned long bits)
+{
+    unsigned long old;
+
+    if (!bits)
+        return;
+    old = __sync_fetch_and_or(&ram_list.migration_dirty[word], bits);
+    if (bits & ~old)
+        __sync_fetch_and_add(&ram_list.migration_dirty_pages, __builtin_popcountl(bits & ~old));
+}
+
+static inline void migration_dirty_clear_range(ram_addr_t page, ram_addr_t nr_pages)
+{
+    ram_addr_t end = page + nr_pages;
+    unsigned long mask;
+
+    while (page < end) {
+        mask = ~0UL << (page % HOST_LONG_BITS);
+        if (end - (page & ~(ram_addr_t)(HOST_LONG_BITS - 1)) < HOST_LONG_BITS)
+            mask &= ~0UL >> (HOST_LONG_BITS - end % HOST_LONG_BITS);
+        migration_dirty_fetch_and_clear(MIGRATION_DIRTY_WORD(page), mask);
+        page = (page | (HOST_LONG_BITS - 1)) + 1;
+    }
 }
 
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+
+    return (ram_list.phys_dirty[page] & ~MIGRATION_DIRTY_FLAG) |
+        (migration_dirty_test(page) ? MIGRATION_DIRTY_FLAG : 0);
+}
+
+/* read dirty bit (return 0 or 1) */
+static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
+{
+    return cpu_physical_memory_get_dirty_flags(addr) == 0xff;
 }
 
 static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
                                                 int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
+    ram_addr_t page = addr >> TARGET_PAGE_BITS;
+
+    if (dirty_flags == MIGRATION_DIRTY_FLAG)
+        return migration_dirty_test(page) ? MIGRATION_DIRTY_FLAG : 0;
+    return cpu_physical_memory_get_dirty_flags(addr) & dirty_flags;
 }
 
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
     ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    migration_dirty_set(addr >> TARGET_PAGE_BITS);
 }
 
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    if (dirty_flags & MIGRATION_DIRTY_FLAG)
+        migration_dirty_set(addr >> TARGET_PAGE_BITS);
+    return cpu_physical_memory_get_dirty_flags(addr);
 }
 
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
@@ -946,8 +1026,13 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
     for (i = 0; i < len; i++) {
         p[i] &= mask;
     }
+    if (dirty_flags & MIGRATION_DIRTY_FLAG)
+        migration_dirty_clear_range(start >> TARGET_PAGE_BITS, len);
 }
 
+void cpu_physical_memory_merge_migration_dirty(ram_addr_t start,
+                                               unsigned long *bitmap,
+                                               ram_addr_t nr_pages);
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
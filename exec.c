@@ -2828,6 +2828,70 @@ static ram_addr_t last_ram_offset(void)
     return last;
 }
 
+/* resize the migration bitmap to cover all ram and mark the new block dirty */
+static void migration_dirty_grow(ram_addr_t page, ram_addr_t nr_pages)
+{
+    static ram_addr_t nr_words;
+    ram_addr_t words = MIGRATION_DIRTY_WORDS(last_ram_offset() >> TARGET_PAGE_BITS);
+    ram_addr_t i;
+
+    if (words > nr_words) {
+        ram_list.migration_dirty = qemu_realloc(ram_list.migration_dirty,
+                                                words * sizeof(unsigned long));
+        memset(ram_list.migration_dirty + nr_words, 0,
+               (words - nr_words) * sizeof(unsigned long));
+        nr_words = words;
+    }
+
+    for (i = page; i < page + nr_pages; i++) {
+        migration_dirty_set(i);
+    }
+}
+
+/*
+ * OR a little endian dirty log of nr_pages pages into the migration bitmap,
+ * starting at ram address start. Whole words are merged at a time, a start
+ * that is not word aligned spills each source word over two bitmap words.
+ */
+void cpu_physical_memory_merge_migration_dirty(ram_addr_t start,
+                                               unsigned long *bitmap,
+                                               ram_addr_t nr_pages)
+{
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    unsigned long *dst = ram_list.migration_dirty + MIGRATION_DIRTY_WORD(page);
+    unsigned int shift = page % HOST_LONG_BITS;
+    ram_addr_t i, len = MIGRATION_DIRTY_WORDS(nr_pages);
+    unsigned long c;
+    long added = 0;
+
+    for (i = 0; i < len; i++) {
+        c = leul_to_cpu(bitmap[i]);
+        if (c == 0) {
+            continue;
+        }
+        if (shift == 0) {
+            if ((dst[i] & c) != c) {
+                added += __builtin_popcountl(c & ~__sync_fetch_and_or(&dst[i], c));
+            }
+            continue;
+        }
+        if (c << shift) {
+            added += __builtin_popcountl((c << shift) &
+                                         ~__sync_fetch_and_or(&dst[i], c << shift));
+        }
+        if (c >> (HOST_LONG_BITS - shift)) {
+            added += __builtin_popcountl((c >> (HOST_LONG_BITS - shift)) &
+                                         ~__sync_fetch_and_or(&dst[i + 1],
+                                                              c >> (HOST_LONG_BITS - shift)));
+        }
+    }
+
+    /* keep the running count of dirty pages for ram_bytes_remaining */
+    if (added) {
+        __sync_fetch_and_add(&ram_list.migration_dirty_pages, added);
+    }
+}
+
 ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                                    ram_addr_t size, void *host)
 {
@@ -2889,6 +2953,8 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
     memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
            0xff, size >> TARGET_PAGE_BITS);
+    migration_dirty_grow(new_block->offset >> TARGET_PAGE_BITS,
+                         size >> TARGET_PAGE_BITS);
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
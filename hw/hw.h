@@ -42,6 +42,19 @@ typedef int (QEMUFileRateLimit)(void *opaque);
 typedef int64_t (QEMUFileSetRateLimit)(void *opaque, int64_t new_rate);
 typedef int64_t (QEMUFileGetRateLimit)(void *opaque);
 
+/* classicsong
+ * Write a vector of buffers queued by qemu_put_buffer_async.
+ * The handler should write all of the data and return the number of bytes
+ * written or a negative error.
+ */
+typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov, int iovcnt);
+
+/* classicsong
+ * Read into a vector of buffers, used by qemu_get_buffer_direct.
+ * The number of bytes actually read should be returned.
+ */
+typedef int (QEMUFileGetBuffervFunc)(void *opaque, struct iovec *iov, int iovcnt);
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,
@@ -53,12 +66,19 @@ QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd);
 //add by classicsong
 QEMUFile *qemu_fopen_socket_ssl(int fd);
+QEMUFile *qemu_fopen_buffer_write(void);
+QEMUFile *qemu_fopen_buffer_read(void);
+uint8_t *qemu_buffer_file_data(QEMUFile *f, int64_t *size);
+void qemu_buffer_file_reset(QEMUFile *f, uint8_t *data, int64_t size);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_stdio_fd(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_file_set_writev(QEMUFile *f, QEMUFileWritevBufferFunc *writev_buffer);
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_file_set_readv(QEMUFile *f, QEMUFileGetBuffervFunc *get_bufferv);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -72,6 +92,8 @@ void qemu_put_be16(QEMUFile *f, unsigned int v);
 void qemu_put_be32(QEMUFile *f, unsigned int v);
 void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
+int qemu_get_buffer_direct(QEMUFile *f, uint8_t *buf, int size);
+int qemu_skip_buffer(QEMUFile *f, int size);
 int qemu_get_byte(QEMUFile *f);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
@@ -361,7 +361,8 @@ static int kvm_get_dirty_pages_log_range(unsigned long start_addr,
 
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
- * This function updates qemu's dirty bitmap using cpu_physical_memory_set_dirty().
+ * This function updates qemu's dirty bitmap using cpu_physical_memory_set_dirty(),
+ * or merges it into the migration bitmap while migrating.
  * This means all bits are set to dirty.
  *
  * @start_add: start of logged region.
@@ -400,8 +401,20 @@ static int kvm_physical_sync_dirty_bitmap(target_phys_addr_t start_addr,
             break;
         }
 
-        kvm_get_dirty_pages_log_range(mem->start_addr, d.dirty_bitmap,
-                                      mem->start_addr, mem->memory_size);
+        /*
+         * While migrating, the log goes word by word into the migration
+         * bitmap; the per page byte map is only updated for slots that a
+         * device (e.g. vga) is logging itself.
+         */
+        if (s->migration_log) {
+            cpu_physical_memory_merge_migration_dirty(mem->phys_offset & TARGET_PAGE_MASK,
+                                                      d.dirty_bitmap,
+                                                      mem->memory_size >> TARGET_PAGE_BITS);
+        }
+        if (!s->migration_log || (mem->flags & KVM_MEM_LOG_DIRTY_PAGES)) {
+            kvm_get_dirty_pages_log_range(mem->start_addr, d.dirty_bitmap,
+                                          mem->start_addr, mem->memory_size);
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
     qemu_free(d.dirty_bitmap);
@@ -191,3 +191,7 @@ int kvm_on_sigbus(int code, void *addr)
 {
     return 1;
 }
+
+void kvm_set_cpu_throttle(int pct)
+{
+}
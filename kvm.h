@@ -57,6 +57,9 @@ int kvm_has_xsave(void);
 int kvm_has_xcrs(void);
 int kvm_has_many_ioeventfds(void);
 
+/* vCPU throttling of auto-converge migration, percent of the time asleep */
+void kvm_set_cpu_throttle(int pct);
+
 #ifdef NEED_CPU_H
 int kvm_init_vcpu(CPUState *env);
 
@@ -7,3 +7,21 @@ c_each("max_iter", NUMBER);
 c_each("max_factor", NUMBER);
 c_each("max_downtime", NUMBER);
 c_each("throughput", NUMBER);
+c_each("scan_threads", NUMBER);
+c_each("compression", NUMBER);
+c_each("xbzrle_cache", NUMBER);
+c_each("shard_mode", NUMBER);
+c_each("slave_node", NUMBER);
+c_each("bind_h_ip", NUMBER);
+c_each("disk_writers", NUMBER);
+c_each("disk_read_depth", NUMBER);
+c_each("slave_min_throughput", NUMBER);
+c_each("work_stealing", NUMBER);
+c_each("conv_alpha", NUMBER);
+c_each("conv_min_gain", NUMBER);
+c_each("auto_converge", NUMBER);
+c_each("throttle_initial", NUMBER);
+c_each("throttle_increment", NUMBER);
+c_each("postcopy", NUMBER);
+c_each("disk_postcopy", NUMBER);
+c_each("hot_rounds", NUMBER);
@@ -0,0 +1,124 @@
+#ifndef MIGR_CONV_H
+#define MIGR_CONV_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * classicsong
+ * convergence controller of the pre-copy iterations
+ * after every iteration the masters feed in the data left to send (the
+ * dirty set just synced, memory and disk) and the bandwidth of both.
+ * The dirty set is what was dirtied since the last sync, so its rate is
+ * remaining / iteration time. Both rates are smoothed with weight alpha for
+ * the newest sample, so one bursty iteration neither stops the migration
+ * nor keeps it going.
+ * Stopping now costs downtime = remaining / bwidth. One more iteration sends
+ * remaining in that time, meanwhile dirty_rate * downtime is dirtied again,
+ * which is the downtime after it. The migration stops when the downtime is
+ * below max_downtime, or when the next iteration would not cut it by
+ * min_gain, as it then resends about as much as it saves.
+ */
+#define CONV_THROTTLE_ITERS 2
+#define CONV_THROTTLE_MAX 99
+struct conv_ctl {
+    double alpha;
+    double min_gain;
+    unsigned long last_ns;
+    int samples;
+    /* smoothed, bytes per ns */
+    double dirty_rate;
+    double bwidth;
+    /* inputs and outputs of the last decision, reported for tuning */
+    uint64_t remaining;
+    double dirty_now;
+    double bwidth_now;
+    double downtime;
+    double next_downtime;
+    /* auto converge, iterations in a row dirtying faster than sending */
+    int over_iters;
+    int throttle;
+};
+
+static inline unsigned long conv_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* called when the first iteration starts */
+static inline void conv_init(struct conv_ctl *c, int alpha_pct, int min_gain_pct) {
+    c->alpha = alpha_pct / 100.0;
+    c->min_gain = min_gain_pct / 100.0;
+    c->last_ns = conv_clock_ns();
+    c->samples = 0;
+    c->dirty_rate = 0;
+    c->bwidth = 0;
+    c->downtime = 0;
+    c->next_downtime = 0;
+    c->over_iters = 0;
+    c->throttle = 0;
+}
+
+static inline double conv_smooth(struct conv_ctl *c, double avg, double sample) {
+    return c->alpha * sample + (1 - c->alpha) * avg;
+}
+
+/* an iteration ended, remaining is in bytes, bwidth in bytes per ns */
+static inline void conv_update(struct conv_ctl *c, uint64_t remaining, double bwidth) {
+    unsigned long now = conv_clock_ns();
+    unsigned long iter_ns = now - c->last_ns;
+
+    c->last_ns = now;
+    c->remaining = remaining;
+    c->dirty_now = iter_ns ? (double)remaining / iter_ns : 0;
+    c->bwidth_now = bwidth;
+
+    //the first sample is taken as is, an iteration sending nothing is no sample
+    c->dirty_rate = c->samples ? conv_smooth(c, c->dirty_rate, c->dirty_now) : c->dirty_now;
+    if (bwidth > 0)
+        c->bwidth = c->bwidth > 0 ? conv_smooth(c, c->bwidth, bwidth) : bwidth;
+    c->samples++;
+
+    if (c->bwidth > 0) {
+        c->downtime = remaining / c->bwidth;
+        c->next_downtime = c->dirty_rate * c->downtime / c->bwidth;
+    }
+}
+
+/* whether the next iteration should be the last, max_downtime in ns */
+static inline int conv_should_stop(struct conv_ctl *c, double max_downtime) {
+    //nothing was sent yet, no estimate
+    if (c->bwidth == 0)
+        return 0;
+
+    if (c->downtime < max_downtime)
+        return 1;
+
+    return c->next_downtime > c->downtime * (1 - c->min_gain);
+}
+
+/*
+ * auto converge: once the guest dirtied faster than the slaves sent for
+ * CONV_THROTTLE_ITERS iterations in a row, its vCPUs are throttled by
+ * initial percent, and by increment more for every such iteration after.
+ * The throttle is kept until the end, the migration converges with it.
+ * Returns the throttle in percent
+ */
+static inline int conv_throttle(struct conv_ctl *c, int initial, int increment) {
+    if (c->dirty_now > c->bwidth_now)
+        c->over_iters++;
+    else
+        c->over_iters = 0;
+
+    if (c->over_iters >= CONV_THROTTLE_ITERS) {
+        c->throttle = c->throttle ? c->throttle + increment : initial;
+        if (c->throttle > CONV_THROTTLE_MAX)
+            c->throttle = CONV_THROTTLE_MAX;
+    }
+
+    return c->throttle;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef MIGR_DUP_H
+#define MIGR_DUP_H
+
+#include <stdint.h>
+
+/*
+ * classicsong
+ * duplicate page detection: is the whole page filled with the byte ch
+ * the slaves call this on every dirty page they send, so the SSE2/AVX2
+ * variants are picked by cpuid the first time it is called. All of them
+ * stop at the first 64 byte line holding a different byte.
+ */
+
+#ifndef DUP_PAGE_SIZE
+#define DUP_PAGE_SIZE 4096
+#endif
+#define DUP_LINE_SIZE 64
+
+static int is_dup_page_generic(uint8_t *page, uint8_t ch)
+{
+    uint64_t val = 0x0101010101010101ULL * ch;
+    uint64_t *array = (uint64_t *)page;
+    int i, j;
+
+    for (i = 0; i < DUP_PAGE_SIZE / 8; i += DUP_LINE_SIZE / 8) {
+        uint64_t diff = 0;
+
+        for (j = 0; j < DUP_LINE_SIZE / 8; j++)
+            diff |= array[i + j] ^ val;
+        if (diff)
+            return 0;
+    }
+
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static int is_dup_page_sse2(uint8_t *page, uint8_t ch)
+{
+    __m128i val = _mm_set1_epi8(ch);
+    __m128i *array = (__m128i *)page;
+    int i;
+
+    for (i = 0; i < DUP_PAGE_SIZE / 16; i += DUP_LINE_SIZE / 16) {
+        __m128i diff = _mm_or_si128(
+            _mm_or_si128(_mm_xor_si128(_mm_load_si128(array + i), val),
+                         _mm_xor_si128(_mm_load_si128(array + i + 1), val)),
+            _mm_or_si128(_mm_xor_si128(_mm_load_si128(array + i + 2), val),
+                         _mm_xor_si128(_mm_load_si128(array + i + 3), val)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff)
+            return 0;
+    }
+
+    return 1;
+}
+
+__attribute__((target("avx2")))
+static int is_dup_page_avx2(uint8_t *page, uint8_t ch)
+{
+    __m256i val = _mm256_set1_epi8(ch);
+    __m256i *array = (__m256i *)page;
+    int i;
+
+    for (i = 0; i < DUP_PAGE_SIZE / 32; i += DUP_LINE_SIZE / 32) {
+        __m256i diff = _mm256_or_si256(
+            _mm256_xor_si256(_mm256_load_si256(array + i), val),
+            _mm256_xor_si256(_mm256_load_si256(array + i + 1), val));
+
+        if (!_mm256_testz_si256(diff, diff))
+            return 0;
+    }
+
+    return 1;
+}
+#endif
+
+typedef int (*is_dup_page_fn)(uint8_t *page, uint8_t ch);
+
+static is_dup_page_fn select_is_dup_page(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return is_dup_page_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return is_dup_page_sse2;
+#endif
+    return is_dup_page_generic;
+}
+
+/* page must be 64 byte aligned */
+static inline int is_dup_page(uint8_t *page, uint8_t ch)
+{
+    static is_dup_page_fn dup_fn;
+
+    if (!dup_fn)
+        dup_fn = select_is_dup_page();
+
+    return dup_fn(page, ch);
+}
+
+#endif
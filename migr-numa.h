@@ -0,0 +1,103 @@
+#ifndef MIGR_NUMA_H
+#define MIGR_NUMA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * classicsong
+ * NUMA helpers of the migration slaves, libnuma is not required:
+ * the cpus of a node are read from sysfs, the memory policy and the
+ * node backing a page go through the raw syscalls
+ */
+
+#define MAX_NUMA_NODES 64
+/* the node of the guest memory is looked up per 2M */
+#define NUMA_GRANULE_SIZE (2 * 1024 * 1024)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* fill set with the cpus of node, return the number of cpus or -1 */
+static inline int numa_node_cpus(int node, cpu_set_t *set)
+{
+    char path[64];
+    FILE *fp;
+    int first, last, nr = 0;
+    char sep;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+
+    /* cpulist looks like 0-7,16-23 */
+    CPU_ZERO(set);
+    while (fscanf(fp, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(fp, "%c", &sep) == 1 && sep == '-') {
+            if (fscanf(fp, "%d", &last) != 1)
+                break;
+            if (fscanf(fp, "%c", &sep) != 1)
+                sep = '\n';
+        }
+
+        for (; first <= last && first < CPU_SETSIZE; first++, nr++)
+            CPU_SET(first, set);
+
+        if (sep != ',')
+            break;
+    }
+
+    fclose(fp);
+    return nr > 0 ? nr : -1;
+}
+
+/*
+ * run the calling thread on the cpus of node and prefer node for
+ * its allocations, return 0 on success
+ */
+static inline int numa_bind_node(int node)
+{
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    cpu_set_t set;
+
+    if (node < 0 || node >= MAX_NUMA_NODES)
+        return -1;
+
+    if (numa_node_cpus(node, &set) < 0 ||
+        sched_setaffinity(0, sizeof(set), &set) < 0)
+        return -1;
+
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODES + 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * nodes[i] gets the node backing pages[i], -1 when the page is not
+ * populated or the kernel has no NUMA support, nothing is moved
+ */
+static inline void numa_page_nodes(void **pages, int *nodes, unsigned long count)
+{
+    unsigned long i;
+
+    if (syscall(__NR_move_pages, 0, count, pages, NULL, nodes, 0) < 0) {
+        for (i = 0; i < count; i++)
+            nodes[i] = -1;
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+        if (nodes[i] < 0 || nodes[i] >= MAX_NUMA_NODES)
+            nodes[i] = -1;
+}
+
+#endif
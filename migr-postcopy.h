@@ -0,0 +1,120 @@
+#ifndef MIGR_POSTCOPY_H
+#define MIGR_POSTCOPY_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/*
+ * classicsong
+ * post-copy of the guest memory
+ * the source stops the guest after the first round and sends the dirty
+ * bitmap instead of the dirty pages. The dest drops those pages and
+ * registers the guest memory with userfaultfd before the guest resumes.
+ * An access to a dropped page stops in the fault thread of the dest, it
+ * asks slave 0 of the source for the page, which is placed with
+ * UFFDIO_COPY, that also wakes the faulting thread. Meanwhile the memory
+ * master queues the pages nobody asked for to the other slaves, starting
+ * again after every fault, so the pages next to it go first. A page is
+ * sent once, by whoever clears its bit in the migration bitmap.
+ * A post-copy page is sent as its ram offset and the page, the stream of
+ * a slave ends with POSTCOPY_EOS
+ */
+#define POSTCOPY_EOS 1 /* no page is at an odd offset */
+#define POSTCOPY_BATCH_LEN 16 /* pages, small so a fault soon moves the push */
+#define POSTCOPY_POLL_MS 10
+
+/*
+ * classicsong
+ * post-copy of the disk, the hybrid migration
+ * the memory is pre-copied, the disk master only reads the disk once in
+ * the background meanwhile. At the switch slave 0 sends a map of the
+ * chunks not sent or dirtied since, the dest puts the block filter of
+ * block/migr-fetch.c in front of those disks before the guest resumes.
+ * A request on a missing chunk waits in the filter, which asks slave 0 for
+ * the chunk, while the disk master reads the chunks nobody asked for to
+ * the other slaves, starting again after the last one asked for.
+ * A chunk goes on the post-copy stream and is asked for as a key with
+ * POSTCOPY_DISK set, which no page offset has, the chunk follows the key
+ * unless POSTCOPY_ZERO is set too. POSTCOPY_EIO instead says the source
+ * could not read the chunk, the requests on it fail on the dest
+ */
+#define POSTCOPY_DISK 2
+#define POSTCOPY_ZERO 4
+#define POSTCOPY_EIO 8
+#define POSTCOPY_DEV_SHIFT 8
+#define POSTCOPY_CHUNK_SHIFT 16
+#define POSTCOPY_DISK_KEY(dev, chunk) \
+    (((uint64_t)(chunk) << POSTCOPY_CHUNK_SHIFT) | \
+     ((uint64_t)(dev) << POSTCOPY_DEV_SHIFT) | POSTCOPY_DISK)
+#define POSTCOPY_KEY_DEV(key) \
+    ((int)(((key) >> POSTCOPY_DEV_SHIFT) & ((1 << (POSTCOPY_CHUNK_SHIFT - POSTCOPY_DEV_SHIFT)) - 1)))
+#define POSTCOPY_KEY_CHUNK(key) ((int64_t)((key) >> POSTCOPY_CHUNK_SHIFT))
+#define POSTCOPY_MAX_DEVS (1 << (POSTCOPY_CHUNK_SHIFT - POSTCOPY_DEV_SHIFT))
+
+/* what follows the QEMU_VM_POSTCOPY marker on the stream of slave 0 */
+#define POSTCOPY_MAP_RAM 1
+#define POSTCOPY_MAP_DISK 2
+
+/* dest, in arch_init.c: ask slave 0 for a page or a chunk, < 0 on failure */
+int postcopy_send_request(uint64_t key);
+
+#if defined(__linux__) && defined(__NR_userfaultfd)
+#include <linux/userfaultfd.h>
+#define HAVE_USERFAULTFD 1
+
+static inline int uffd_open(void) {
+    struct uffdio_api api;
+    int uffd;
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0)
+        return -errno;
+
+    api.api = UFFD_API;
+    api.features = 0;
+    if (ioctl(uffd, UFFDIO_API, &api) < 0) {
+        close(uffd);
+        return -errno;
+    }
+
+    return uffd;
+}
+
+/* faults on missing pages of [start, start + len) go to uffd */
+static inline int uffd_register(int uffd, void *start, unsigned long len) {
+    struct uffdio_register reg;
+
+    reg.range.start = (unsigned long)start;
+    reg.range.len = len;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+    return ioctl(uffd, UFFDIO_REGISTER, &reg) < 0 ? -errno : 0;
+}
+
+/* place len bytes of src at dst and wake the threads faulting on it */
+static inline int uffd_copy(int uffd, void *dst, void *src, unsigned long len) {
+    struct uffdio_copy copy;
+
+    copy.dst = (unsigned long)dst;
+    copy.src = (unsigned long)src;
+    copy.len = len;
+    copy.mode = 0;
+
+    return ioctl(uffd, UFFDIO_COPY, &copy) < 0 ? -errno : 0;
+}
+
+static inline int uffd_zeropage(int uffd, void *dst, unsigned long len) {
+    struct uffdio_zeropage zero;
+
+    zero.range.start = (unsigned long)dst;
+    zero.range.len = len;
+    zero.mode = 0;
+
+    return ioctl(uffd, UFFDIO_ZEROPAGE, &zero) < 0 ? -errno : 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef MIGR_RATE_H
+#define MIGR_RATE_H
+
+#include <time.h>
+
+#include "atomic.h"
+
+/*
+ * classicsong
+ * token bucket rate limit of the slaves
+ * all slaves of a migration take from one shared bucket, so the migration
+ * as a whole is capped and an idle slave leaves its share to the busy ones.
+ * The tokens are bytes, a refill adds them for the time passed since the
+ * last one, up to burst_ns worth. A sender takes its bytes at once and
+ * sleeps off the deficit when the bucket went below zero, so a send larger
+ * than the burst does not starve. Only cmpxchg is used, no lock is taken.
+ */
+#define TOKEN_BURST_NS 10000000 /* 10ms of the shared rate */
+#define TOKEN_RESERVE_NS 1000000000 /* 1s of the per-slave minimum */
+#define TOKEN_MAX_WAIT_NS 1000000000 /* a rate cut never blocks longer */
+
+struct token_bucket {
+    volatile unsigned long rate; /* bytes per second, 0 is unlimited */
+    volatile unsigned long tokens; /* signed, below 0 while in deficit */
+    volatile unsigned long last_ns;
+    unsigned long burst_ns;
+};
+
+static inline unsigned long token_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline long token_burst(struct token_bucket *b, unsigned long rate) {
+    return rate / 1000 * (b->burst_ns / 1000000);
+}
+
+static inline void token_bucket_init(struct token_bucket *b, unsigned long burst_ns,
+                                     unsigned long rate) {
+    b->rate = rate;
+    b->burst_ns = burst_ns;
+    b->tokens = token_burst(b, rate);
+    b->last_ns = token_clock_ns();
+}
+
+static inline void token_bucket_set_rate(struct token_bucket *b, unsigned long rate) {
+    b->rate = rate;
+}
+
+/* add the tokens of the time since the last refill, one thread wins it */
+static inline void token_bucket_refill(struct token_bucket *b, unsigned long rate) {
+    unsigned long now = token_clock_ns();
+    unsigned long last = b->last_ns;
+    long burst = token_burst(b, rate);
+    long add, tokens, new_tokens;
+
+    if (now <= last || atomic_cmpxchg_long(&b->last_ns, last, now) != last)
+        return;
+
+    //a sender waits for at most TOKEN_MAX_WAIT_NS of deficit, refill no more
+    if (now - last >= TOKEN_MAX_WAIT_NS + b->burst_ns)
+        add = rate / 1000 * ((TOKEN_MAX_WAIT_NS + b->burst_ns) / 1000000);
+    else
+        add = (now - last) * (rate / 1000) / 1000000;
+
+    do {
+        tokens = (long)b->tokens;
+        new_tokens = tokens + add > burst ? burst : tokens + add;
+        if (new_tokens <= tokens)
+            return;
+    } while (atomic_cmpxchg_long(&b->tokens, tokens, new_tokens) != (unsigned long)tokens);
+}
+
+/* take size bytes, return the ns to wait before sending them */
+static inline unsigned long token_bucket_take(struct token_bucket *b, unsigned long size) {
+    unsigned long rate = b->rate;
+    unsigned long wait;
+    long tokens;
+
+    if (rate == 0)
+        return 0;
+
+    token_bucket_refill(b, rate);
+    do {
+        tokens = (long)b->tokens;
+    } while (atomic_cmpxchg_long(&b->tokens, tokens, tokens - size) != (unsigned long)tokens);
+
+    tokens -= size;
+    if (tokens >= 0)
+        return 0;
+
+    wait = (double)-tokens * 1000000000 / rate;
+    return wait > TOKEN_MAX_WAIT_NS ? TOKEN_MAX_WAIT_NS : wait;
+}
+
+/*
+ * the reserve of a slave is its own bucket filled at the per-slave minimum,
+ * a send it covers does not touch the shared bucket, only its slave uses it
+ */
+static inline unsigned long token_take(struct token_bucket *shared,
+                                       struct token_bucket *reserve,
+                                       unsigned long size) {
+    if (reserve && reserve->rate) {
+        token_bucket_refill(reserve, reserve->rate);
+        if ((long)reserve->tokens >= (long)size) {
+            reserve->tokens -= size;
+            return 0;
+        }
+    }
+
+    return shared ? token_bucket_take(shared, size) : 0;
+}
+
+#endif
@@ -3,9 +3,16 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "block.h"
 #include "atomic.h"
+#include "qemu-barrier.h"
 
 #define SLEEP_SHORT_TIME 1000
 
@@ -32,46 +39,283 @@
 #define DEFAULT_DISK_BATCH_LEN (DEFAULT_DISK_BATCH_SIZE/BLOCK_SIZE)
 #define DEFAULT_DISK_BATCH_MIN_LEN (DEFAULT_DISK_BATCH_LEN/2)
 
+struct task_page {
+    uint8_t *ptr;
+    unsigned long addr;
+    void *block;
+};
+
+/*
+ * the entries are sized by the pool class of the body, see task_body_new
+ */
 struct task_body {
     int type;
     int len;
+    int iter_num;
+    int size_class;
     union {
-        struct {
-            uint8_t *ptr;
-            unsigned long addr;
-            void *block;
-        } pages[DEFAULT_MEM_BATCH_LEN];
+        struct task_page pages[0];
         struct {
             void *ptr;
-        } blocks[DEFAULT_DISK_BATCH_LEN];
+        } blocks[0];
     };
-    int iter_num;
 };
 
-struct linked_list {
-    struct linked_list *next;
-    struct linked_list *prev;
+/*
+ * Bounded multi-producer/multi-consumer ring of task pointers.
+ * Every slot carries a sequence number: a producer may fill slot
+ * (pos & mask) once its seq equals pos, a consumer may drain it once
+ * its seq equals pos + 1. head and tail are claimed with cmpxchg,
+ * so neither side ever takes a lock or allocates memory.
+ */
+#define TASK_QUEUE_SLOTS 4096 /* must be a power of two */
+#define TASK_CACHELINE 64
+
+struct task_slot {
+    volatile unsigned long seq;
+    void *body;
+};
+
+struct task_ring {
+    volatile unsigned long head;
+    char pad0[TASK_CACHELINE - sizeof(unsigned long)];
+    volatile unsigned long tail;
+    char pad1[TASK_CACHELINE - sizeof(unsigned long)];
+    unsigned long mask;
+    struct task_slot *slots;
+};
+
+static inline void task_ring_init(struct task_ring *ring, unsigned long nr_slots) {
+    unsigned long i;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->mask = nr_slots - 1;
+    ring->slots = (struct task_slot *)malloc(nr_slots * sizeof(struct task_slot));
+    for (i = 0; i < nr_slots; i++) {
+        ring->slots[i].seq = i;
+        ring->slots[i].body = NULL;
+    }
+}
+
+/* return 0 on success, -1 if the ring is full */
+static inline int task_ring_push(struct task_ring *ring, void *body) {
+    struct task_slot *slot;
+    unsigned long pos = ring->head;
+    long diff;
+
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        diff = (long)slot->seq - (long)pos;
+        if (diff == 0) {
+            if (atomic_cmpxchg_long(&ring->head, pos, pos + 1) == pos)
+                break;
+            pos = ring->head;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = ring->head;
+        }
+    }
+
+    slot->body = body;
+    barrier();
+    slot->seq = pos + 1;
+
+    return 0;
+}
+
+/* return 1 on success, -1 if the ring is empty */
+static inline int task_ring_pop(struct task_ring *ring, void **body) {
+    struct task_slot *slot;
+    unsigned long pos = ring->tail;
+    long diff;
+
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        diff = (long)slot->seq - (long)(pos + 1);
+        if (diff == 0) {
+            if (atomic_cmpxchg_long(&ring->tail, pos, pos + 1) == pos)
+                break;
+            pos = ring->tail;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = ring->tail;
+        }
+    }
+
+    *body = slot->body;
+    barrier();
+    slot->seq = pos + ring->mask + 1;
+
+    return 1;
+}
+
+static inline unsigned long task_ring_count(struct task_ring *ring) {
+    unsigned long tail = ring->tail;
+    unsigned long head = ring->head;
+
+    return (head > tail) ? head - tail : 0;
+}
+
+static inline unsigned long task_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Sleep/wakeup point for the queue consumers.
+ * A consumer samples seq with task_event_prepare before it looks at the
+ * queues and the barrier states, and only sleeps in task_event_wait if
+ * seq is still unchanged; producers bump seq on every push or state
+ * change, so a wakeup can never be lost between the check and the sleep.
+ * The futex syscall is skipped while nobody is waiting.
+ */
+#define TASK_EVENT_TIMEOUT_NS 100000000 /* 100ms, safety net only */
+
+struct task_event {
+    atomic_t seq;
+    atomic_t waiters;
+};
+
+static inline void task_event_init(struct task_event *ev) {
+    atomic_set(&ev->seq, 0);
+    atomic_set(&ev->waiters, 0);
+}
+
+static inline int task_event_prepare(struct task_event *ev) {
+    int seq = atomic_read(&ev->seq);
+
+    barrier();
+    return seq;
+}
+
+static inline void task_event_wait(struct task_event *ev, int seq, long timeout_ns) {
+    struct timespec ts = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+
+    atomic_inc(&ev->waiters);
+    if (atomic_read(&ev->seq) == seq)
+        syscall(SYS_futex, &ev->seq.counter, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+    atomic_dec(&ev->waiters);
+}
+
+static inline void task_event_notify(struct task_event *ev) {
+    atomic_inc(&ev->seq);
+    if (atomic_read(&ev->waiters) > 0)
+        syscall(SYS_futex, &ev->seq.counter, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * classicsong
+ * object pools of the migration threads
+ * an object put back goes to the free ring and is handed out again, so a
+ * long migration does not go through malloc for every batch and chunk.
+ * At most max_alloc objects of a pool are out, pool_get sleeps until one
+ * is put back, and the free ring holds all of them, so the pool only grows
+ * to its peak use and never gives memory back
+ */
+struct migr_pool {
+    struct task_ring free;
+    size_t size;
+    size_t align;
+    unsigned long max_alloc;
+    volatile unsigned long nr_alloc;
+    /* notified on put */
+    struct task_event event;
 };
 
-static inline void INIT_LIST_HEAD(struct linked_list *list) {
-    list->next = list;
-    list->prev = list;
+static inline void pool_init(struct migr_pool *pool, size_t size, size_t align,
+                             unsigned long max_alloc) {
+    unsigned long slots = 1;
+
+    while (slots < max_alloc)
+        slots <<= 1;
+
+    task_ring_init(&pool->free, slots);
+    pool->size = size;
+    pool->align = align;
+    pool->max_alloc = max_alloc;
+    pool->nr_alloc = 0;
+    task_event_init(&pool->event);
+}
+
+static inline void *pool_get(struct migr_pool *pool) {
+    void *obj;
+    unsigned long nr;
+    int seq;
+
+    for (;;) {
+        seq = task_event_prepare(&pool->event);
+        if (task_ring_pop(&pool->free, &obj) > 0)
+            return obj;
+
+        nr = pool->nr_alloc;
+        if (nr < pool->max_alloc) {
+            if (atomic_cmpxchg_long(&pool->nr_alloc, nr, nr + 1) != nr)
+                continue;
+            return pool->align ? qemu_memalign(pool->align, pool->size) :
+                qemu_malloc(pool->size);
+        }
+
+        task_event_wait(&pool->event, seq, TASK_EVENT_TIMEOUT_NS);
+    }
+}
+
+static inline void pool_put(struct migr_pool *pool, void *obj) {
+    /* never full, it has a slot for every object of the pool */
+    task_ring_push(&pool->free, obj);
+    task_event_notify(&pool->event);
 }
 
-static inline void __list_add(struct linked_list *new, struct linked_list *prev, struct linked_list *next) {
-    next->prev = new;
-    new->next = next;
-    new->prev = prev;
-    prev->next = new;
+/*
+ * task bodies come in TASK_BODY_CLASSES sizes, class c has room for
+ * 8 << (3 * c) pages, up to DEFAULT_MEM_BATCH_LEN. A disk body fits in
+ * class 0. Class c is capped so its bodies describe at most MAX_DATA_BUF
+ * of guest memory
+ */
+#define TASK_BODY_CLASSES 3
+#define TASK_BODY_CLASS_PAGES(c) (8 << (3 * (c)))
+
+extern struct migr_pool task_body_pool[TASK_BODY_CLASSES];
+
+static inline void task_body_pool_init(void) {
+    static int inited;
+    int c;
+
+    if (inited)
+        return;
+
+    for (c = 0; c < TASK_BODY_CLASSES; c++)
+        pool_init(&task_body_pool[c],
+                  sizeof(struct task_body) + TASK_BODY_CLASS_PAGES(c) * sizeof(struct task_page),
+                  0, MAX_DATA_BUF / (TASK_BODY_CLASS_PAGES(c) * TARGET_PAGE_SIZE));
+    inited = 1;
 }
 
-static inline void list_add_tail(struct linked_list *new, struct linked_list *head) {
-    __list_add(new, head->prev, head);
+/* a body with room for nr entries of type */
+static inline struct task_body *task_body_new(int type, int nr, int iter_num) {
+    size_t bytes = nr * (type == TASK_TYPE_MEM ? sizeof(struct task_page) : sizeof(void *));
+    struct task_body *body;
+    int c;
+
+    for (c = 0; c < TASK_BODY_CLASSES - 1; c++)
+        if (bytes <= TASK_BODY_CLASS_PAGES(c) * sizeof(struct task_page))
+            break;
+
+    body = (struct task_body *)pool_get(&task_body_pool[c]);
+    body->type = type;
+    body->len = 0;
+    body->iter_num = iter_num;
+    body->size_class = c;
+
+    return body;
 }
 
-static inline void __list_del(struct linked_list *prev, struct linked_list *next) {
-    next->prev = prev;
-    prev->next = next;
+static inline void task_body_free(struct task_body *body) {
+    pool_put(&task_body_pool[body->size_class], body);
 }
 
 #define BARR_STATE_ITER_ERR 0
@@ -80,35 +324,116 @@ static inline void __list_del(struct linked_list *prev, struct linked_list *next
 #define BARR_STATE_SKIP 3
 #define BARR_STATE_ITER_TERMINATE 4
 
+/*
+ * classicsong
+ * pipelined iterations
+ * the slaves only meet the masters at the start and at the end of the
+ * migration, between the iterations only the two masters meet on
+ * next_iter_barr. The masters publish the last iteration they queued in
+ * mem_scanned/disk_scanned, a slave closes its iteration e by sending
+ * ITER_END once e is queued and no task of e is left anywhere, so the
+ * dirty bitmap of e + 1 is synced while the slaves send the tail of e.
+ * slave_iter[i] is the first iteration slave i has not closed, a master
+ * scans iteration e only when every slave closed e - 2 (e - 1 in strict
+ * mode), so epoch_pending of the queues is indexed by the parity of e
+ */
 struct migration_barrier {
     volatile int mem_state;
     volatile int disk_state;
+    /* signalled on every task push and every state change */
+    struct task_event event;
     pthread_barrier_t sender_iter_barr;
     pthread_barrier_t next_iter_barr;
     pthread_mutex_t master_lock;
-};
-
-struct migration_task {
-    struct linked_list list;
-    void *body;
+    volatile int mem_scanned;
+    volatile int disk_scanned;
+    int nr_slaves;
+    volatile int slave_iter[32];
+    /*
+     * strict mode: the slaves wait for the ack of ITER_END and the next
+     * iteration is queued when all dests acked, for the XBZRLE deltas
+     */
+    int strict;
+    /* signalled when a slave closes an iteration */
+    struct task_event iter_event;
+    /*
+     * post-copy, see migr-postcopy.h: slave 0 leaves the page after the
+     * last fault in fault_hint (+1, 0 is none), postcopy_pushed is set once
+     * the memory master queued every page, postcopy_slaves counts the
+     * slaves still sending
+     */
+    int postcopy;
+    volatile unsigned long fault_hint;
+    volatile int postcopy_pushed;
+    atomic_t postcopy_slaves;
+    /*
+     * disk post-copy: disk_fault_hint is the key of the last chunk asked
+     * for (0 is none), disk_pushed is set once the disk master queued
+     * every chunk
+     */
+    int disk_postcopy;
+    volatile uint64_t disk_fault_hint;
+    volatile int disk_pushed;
 };
 
 struct disk_task {
     void *bs;
     int64_t addr;
-    void *buf;
+    void *buf; /* NULL for a chunk of zeroes */
     int nr_sectors;
+    int vnum; /* iteration of the chunk, see disk_task_stale */
 };
 
+/*
+ * dest disk writers merge up to DISK_COALESCE_CHUNKS contiguous chunks
+ * into one vectored write, waiting at most DISK_COALESCE_NS for the next
+ */
+#define DISK_COALESCE_CHUNKS 16
+#define DISK_COALESCE_NS 1000000
+
 struct banner {
-    pthread_barrier_t end_barrier;
+    /* slaves that got ITER_END of the current iteration */
+    atomic_t iter_done;
+    /* slaves that got EOF */
     atomic_t slave_done;
     volatile int end;
+    /* signalled on reduce_q push, slave_done and end */
+    struct task_event event;
 };
 
 struct migration_task_queue {
-    struct linked_list list_head;
-    pthread_mutex_t task_lock;
+    struct task_ring ring;
+    /*
+     * shard mode: one ring per slave, slave i only sends the tasks
+     * pushed to shards[i], NULL when all slaves share ring
+     */
+    struct task_ring *shards;
+    int nr_shards;
+    /* NUMA node of the slave of every shard, NULL if not NUMA aware */
+    int *shard_node;
+    /*
+     * work stealing mode: a slave with an empty shard pops from the
+     * others, batch_len[i] is the batch of slave i in pages
+     */
+    int steal;
+    volatile int batch_len[32];
+    /*
+     * event notified on push, points to own_event unless the
+     * consumers share one event among several queues
+     */
+    struct task_event *event;
+    struct task_event own_event;
+    /* notified on pop, producers wait on it for room in the queue */
+    struct task_event space_event;
+    /* bodies of an iteration queued or being sent, by iteration parity */
+    atomic_t epoch_pending[2];
+    /* bytes the bodies of both counted above describe, see task_body_bytes */
+    volatile unsigned long pending_bytes;
+    /*
+     * the bodies belong to no iteration and are not counted, the disk
+     * queue of the disk post-copy
+     */
+    int untracked;
     union {
         int section_id;
         int nr_slaves;
@@ -118,9 +443,19 @@ struct migration_task_queue {
     unsigned long data_remaining;
     unsigned long sent_this_iter;
     unsigned long sent_last_iter;
-    volatile int task_pending;
     double bwidth;
-    unsigned long slave_sent[32];
+    /* added to by the slaves, taken by the master with queue_take_sent */
+    volatile unsigned long slave_sent[32];
+    /* ns the slaves spent sending this iteration */
+    volatile unsigned long slave_busy_ns[32];
+    /*
+     * push/pop latency accounting
+     * read and reset by the masters once per iteration
+     */
+    volatile unsigned long nr_push;
+    volatile unsigned long push_ns;
+    volatile unsigned long nr_pop;
+    volatile unsigned long pop_ns;
 };
 
 struct migration_slave{
@@ -130,19 +465,47 @@ struct migration_slave{
 
 static void 
 init_migr_barrier(struct migration_barrier *barr, int num_slaves) {
+    int i;
+
     barr->mem_state = BARR_STATE_ITER_ERR;
     barr->disk_state = BARR_STATE_ITER_ERR;
+    task_event_init(&barr->event);
     //barrier for master and the main process
     pthread_barrier_init(&barr->sender_iter_barr, NULL, num_slaves + 2);
-    pthread_barrier_init(&barr->next_iter_barr, NULL, num_slaves + 2);
+    //barrier for the two masters between the iterations
+    pthread_barrier_init(&barr->next_iter_barr, NULL, 2);
     pthread_mutex_init(&barr->master_lock, NULL);
+    barr->mem_scanned = -1;
+    barr->disk_scanned = -1;
+    barr->nr_slaves = num_slaves;
+    for (i = 0; i < 32; i++)
+        barr->slave_iter[i] = 0;
+    barr->strict = 0;
+    task_event_init(&barr->iter_event);
+    barr->postcopy = 0;
+    barr->fault_hint = 0;
+    barr->postcopy_pushed = 0;
+    atomic_set(&barr->postcopy_slaves, 0);
+    barr->disk_postcopy = 0;
+    barr->disk_fault_hint = 0;
+    barr->disk_pushed = 0;
 }
 
 static struct migration_task_queue * new_task_queue(void) {
     int i;
     struct migration_task_queue *task_queue = (struct migration_task_queue *)malloc(sizeof(struct migration_task_queue));
-    INIT_LIST_HEAD(&(task_queue->list_head));
-    pthread_mutex_init(&(task_queue->task_lock), NULL);
+    task_ring_init(&task_queue->ring, TASK_QUEUE_SLOTS);
+    task_queue->shards = NULL;
+    task_queue->nr_shards = 0;
+    task_queue->shard_node = NULL;
+    task_queue->steal = 0;
+    task_event_init(&task_queue->own_event);
+    task_queue->event = &task_queue->own_event;
+    task_event_init(&task_queue->space_event);
+    atomic_set(&task_queue->epoch_pending[0], 0);
+    atomic_set(&task_queue->epoch_pending[1], 0);
+    task_queue->pending_bytes = 0;
+    task_queue->untracked = 0;
     task_queue->section_id = 0;
     task_queue->force_end = 0;
     task_queue->iter_num = 0;
@@ -150,48 +513,320 @@ static struct migration_task_queue * new_task_queue(void) {
     task_queue->bwidth = 0;
     task_queue->sent_this_iter = 0;
     task_queue->sent_last_iter = 0;
-    task_queue->task_pending = 0;
-    for ( i = 0; i < 32; i++ )
+    for ( i = 0; i < 32; i++ ) {
         task_queue->slave_sent[i] = 0;
+        task_queue->slave_busy_ns[i] = 0;
+        task_queue->batch_len[i] = DEFAULT_MEM_BATCH_LEN;
+    }
+    task_queue->nr_push = 0;
+    task_queue->push_ns = 0;
+    task_queue->nr_pop = 0;
+    task_queue->pop_ns = 0;
 
     return task_queue;
 }
 
-static int queue_pop_task(struct migration_task_queue *task_queue, void **arg) {
-    pthread_mutex_lock(&(task_queue->task_lock));
-    if (task_queue->list_head.next == &task_queue->list_head) {
-        pthread_mutex_unlock(&(task_queue->task_lock));
+static inline void queue_set_event(struct migration_task_queue *task_queue,
+                                   struct task_event *ev) {
+    task_queue->event = ev;
+}
+
+static inline void migr_barrier_set_mem_state(struct migration_barrier *barr, int state) {
+    barr->mem_state = state;
+    task_event_notify(&barr->event);
+}
+
+static inline void migr_barrier_set_disk_state(struct migration_barrier *barr, int state) {
+    barr->disk_state = state;
+    task_event_notify(&barr->event);
+}
+
+/* all tasks of iteration iter are queued */
+static inline void migr_barrier_set_mem_scanned(struct migration_barrier *barr, int iter) {
+    barr->mem_scanned = iter;
+    task_event_notify(&barr->event);
+}
+
+static inline void migr_barrier_set_disk_scanned(struct migration_barrier *barr, int iter) {
+    barr->disk_scanned = iter;
+    task_event_notify(&barr->event);
+}
+
+/* the first iteration not closed by every slave */
+static inline int migr_barrier_min_iter(struct migration_barrier *barr) {
+    int i, iter = barr->slave_iter[0];
+
+    for (i = 1; i < barr->nr_slaves; i++)
+        if (barr->slave_iter[i] < iter)
+            iter = barr->slave_iter[i];
+    return iter;
+}
+
+/* master: wait until every slave closed iteration iter */
+static inline void migr_barrier_wait_closed(struct migration_barrier *barr, int iter) {
+    int seq;
+
+    while (1) {
+        seq = task_event_prepare(&barr->iter_event);
+        if (migr_barrier_min_iter(barr) > iter)
+            return;
+        task_event_wait(&barr->iter_event, seq, TASK_EVENT_TIMEOUT_NS);
+    }
+}
+
+/* master: wait until the tasks of iteration iter may be queued */
+static inline void migr_barrier_wait_iter(struct migration_barrier *barr, int iter) {
+    migr_barrier_wait_closed(barr, iter - (barr->strict ? 1 : 2));
+}
+
+/* slave: slave_id closed the iteration slave_iter[slave_id] */
+static inline void migr_barrier_close_iter(struct migration_barrier *barr, int slave_id) {
+    barr->slave_iter[slave_id]++;
+    task_event_notify(&barr->iter_event);
+}
+
+static inline void queue_enable_shards(struct migration_task_queue *task_queue, int nr_shards) {
+    int i;
+
+    task_queue->shards = (struct task_ring *)malloc(nr_shards * sizeof(struct task_ring));
+    for (i = 0; i < nr_shards; i++)
+        task_ring_init(&task_queue->shards[i], TASK_QUEUE_SLOTS);
+    task_queue->nr_shards = nr_shards;
+}
+
+/*
+ * work stealing mode of the memory queue
+ * every slave has its own shard, the scanners deal the batches out to the
+ * shards in turn and a slave whose shard is empty steals from its peers.
+ * The batch of a slave is sized to its send rate of the last iteration,
+ * the fastest slave gets DEFAULT_MEM_BATCH_LEN pages, so every batch takes
+ * about the same time and no slave is left with a long one at the end
+ */
+#define MIN_MEM_BATCH_LEN 16
+
+static inline void queue_enable_stealing(struct migration_task_queue *task_queue, int nr_slaves) {
+    queue_enable_shards(task_queue, nr_slaves);
+    task_queue->steal = 1;
+}
+
+/* pages in the next batch for shard */
+static inline int queue_batch_len(struct migration_task_queue *task_queue, int shard) {
+    return task_queue->steal ? task_queue->batch_len[shard] : DEFAULT_MEM_BATCH_LEN;
+}
+
+/*
+ * master: the bytes slave i sent since the last call, the slaves do not
+ * stop meanwhile so the counter is swapped with 0
+ */
+static inline unsigned long queue_take_sent(struct migration_task_queue *task_queue, int i) {
+    return __sync_lock_test_and_set(&task_queue->slave_sent[i], 0);
+}
+
+/*
+ * called by the master at the iteration end with the bytes every slave
+ * sent, see queue_take_sent
+ * a slave that sent nothing keeps its batch, the new batch is halfway
+ * between the old one and the target so one slow iteration does not
+ * shrink it all at once
+ */
+static inline void queue_adapt_batch(struct migration_task_queue *task_queue,
+                                     unsigned long *sent) {
+    double rate[32], max_rate = 0;
+    unsigned long busy;
+    int i, len;
+
+    if (!task_queue->steal)
+        return;
+
+    for (i = 0; i < task_queue->nr_shards; i++) {
+        busy = __sync_lock_test_and_set(&task_queue->slave_busy_ns[i], 0);
+        rate[i] = busy ? (double)sent[i] / busy : 0;
+        if (rate[i] > max_rate)
+            max_rate = rate[i];
+    }
+
+    if (max_rate == 0)
+        return;
+
+    for (i = 0; i < task_queue->nr_shards; i++) {
+        if (rate[i] == 0)
+            continue;
+        len = DEFAULT_MEM_BATCH_LEN * rate[i] / max_rate;
+        if (len < MIN_MEM_BATCH_LEN)
+            len = MIN_MEM_BATCH_LEN;
+        task_queue->batch_len[i] = (task_queue->batch_len[i] + len) / 2;
+    }
+}
+
+/* the tasks of shard i should be read on node shard_node[i] */
+static inline void queue_set_shard_nodes(struct migration_task_queue *task_queue, int *shard_node) {
+    task_queue->shard_node = shard_node;
+}
+
+static inline unsigned long queue_task_pending(struct migration_task_queue *task_queue) {
+    unsigned long pending = task_ring_count(&task_queue->ring);
+    int i;
+
+    for (i = 0; i < task_queue->nr_shards; i++)
+        pending += task_ring_count(&task_queue->shards[i]);
+
+    return pending;
+}
+
+static inline int queue_pop_ring(struct migration_task_queue *task_queue,
+                                 struct task_ring *ring, void **arg) {
+    unsigned long start = task_clock_ns();
+
+    if (task_ring_pop(ring, arg) < 0)
         return -1;
-    } else {
-        struct migration_task *task;
-        task = (struct migration_task *)task_queue->list_head.next;
-        __list_del(task->list.prev, task->list.next);
+    task_event_notify(&task_queue->space_event);
 
-        task_queue->task_pending --;
-        *arg = task->body;
-        free(task);
-    }    
-    pthread_mutex_unlock(&(task_queue->task_lock));
+    atomic_add_long(task_clock_ns() - start, &task_queue->pop_ns);
+    atomic_add_long(1, &task_queue->nr_pop);
 
     return 1;
 }
 
-static int queue_push_task(struct migration_task_queue *task_queue, void *body) {
-    struct migration_task *task = (struct migration_task *)malloc(sizeof(struct migration_task));
+static inline int queue_push_ring(struct migration_task_queue *task_queue,
+                                  struct task_ring *ring, void *body) {
+    unsigned long start = task_clock_ns();
 
-    if (task < 0) {
-        fprintf(stderr, "error allock task");
-        return -1;
+    /*
+     * the ring is bounded, a full ring means the slaves are behind
+     * so just give them the cpu until a slot is freed
+     */
+    while (task_ring_push(ring, body) < 0)
+        sched_yield();
+    task_event_notify(task_queue->event);
+
+    atomic_add_long(task_clock_ns() - start, &task_queue->push_ns);
+    atomic_add_long(1, &task_queue->nr_push);
+
+    return 0;
+}
+
+/*
+ * producer backpressure: sleep until no more than max tasks are pending,
+ * every pop wakes the waiting producer
+ */
+static inline void queue_wait_space(struct migration_task_queue *task_queue,
+                                    unsigned long max) {
+    int seq;
+
+    for (;;) {
+        seq = task_event_prepare(&task_queue->space_event);
+        if (queue_task_pending(task_queue) <= max)
+            return;
+        task_event_wait(&task_queue->space_event, seq, TASK_EVENT_TIMEOUT_NS);
     }
+}
+
+static inline int queue_pop_task(struct migration_task_queue *task_queue,
+                                 void **arg) {
+    return queue_pop_ring(task_queue, &task_queue->ring, arg);
+}
+
+static inline int queue_push_task(struct migration_task_queue *task_queue,
+                                  void *body) {
+    return queue_push_ring(task_queue, &task_queue->ring, body);
+}
+
+/*
+ * pop for slave id: its own shard in shard mode, then the shards of the
+ * next slaves in stealing mode, the shared ring otherwise
+ */
+static inline int queue_pop_task_slave(struct migration_task_queue *task_queue,
+                                       int id, void **arg) {
+    int i;
 
-    pthread_mutex_lock(&(task_queue->task_lock));
-    task->body = body;
-    list_add_tail(&task->list, &task_queue->list_head);
-    task_queue->task_pending ++;
+    if (task_queue->shards == NULL)
+        return queue_pop_ring(task_queue, &task_queue->ring, arg);
 
-    pthread_mutex_unlock(&(task_queue->task_lock));
+    if (queue_pop_ring(task_queue, &task_queue->shards[id], arg) > 0)
+        return 1;
 
+    if (task_queue->steal)
+        for (i = 1; i < task_queue->nr_shards; i++)
+            if (queue_pop_ring(task_queue,
+                               &task_queue->shards[(id + i) % task_queue->nr_shards], arg) > 0)
+                return 1;
+
+    return -1;
+}
+
+static inline int queue_push_task_shard(struct migration_task_queue *task_queue,
+                                        int shard, void *body) {
+    if (task_queue->shards)
+        return queue_push_ring(task_queue, &task_queue->shards[shard], body);
+    return queue_push_ring(task_queue, &task_queue->ring, body);
+}
+
+/* the guest data a body describes, before the slave compresses it */
+static inline unsigned long task_body_bytes(struct task_body *body) {
+    return (unsigned long)body->len *
+        (body->type == TASK_TYPE_MEM ? TARGET_PAGE_SIZE : BLOCK_SIZE);
+}
+
+/*
+ * push a task body of the masters, it is counted in epoch_pending of its
+ * iteration and in pending_bytes until the slave sending it calls
+ * queue_body_done
+ */
+static inline int queue_push_body(struct migration_task_queue *task_queue,
+                                  int shard, struct task_body *body) {
+    if (task_queue->untracked)
+        return queue_push_task_shard(task_queue, shard, body);
+
+    atomic_inc(&task_queue->epoch_pending[body->iter_num & 1]);
+    atomic_add_long(task_body_bytes(body), &task_queue->pending_bytes);
+    if (queue_push_task_shard(task_queue, shard, body) < 0) {
+        atomic_add_long(-(long)task_body_bytes(body), &task_queue->pending_bytes);
+        atomic_dec(&task_queue->epoch_pending[body->iter_num & 1]);
+        return -1;
+    }
     return 0;
 }
 
+/* the last body of an iteration wakes the slaves to close it */
+static inline void queue_body_done(struct migration_task_queue *task_queue,
+                                   struct task_body *body) {
+    if (task_queue->untracked)
+        return;
+    atomic_add_long(-(long)task_body_bytes(body), &task_queue->pending_bytes);
+    if (atomic_sub_and_test(1, &task_queue->epoch_pending[body->iter_num & 1]))
+        task_event_notify(task_queue->event);
+}
+
+/* master: bytes queued and not sent yet, to add to the dirty data left */
+static inline unsigned long queue_pending_bytes(struct migration_task_queue *task_queue) {
+    return task_queue->pending_bytes;
+}
+
+/* slave: every task of iteration iter is queued and sent */
+static inline int queue_iter_sent(struct migration_barrier *barr,
+                                  struct migration_task_queue *mem_q,
+                                  struct migration_task_queue *disk_q, int iter) {
+    return barr->mem_scanned >= iter && barr->disk_scanned >= iter &&
+        atomic_read(&mem_q->epoch_pending[iter & 1]) == 0 &&
+        atomic_read(&disk_q->epoch_pending[iter & 1]) == 0;
+}
+
+/*
+ * get the average push/pop latency in ns since the last call
+ * and reset the counters
+ */
+static inline void queue_latency_stat(struct migration_task_queue *task_queue,
+                                      unsigned long *push_avg, unsigned long *pop_avg) {
+    unsigned long nr_push = task_queue->nr_push;
+    unsigned long nr_pop = task_queue->nr_pop;
+
+    *push_avg = nr_push ? task_queue->push_ns / nr_push : 0;
+    *pop_avg = nr_pop ? task_queue->pop_ns / nr_pop : 0;
+
+    task_queue->nr_push = 0;
+    task_queue->push_ns = 0;
+    task_queue->nr_pop = 0;
+    task_queue->pop_ns = 0;
+}
+
 #endif
@@ -0,0 +1,111 @@
+#ifndef MIGR_XBZRLE_H
+#define MIGR_XBZRLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * classicsong
+ * XOR based zero run length encoding of a page against its previous version
+ * the XOR of old and new is a sequence of
+ *   zero run (unchanged bytes) | non-zero run (changed bytes)
+ * every pair is encoded as uleb128(zero run len) uleb128(nzero run len)
+ * followed by the nzero run bytes of the new page, the decoder skips the
+ * zero runs of the page it already holds and copies the rest
+ */
+
+static inline int xbzrle_put_uleb128(uint8_t *dst, int dlen, int pos, uint32_t v)
+{
+    do {
+        if (pos >= dlen)
+            return -1;
+        dst[pos++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+
+    return pos;
+}
+
+static inline int xbzrle_get_uleb128(const uint8_t *src, int slen, int pos, uint32_t *v)
+{
+    int shift = 0;
+    uint8_t b;
+
+    *v = 0;
+    do {
+        if (pos >= slen || shift > 28)
+            return -1;
+        b = src[pos++];
+        *v |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    return pos;
+}
+
+/*
+ * return the encoded length, 0 if the pages are equal,
+ * -1 if the encoding does not fit into dlen bytes
+ */
+static inline int xbzrle_encode(const uint8_t *old, const uint8_t *new,
+                                int len, uint8_t *dst, int dlen)
+{
+    int i = 0, pos = 0;
+    int zrun, nzrun;
+
+    while (i < len) {
+        zrun = i;
+        /* skip unchanged words first */
+        while (i + 8 <= len && *(uint64_t *)(old + i) == *(uint64_t *)(new + i))
+            i += 8;
+        while (i < len && old[i] == new[i])
+            i++;
+        zrun = i - zrun;
+
+        if (i == len)
+            break;
+
+        nzrun = i;
+        while (i < len && old[i] != new[i])
+            i++;
+        nzrun = i - nzrun;
+
+        pos = xbzrle_put_uleb128(dst, dlen, pos, zrun);
+        if (pos < 0)
+            return -1;
+        pos = xbzrle_put_uleb128(dst, dlen, pos, nzrun);
+        if (pos < 0 || pos + nzrun > dlen)
+            return -1;
+        memcpy(dst + pos, new + i - nzrun, nzrun);
+        pos += nzrun;
+    }
+
+    return pos;
+}
+
+/* apply an encoding to page, return 0 on success */
+static inline int xbzrle_decode(const uint8_t *src, int slen, uint8_t *page, int len)
+{
+    int pos = 0, i = 0;
+    uint32_t zrun, nzrun;
+
+    while (pos < slen) {
+        pos = xbzrle_get_uleb128(src, slen, pos, &zrun);
+        if (pos < 0)
+            return -1;
+        pos = xbzrle_get_uleb128(src, slen, pos, &nzrun);
+        if (pos < 0)
+            return -1;
+
+        i += zrun;
+        if (i + nzrun > len || pos + nzrun > slen)
+            return -1;
+        memcpy(page + i, src + pos, nzrun);
+        i += nzrun;
+        pos += nzrun;
+    }
+
+    return 0;
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include "block.h"
 #include "hw/hw.h"
 #include "qemu-timer.h"
+#include "migr-numa.h"
 
 
 #define TARGET_PHYS_ADDR_BITS 64
@@ -25,6 +26,9 @@
     do { } while (0)
 #endif
 
+/* the task bodies of both masters, see task_body_new */
+struct migr_pool task_body_pool[TASK_BODY_CLASSES];
+
 void* host_memory_master(void *data);
 void create_host_memory_master(void *opaque);
 void* host_disk_master(void * data);
@@ -35,9 +39,14 @@ extern int cpu_physical_sync_dirty_bitmap(target_phys_addr_t start_addr,
                                           target_phys_addr_t end_addr);
 extern int cpu_physical_memory_set_dirty_tracking(int enable);
 
+//from qemu-kvm.c
+extern void kvm_set_cpu_throttle(int pct);
+
 //from arch_init.c
 extern unsigned long
 ram_save_iter(int stage, struct migration_task_queue *task_queue, QEMUFile *f);
+extern void ram_postcopy_push(struct migration_task_queue *task_queue,
+                              struct migration_barrier *barr);
 
 //from block-migration.c
 extern uint64_t blk_mig_bytes_total(void);
@@ -47,7 +56,14 @@ extern void blk_mig_cleanup_master(Monitor *mon);
 extern unsigned long block_save_iter(int stage, Monitor *mon, 
                                      struct migration_task_queue *task_queue, QEMUFile *f);
 extern int64_t get_remaining_dirty_master(void);
+extern void ram_scanners_stop(void);
 extern uint64_t blk_read_remaining(void);
+extern void blk_mig_start_readers(int nr_readers);
+extern unsigned long block_save_background(Monitor *mon, struct migration_task_queue *task_q,
+                                           QEMUFile *f, volatile int *stop, int max_pending);
+extern void blk_postcopy_prepare(void);
+extern void blk_postcopy_push(struct migration_task_queue *task_q,
+                              struct migration_barrier *barr);
 
 //borrowed from savevm.c
 #define QEMU_VM_EOF                  0x00
@@ -57,6 +73,79 @@ extern uint64_t blk_read_remaining(void);
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
 
+/*
+ * NUMA mode: memory sent by the slaves of every node this iteration
+ * elapsed is in ns
+ */
+static void report_node_sent(struct FdMigrationState *s, unsigned long *sent,
+                             double elapsed) {
+    unsigned long node_sent[MAX_NUMA_NODES] = { 0 };
+    int i;
+
+    if (s->para_config->slave_node == NULL)
+        return;
+
+    for (i = 0; i < s->para_config->num_slaves; i++)
+        if (s->para_config->slave_node[i] >= 0)
+            node_sent[s->para_config->slave_node[i]] += sent[i];
+
+    for (i = 0; i < MAX_NUMA_NODES; i++)
+        if (node_sent[i])
+            DPRINTF("Mem node %d sent this iter %lx, %f MB/s\n", i, node_sent[i],
+                    node_sent[i] / elapsed * 1000000000 / (1024 * 1024));
+}
+
+/*
+ * classicsong
+ * called by the master getting the master_lock second, the numbers of
+ * both masters for this iteration are in, see migr-conv.h
+ */
+static void master_check_last_iter(struct FdMigrationState *s, int queue_iter, int iter_num) {
+    struct migration_task_queue *mem_q = s->mem_task_queue;
+    struct migration_task_queue *disk_q = s->disk_task_queue;
+    struct conv_ctl *c = &s->conv;
+
+    conv_update(c, mem_q->data_remaining + disk_q->data_remaining,
+                mem_q->bwidth + disk_q->bwidth);
+
+    DPRINTF("Total Iter [%d:%d], data_remain %lx, bwidth %f\n", queue_iter, iter_num,
+            mem_q->data_remaining + disk_q->data_remaining,
+            mem_q->bwidth + disk_q->bwidth);
+    DPRINTF("Sent this iter %lx, sent last iter %lx\n",
+            mem_q->sent_this_iter + disk_q->sent_this_iter,
+            mem_q->sent_last_iter + disk_q->sent_last_iter);
+    DPRINTF("Conv dirty %f (avg %f), bwidth %f (avg %f) B/ns, downtime %.0f ns, next %.0f ns\n",
+            c->dirty_now, c->dirty_rate, c->bwidth_now, c->bwidth,
+            c->downtime, c->next_downtime);
+
+    //post-copy switches after the first round whatever the dirty rate
+    //max_downtime is in ms, the estimate in ns
+    if (conv_should_stop(c, (double)s->para_config->max_downtime * 1000000) ||
+        s->sender_barr->postcopy ||
+        disk_q->force_end == 1 ||
+        mem_q->force_end == 1)
+        s->laster_iter =1;
+
+    if (s->para_config->auto_converge) {
+        kvm_set_cpu_throttle(conv_throttle(c, s->para_config->throttle_initial,
+                                           s->para_config->throttle_increment));
+        DPRINTF("Iter %d vCPU throttle %d%%, %d iters dirtying faster than sending\n",
+                iter_num, c->throttle, c->over_iters);
+    }
+}
+
+/* post-copy: wait until every slave sent its part */
+static void master_wait_postcopy(struct FdMigrationState *s) {
+    int seq;
+
+    for (;;) {
+        seq = task_event_prepare(&s->sender_barr->iter_event);
+        if (atomic_read(&s->sender_barr->postcopy_slaves) == 0)
+            break;
+        task_event_wait(&s->sender_barr->iter_event, seq, TASK_EVENT_TIMEOUT_NS);
+    }
+}
+
 void *
 host_memory_master(void *data) {
     struct FdMigrationState *s = (struct FdMigrationState *)data;
@@ -70,6 +159,9 @@ host_memory_master(void *data) {
     int hold_lock = 0;
     sigset_t set;
     int i;
+    unsigned long push_avg, pop_avg;
+    unsigned long slave_sent[32];
+    int64_t take_ns, last_take_ns;
 
     sigemptyset(&set);
     sigaddset(&set, SIGUSR2);
@@ -83,12 +175,14 @@ host_memory_master(void *data) {
      */
     pthread_barrier_wait(&(s->sender_barr->sender_iter_barr));
     s->mem_task_queue->sent_last_iter = memory_size;
-    s->sender_barr->mem_state = BARR_STATE_ITER_START;
+    migr_barrier_set_mem_state(s->sender_barr, BARR_STATE_ITER_START);
 
     DPRINTF("Start processing memory, %lx\n", s->mem_task_queue->sent_last_iter);
+    last_take_ns = qemu_get_clock_ns(rt_clock);
 
     do {
-        bwidth = qemu_get_clock_ns(rt_clock);
+        //the slaves may still send the tail of the last iteration
+        migr_barrier_wait_iter(s->sender_barr, s->mem_task_queue->iter_num);
 
         DPRINTF("Start mem iter %d\n", s->mem_task_queue->iter_num);
         /*
@@ -100,12 +194,15 @@ host_memory_master(void *data) {
 
     skip_iter:
         /*
-         * add barrier here to sync for iterations
+         * the iteration is queued, the slaves close it on their own once
+         * it is sent, only the masters meet here
          */
-        s->sender_barr->mem_state = BARR_STATE_ITER_END;
-        hold_lock = !pthread_mutex_trylock(&s->sender_barr->master_lock);
+        migr_barrier_set_mem_scanned(s->sender_barr, s->mem_task_queue->iter_num);
+        //disk post-copy: the disk master does not iterate, decide alone
+        hold_lock = !s->sender_barr->disk_postcopy &&
+            !pthread_mutex_trylock(&s->sender_barr->master_lock);
         
-        pthread_barrier_wait(&s->sender_barr->sender_iter_barr);
+        pthread_barrier_wait(&s->sender_barr->next_iter_barr);
 
         /*
          * sync_dirty_bitmap in iteration for the next iter
@@ -115,10 +212,10 @@ host_memory_master(void *data) {
          *    b. reset dirty bit in page table
          * 2. copy the dirty bitmap to user bitmap KVMDirtyLog d.dirty_bitmap
          *    a. KVMDirtyLog.dirty_bitmap is local
-         * 3. copy the dirty_bitmap to a global bitmap using cpu_physical_memory_set_dirty that is 
-         *    modifying ram_list.phys_dirty
-         * Thus calling cpu_physical_sync_dirty_bitmap will not clean the ram_list.phys_dirty
-         *   The dirty flag is reset by cpu_physical_memory_reset_dirty(va, vb, MIGRATION_DIRTY_FLAG)
+         * 3. OR the dirty_bitmap word by word into the global ram_list.migration_dirty
+         *    (cpu_physical_memory_merge_migration_dirty)
+         * Thus calling cpu_physical_sync_dirty_bitmap will not clean the ram_list.migration_dirty
+         *   The dirty bits are cleared by the scanners in ram_save_block_master
          */
         if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
             fprintf(stderr, "get dirty bitmap error\n");
@@ -126,17 +223,33 @@ host_memory_master(void *data) {
             return 0;
         }
 
+        /*
+         * the slaves do not wait for the scans, the bytes taken are sent
+         * since the last take, so is the bandwidth
+         */
+        take_ns = qemu_get_clock_ns(rt_clock);
         s->mem_task_queue->sent_this_iter = 0;
         for ( i = 0; i < s->para_config->num_slaves; i++) {
-            s->mem_task_queue->sent_this_iter += s->mem_task_queue->slave_sent[i];
-            s->mem_task_queue->slave_sent[i] = 0;
+            slave_sent[i] = queue_take_sent(s->mem_task_queue, i);
+            s->mem_task_queue->sent_this_iter += slave_sent[i];
         }
 
-        bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
+        report_node_sent(s, slave_sent, take_ns - last_take_ns);
+
+        //size the batches of the next iteration to the slave rates
+        queue_adapt_batch(s->mem_task_queue, slave_sent);
+        for ( i = 0; i < s->mem_task_queue->nr_shards && s->mem_task_queue->steal; i++)
+            DPRINTF("Slave %d batch %d pages\n", i, s->mem_task_queue->batch_len[i]);
+
+        bwidth = take_ns - last_take_ns;
+        last_take_ns = take_ns;
         DPRINTF("Mem send this iter %lx, bwidth %f\n", s->mem_task_queue->sent_this_iter, bwidth/1000000);
+        queue_latency_stat(s->mem_task_queue, &push_avg, &pop_avg);
+        DPRINTF("Mem queue latency push %lu ns, pop %lu ns\n", push_avg, pop_avg);
         bwidth = s->mem_task_queue->sent_this_iter / bwidth;
 
-        data_remaining = ram_bytes_remaining();
+        //the pages queued and not sent yet are left too
+        data_remaining = ram_bytes_remaining() + queue_pending_bytes(s->mem_task_queue);
         total_sent += s->mem_task_queue->sent_this_iter;
 
         if ((s->mem_task_queue->iter_num >= s->para_config->max_iter) ||
@@ -156,40 +269,19 @@ host_memory_master(void *data) {
             pthread_mutex_unlock(&s->sender_barr->master_lock);
         }
         else {
-            uint64_t total_expected_downtime;
-            uint64_t sent_this_iter;
-            uint64_t sent_last_iter;
             /*
              * failed to get lock first
-             * check for disk info
+             * both masters filled their info, decide on the last iteration
              */
             pthread_mutex_lock(&s->sender_barr->master_lock);
-
-            total_expected_downtime = (s->mem_task_queue->data_remaining + s->disk_task_queue->data_remaining)/
-                (s->mem_task_queue->bwidth + s->disk_task_queue->bwidth);
-            sent_this_iter = s->mem_task_queue->sent_this_iter + s->disk_task_queue->sent_this_iter;
-            sent_last_iter = s->mem_task_queue->sent_last_iter + s->disk_task_queue->sent_last_iter;
-
-            DPRINTF("Total Iter [%d:%d], data_remain %lx, bwidth %f\n", s->mem_task_queue->iter_num, iter_num,
-                    s->mem_task_queue->data_remaining + s->disk_task_queue->data_remaining, 
-                    s->mem_task_queue->bwidth + s->disk_task_queue->bwidth);
-
-            DPRINTF("Sent this iter %lx, sent last iter %lx, expect downtime %ld ns\n", 
-                    sent_this_iter, sent_last_iter, total_expected_downtime);
-
-            if (total_expected_downtime < s->para_config->max_downtime ||
-                sent_this_iter > sent_last_iter ||
-                s->disk_task_queue->force_end == 1 ||
-                s->mem_task_queue->force_end == 1)
-                s->laster_iter =1;
+            master_check_last_iter(s, s->mem_task_queue->iter_num, iter_num);
             pthread_mutex_unlock(&s->sender_barr->master_lock);
         }
 
         //set last iter and reset this iter
         s->mem_task_queue->sent_last_iter = s->mem_task_queue->sent_this_iter;
         s->mem_task_queue->sent_this_iter = 0;
-        //start the next iteration for slaves
-        s->sender_barr->mem_state = BARR_STATE_ITER_START;
+        //both masters know whether it was the last iteration
         pthread_barrier_wait(&s->sender_barr->next_iter_barr);
 
         //total iteration number count
@@ -216,6 +308,8 @@ host_memory_master(void *data) {
     } while (s->laster_iter != 1);
 
     DPRINTF("Done mem iterating\n");
+    //the last iteration is sent before the guest stops
+    migr_barrier_wait_closed(s->sender_barr, s->mem_task_queue->iter_num - 1);
 
     pthread_barrier_wait(&s->last_barr);
 
@@ -229,11 +323,27 @@ host_memory_master(void *data) {
         return 0;
     }
 
-    ram_save_iter(QEMU_VM_SECTION_END, s->mem_task_queue, s->file);
+    /*
+     * post-copy: the dirty pages stay in the bitmap, slave 0 sends it
+     * and they are pushed once the dest resumed the guest
+     */
+    if (s->sender_barr->postcopy) {
+        cpu_physical_memory_set_dirty_tracking(0);
+        ram_scanners_stop();
+        DPRINTF("post-copy of %lx bytes\n", (unsigned long)ram_bytes_remaining());
+    } else
+        ram_save_iter(QEMU_VM_SECTION_END, s->mem_task_queue, s->file);
 
     //wait for slave end
-    s->sender_barr->mem_state = BARR_STATE_ITER_TERMINATE;
+    migr_barrier_set_mem_state(s->sender_barr, BARR_STATE_ITER_TERMINATE);
     pthread_barrier_wait(&s->sender_barr->sender_iter_barr);
+
+    if (s->sender_barr->postcopy) {
+        DPRINTF("switched, post-copy downtime %f\n", (qemu_get_clock_ns(rt_clock) - bwidth)/1000000);
+        ram_postcopy_push(s->mem_task_queue, s->sender_barr);
+    }
+    if (s->sender_barr->postcopy || s->sender_barr->disk_postcopy)
+        master_wait_postcopy(s);
     //last iteration end
     pthread_barrier_wait(&s->last_barr);
     DPRINTF("last iteration time %f\n", (qemu_get_clock_ns(rt_clock) - bwidth)/1000000);
@@ -260,6 +370,39 @@ create_host_memory_master(void *opaque) {
 extern unsigned long total_disk_read;
 extern unsigned long total_disk_put_task;
 
+/*
+ * disk post-copy, see migr-postcopy.h
+ * the disks are read once while the memory master iterates alone, the
+ * chunks not read by the switch or dirtied since make the post-copy map
+ */
+static void host_disk_postcopy(struct FdMigrationState *s) {
+    double bwidth;
+
+    block_save_background(s->mon, s->disk_task_queue, s->file, &s->laster_iter,
+                          s->para_config->num_slaves);
+
+    DPRINTF("done disk background read\n");
+    pthread_barrier_wait(&s->last_barr);
+
+    //the guest is stopped
+    pthread_barrier_wait(&s->last_barr);
+    bwidth = qemu_get_clock_ns(rt_clock);
+    blk_postcopy_prepare();
+
+    migr_barrier_set_disk_state(s->sender_barr, BARR_STATE_ITER_TERMINATE);
+    pthread_barrier_wait(&s->sender_barr->sender_iter_barr);
+
+    DPRINTF("switched, disk post-copy downtime %f\n", (qemu_get_clock_ns(rt_clock) - bwidth)/1000000);
+    blk_postcopy_push(s->disk_task_queue, s->sender_barr);
+    master_wait_postcopy(s);
+
+    //last iteration end
+    pthread_barrier_wait(&s->last_barr);
+
+    blk_mig_cleanup_master(s->mon);
+    DPRINTF("Disk master end\n");
+}
+
 void *
 host_disk_master(void * data) {
     struct FdMigrationState *s = (struct FdMigrationState *) data;
@@ -273,6 +416,8 @@ host_disk_master(void * data) {
     int hold_lock;
     sigset_t set;
     int i;
+    unsigned long push_avg, pop_avg;
+    int64_t take_ns, last_take_ns;
 
     sigemptyset(&set);
     sigaddset(&set, SIGUSR2);
@@ -291,19 +436,30 @@ host_disk_master(void * data) {
 
     DPRINTF("The default disk size is %lx\n", disk_size);
 
+    /* keep disk_read_depth chunks in flight on the source disk */
+    blk_mig_start_readers(s->para_config->disk_read_depth);
+
     /*
      * wait for all slaves and master to be ready
      */
     pthread_barrier_wait(&(s->sender_barr->sender_iter_barr));
     s->disk_task_queue->sent_last_iter = disk_size;
-    s->sender_barr->disk_state = BARR_STATE_ITER_START;
+    migr_barrier_set_disk_state(s->sender_barr, BARR_STATE_ITER_START);
 
     /* Enable dirty disk tracking */
     set_dirty_tracking_master(1);
 
     blk_mig_reset_dirty_cursor_master();
 
+    if (s->sender_barr->disk_postcopy) {
+        host_disk_postcopy(s);
+        return NULL;
+    }
+
+    last_take_ns = qemu_get_clock_ns(rt_clock);
     do {
+        //the slaves may still send the tail of the last iteration
+        migr_barrier_wait_iter(s->sender_barr, s->disk_task_queue->iter_num);
         DPRINTF("Start Disk iteration %d, %lx\n", s->disk_task_queue->iter_num,
                 s->disk_task_queue->sent_this_iter);
         bwidth = qemu_get_clock_ns(rt_clock);
@@ -323,14 +479,15 @@ host_disk_master(void * data) {
 
     skip_iter:
         /*
-         * add barrier here to sync for iterations
+         * the iteration is queued, the slaves close it on their own once
+         * it is sent, only the masters meet here
          */
-        s->sender_barr->disk_state = BARR_STATE_ITER_END;
+        migr_barrier_set_disk_scanned(s->sender_barr, s->disk_task_queue->iter_num);
         DPRINTF("Disk master end, time %f, %ld, %ld\n", (qemu_get_clock_ns(rt_clock) - bwidth)/1000000, 
                 total_disk_read/1000000, total_disk_put_task/1000000);
 
         hold_lock = !pthread_mutex_trylock(&s->sender_barr->master_lock);
-        pthread_barrier_wait(&s->sender_barr->sender_iter_barr);
+        pthread_barrier_wait(&s->sender_barr->next_iter_barr);
 
         /*
          * the dirty bitmap is reset in mig_save_device_dirty 
@@ -339,22 +496,27 @@ host_disk_master(void * data) {
          */
         blk_mig_reset_dirty_cursor_master();
 
+        //sent since the last take, as the memory master
+        take_ns = qemu_get_clock_ns(rt_clock);
         s->disk_task_queue->sent_this_iter = 0;
-        for ( i = 0; i < s->para_config->num_slaves; i++) {
-            s->disk_task_queue->sent_this_iter += s->disk_task_queue->slave_sent[i];
-            s->disk_task_queue->slave_sent[i] = 0;
-        }
+        for ( i = 0; i < s->para_config->num_slaves; i++)
+            s->disk_task_queue->sent_this_iter += queue_take_sent(s->disk_task_queue, i);
 
-        bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
+        bwidth = take_ns - last_take_ns;
+        last_take_ns = take_ns;
         DPRINTF("Disk send this iter %lx, bwidth %f\n", s->disk_task_queue->sent_this_iter, 
                 (bwidth/1000000));
         bwidth = s->disk_task_queue->sent_this_iter / bwidth;
+        queue_latency_stat(s->disk_task_queue, &push_avg, &pop_avg);
+        DPRINTF("Disk queue latency push %lu ns, pop %lu ns\n", push_avg, pop_avg);
 
         /*
          * The data_remaining includes dirty blocks, block have been reading using AIO
          *                             and blocks have bee read but not sent
+         *                             and blocks queued to the slaves
          */
-        data_remaining = get_remaining_dirty_master() + blk_read_remaining();
+        data_remaining = get_remaining_dirty_master() + blk_read_remaining() +
+            queue_pending_bytes(s->disk_task_queue);
         DPRINTF("Disk data_remaining %lx; %lx\n", get_remaining_dirty_master(), data_remaining); 
 
         total_sent += s->disk_task_queue->sent_this_iter;
@@ -376,40 +538,19 @@ host_disk_master(void * data) {
             pthread_mutex_unlock(&s->sender_barr->master_lock);
         }
         else {
-            uint64_t total_expected_downtime;
-            uint64_t sent_this_iter;
-            uint64_t sent_last_iter;
             /*
              * failed to get lock first
-             * check for disk info
+             * both masters filled their info, decide on the last iteration
              */
             pthread_mutex_lock(&s->sender_barr->master_lock);
-
-            total_expected_downtime = (s->mem_task_queue->data_remaining + s->disk_task_queue->data_remaining)/
-                (s->mem_task_queue->bwidth + s->disk_task_queue->bwidth);
-            sent_this_iter = s->mem_task_queue->sent_this_iter + s->disk_task_queue->sent_this_iter;
-            sent_last_iter = s->mem_task_queue->sent_last_iter + s->disk_task_queue->sent_last_iter;
-
-            DPRINTF("Total Iter [%d:%d], data_remain %lx, bwidth %f\n", s->disk_task_queue->iter_num, iter_num,
-                    s->mem_task_queue->data_remaining + s->disk_task_queue->data_remaining, 
-                    s->mem_task_queue->bwidth + s->disk_task_queue->bwidth);
-
-            DPRINTF("Sent this iter %lx, sent last iter %lx, expect downtime %ld ns\n", 
-                    sent_this_iter, sent_last_iter, total_expected_downtime);
-
-            if (total_expected_downtime < s->para_config->max_downtime ||
-                sent_this_iter > sent_last_iter ||
-                s->disk_task_queue->force_end == 1 ||
-                s->mem_task_queue->force_end == 1)
-                s->laster_iter =1;
+            master_check_last_iter(s, s->disk_task_queue->iter_num, iter_num);
             pthread_mutex_unlock(&s->sender_barr->master_lock);
         }
 
         //set last iter and reset this iter
         s->disk_task_queue->sent_last_iter = s->disk_task_queue->sent_this_iter;
         s->disk_task_queue->sent_this_iter = 0;
-        //start the next iteration for slaves
-        s->sender_barr->disk_state = BARR_STATE_ITER_START;
+        //both masters know whether it was the last iteration
         pthread_barrier_wait(&s->sender_barr->next_iter_barr);
 
         //total iteration number count
@@ -437,6 +578,8 @@ host_disk_master(void * data) {
     } while (s->laster_iter != 1);
 
     DPRINTF("done iterating\n");
+    //the last iteration is sent before the guest stops
+    migr_barrier_wait_closed(s->sender_barr, s->disk_task_queue->iter_num - 1);
 
     pthread_barrier_wait(&s->last_barr);
 
@@ -449,12 +592,11 @@ host_disk_master(void * data) {
     block_save_iter(QEMU_VM_SECTION_END, s->mon, s->disk_task_queue, s->file);
     
     s->disk_task_queue->sent_this_iter = 0;
-    for ( i = 0; i < s->para_config->num_slaves; i++) {
-        s->disk_task_queue->sent_this_iter += s->disk_task_queue->slave_sent[i];
-    }
+    for ( i = 0; i < s->para_config->num_slaves; i++)
+        s->disk_task_queue->sent_this_iter += queue_take_sent(s->disk_task_queue, i);
 
     //wait for slave end
-    s->sender_barr->disk_state = BARR_STATE_ITER_TERMINATE;
+    migr_barrier_set_disk_state(s->sender_barr, BARR_STATE_ITER_TERMINATE);
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     DPRINTF("Disk send last iter %lx, bwidth %f\n", s->disk_task_queue->sent_this_iter, 
             (bwidth/1000000));
@@ -488,46 +630,230 @@ create_host_disk_master(void *opaque) {
 struct migration_task_queue *reduce_q;
 
 extern int disk_write(void *bs_p, int64_t addr, void *buf_p, int nr_sectors);
+extern int disk_writev(void *bs_p, int64_t addr, struct iovec *iov, int niov, int nr_sectors);
+extern int disk_write_zeroes(void *bs_p, int64_t addr, int nr_sectors);
+extern int disk_task_stale(struct disk_task *task);
 
-extern unsigned long total_disk_write;
+extern volatile unsigned long total_disk_write;
+extern volatile unsigned long total_disk_bytes;
 void *dest_disk_master(void *data);
 
+/*
+ * classicsong
+ * dest disk writers
+ * block_load hashes every chunk to one of nr_disk_writers shards of reduce_q
+ * (disk_chunk_writer), writer i writes the chunks of shard i, so the
+ * versions of a chunk are written in the order they arrived while
+ * nr_disk_writers chunks are written at the same time.
+ * writers_busy counts the writers between popping a task and finishing its
+ * write, the disk master ends when the slaves got EOF, the queue is empty
+ * and no writer is busy.
+ * The iterations overlap, a chunk may arrive after a newer version of it
+ * sent on another connection, the writer drops it (disk_task_stale)
+ */
+static int nr_disk_writers;
+static atomic_t writers_busy;
+
+struct disk_writer {
+    int id;
+    struct banner *banner;
+    /*
+     * run of contiguous chunks of one device not written yet
+     */
+    void *bs;
+    int64_t addr;
+    int nr_sectors;
+    int niov;
+    struct iovec iov[DISK_COALESCE_CHUNKS];
+};
+
+/* add the task to the run, fail if it does not continue the run */
+static int disk_run_add(struct disk_writer *writer, struct disk_task *task) {
+    if (writer->niov > 0 &&
+        (writer->niov == DISK_COALESCE_CHUNKS || task->bs != writer->bs ||
+         task->addr != writer->addr + writer->nr_sectors))
+        return -1;
+
+    if (writer->niov == 0) {
+        writer->bs = task->bs;
+        writer->addr = task->addr;
+        writer->nr_sectors = 0;
+    }
+
+    writer->iov[writer->niov].iov_base = task->buf;
+    writer->iov[writer->niov].iov_len = task->nr_sectors << BDRV_SECTOR_BITS;
+    writer->niov++;
+    writer->nr_sectors += task->nr_sectors;
+    free(task);
+
+    return 0;
+}
+
+static void disk_run_flush(struct disk_writer *writer) {
+    if (writer->niov == 1)
+        disk_write(writer->bs, writer->addr, writer->iov[0].iov_base, writer->nr_sectors);
+    else if (writer->niov > 1)
+        disk_writev(writer->bs, writer->addr, writer->iov, writer->niov, writer->nr_sectors);
+    writer->niov = 0;
+}
+
+/*
+ * the writer counts as busy while its run holds chunks
+ */
+static void *dest_disk_writer(void *data) {
+    struct disk_writer *writer = (struct disk_writer *)data;
+    struct banner *banner = writer->banner;
+    struct disk_task *task;
+    void *task_p;
+    int seq, done, waited = 0;
+
+    while (1) {
+        seq = task_event_prepare(&banner->event);
+        /* every slave got EOF, nothing is pushed any more */
+        done = banner->end && atomic_read(&banner->slave_done) >= reduce_q->nr_slaves;
+
+        if (writer->niov == 0)
+            atomic_inc(&writers_busy);
+        if (queue_pop_task_slave(reduce_q, writer->id, &task_p) > 0) {
+            task = (struct disk_task *)task_p;
+            waited = 0;
+            if (disk_task_stale(task)) {
+                /* a newer version of the chunk is written already */
+            } else if (task->buf == NULL) {
+                /* zero chunk, never part of a run */
+                disk_run_flush(writer);
+                disk_write_zeroes(task->bs, task->addr, task->nr_sectors);
+                free(task);
+            } else if (disk_run_add(writer, task) < 0) {
+                disk_run_flush(writer);
+                disk_run_add(writer, task);
+            }
+            if (writer->niov == DISK_COALESCE_CHUNKS)
+                disk_run_flush(writer);
+        } else if (writer->niov > 0 && !waited) {
+            /* give the next chunk of the run a moment to arrive */
+            waited = 1;
+            task_event_wait(&banner->event, seq, DISK_COALESCE_NS);
+            continue;
+        } else if (writer->niov > 0) {
+            waited = 0;
+            disk_run_flush(writer);
+        } else {
+            atomic_dec(&writers_busy);
+
+            if (done)
+                break;
+
+            task_event_wait(&banner->event, seq, TASK_EVENT_TIMEOUT_NS);
+            continue;
+        }
+
+        if (writer->niov == 0) {
+            atomic_dec(&writers_busy);
+
+            /* let the disk master check for the iteration end */
+            if (queue_task_pending(reduce_q) == 0)
+                task_event_notify(&banner->event);
+        }
+    }
+
+    free(writer);
+    return NULL;
+}
+
 void *
 dest_disk_master(void *data) {
-    void *task_p;
-    struct disk_task *task;
-    struct timespec master_sleep = {0, 100000};
     int nr_slaves = reduce_q->nr_slaves;
     struct banner *banner = (struct banner *)data;
+    unsigned long push_avg, pop_avg;
+    unsigned long iter_start, iter_bytes, iter_ns;
+    int seq;
 
-    DPRINTF("disk master inited\n");
+    DPRINTF("disk master inited, %d writers\n", nr_disk_writers);
 
+    iter_start = qemu_get_clock_ns(rt_clock);
+    iter_bytes = total_disk_bytes;
     while (1) {
-        while (queue_pop_task(reduce_q, &task_p) < 0) {
-            if (atomic_read(&banner->slave_done) < nr_slaves)
-                nanosleep(&master_sleep, NULL);
-            else {
-                if (banner->end) {
-                    fprintf(stderr, "end disk write %lx\n", total_disk_write/1000000);
-                    return;
-                }
-                DPRINTF("disk iteration end\n");
-                atomic_set(&banner->slave_done, 0);
-                pthread_barrier_wait(&banner->end_barrier);
-            }
-        } 
-          
-        task = (struct disk_task *)task_p;
-        disk_write(task->bs, task->addr, task->buf, task->nr_sectors);
-        free(task);
+        seq = task_event_prepare(&banner->event);
+
+        /*
+         * every slave got the ITER_END of an iteration, the chunks of the
+         * next one are already being written, so this is only reported
+         */
+        if (atomic_read(&banner->iter_done) >= nr_slaves) {
+            atomic_add(-nr_slaves, &banner->iter_done);
+
+            queue_latency_stat(reduce_q, &push_avg, &pop_avg);
+            DPRINTF("disk iteration end, queue latency push %lu ns, pop %lu ns\n",
+                    push_avg, pop_avg);
+
+            iter_ns = qemu_get_clock_ns(rt_clock) - iter_start;
+            iter_bytes = total_disk_bytes - iter_bytes;
+            DPRINTF("disk written this iter %lx, %f MB/s\n", iter_bytes,
+                    (double)iter_bytes / iter_ns * 1000000000 / (1024 * 1024));
+
+            iter_start = qemu_get_clock_ns(rt_clock);
+            iter_bytes = total_disk_bytes;
+            continue;
+        }
+
+        /*
+         * slave_done is checked first, after that no task is pushed,
+         * a writer is busy from before its pop until the write is done
+         */
+        if (!banner->end ||
+            atomic_read(&banner->slave_done) < nr_slaves ||
+            queue_task_pending(reduce_q) > 0 ||
+            atomic_read(&writers_busy) > 0) {
+            task_event_wait(&banner->event, seq, TASK_EVENT_TIMEOUT_NS);
+            continue;
+        }
+
+        fprintf(stderr, "end disk write %lx\n", total_disk_write/1000000);
+        task_event_notify(&banner->event);
+        return NULL;
     }
 }
 
-void create_dest_disk_master(int nr_slaves, struct banner *banner);
-void create_dest_disk_master(int nr_slaves, struct banner *banner) {
+/*
+ * disk post-copy: wait until the chunks of the pre-copy are written, the
+ * condition the disk master ends on
+ */
+void dest_disk_wait(struct banner *banner);
+void dest_disk_wait(struct banner *banner) {
+    int seq;
+
+    while (1) {
+        seq = task_event_prepare(&banner->event);
+        if (banner->end &&
+            atomic_read(&banner->slave_done) >= reduce_q->nr_slaves &&
+            queue_task_pending(reduce_q) == 0 &&
+            atomic_read(&writers_busy) == 0)
+            return;
+        task_event_wait(&banner->event, seq, TASK_EVENT_TIMEOUT_NS);
+    }
+}
+
+void create_dest_disk_master(int nr_slaves, int nr_writers, struct banner *banner);
+void create_dest_disk_master(int nr_slaves, int nr_writers, struct banner *banner) {
     pthread_t tid;
+    int i;
+
     reduce_q = new_task_queue();
     reduce_q->nr_slaves = nr_slaves;
+    queue_set_event(reduce_q, &banner->event);
+    queue_enable_shards(reduce_q, nr_writers);
+
+    nr_disk_writers = nr_writers;
+    atomic_set(&writers_busy, 0);
+    for (i = 0; i < nr_writers; i++) {
+        struct disk_writer *writer = (struct disk_writer *)malloc(sizeof(struct disk_writer));
+
+        writer->id = i;
+        writer->banner = banner;
+        writer->niov = 0;
+        pthread_create(&tid, NULL, dest_disk_writer, writer);
+    }
 
     pthread_create(&tid, NULL, dest_disk_master, banner);
 }
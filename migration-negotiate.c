@@ -33,12 +33,16 @@ qemu_savevm_state_negotiate(FdMigrationState *s, QEMUFile *f) {
      * negotiate
      * 1. num of dest ip used
      * 2. SSL type
+     * 3. compression level of the slave streams
+     * 4. number of disk writers of the dest
      */
     qemu_put_byte(f, QEMU_VM_SECTION_NEGOTIATE);
     qemu_put_be32(f, num_slaves);
     qemu_put_be32(f, num_ips);
 
     qemu_put_be32(f, s->para_config->SSL_type);
+    qemu_put_be32(f, s->para_config->compression);
+    qemu_put_be32(f, s->para_config->num_disk_writers);
 
     for (i = 0; i < num_ips; i++) {
         tmp_ip_list->host_port[tmp_ip_list->len] = 0;
@@ -65,6 +69,24 @@ default_config(const char *host_port) {
     para_config->dest_ip_list = dest;  //only init the dest ip
     para_config->host_ip_list = NULL;
     para_config->default_throughput = 1024 * 1024 * 1024;
+    para_config->num_scanners = DEFAULT_SCAN_THREADS;
+    para_config->compression = DEFAULT_COMPRESSION;
+    para_config->xbzrle_cache = DEFAULT_XBZRLE_CACHE;
+    para_config->shard_mode = DEFAULT_SHARD_MODE;
+    para_config->slave_node = NULL;
+    para_config->bind_host_ip = DEFAULT_BIND_HOST_IP;
+    para_config->num_disk_writers = DEFAULT_DISK_WRITERS;
+    para_config->disk_read_depth = DEFAULT_DISK_READ_DEPTH;
+    para_config->slave_min_throughput = DEFAULT_SLAVE_MIN_THROUGHPUT;
+    para_config->work_stealing = DEFAULT_WORK_STEALING;
+    para_config->conv_alpha = DEFAULT_CONV_ALPHA;
+    para_config->conv_min_gain = DEFAULT_CONV_MIN_GAIN;
+    para_config->auto_converge = DEFAULT_AUTO_CONVERGE;
+    para_config->throttle_initial = DEFAULT_THROTTLE_INITIAL;
+    para_config->throttle_increment = DEFAULT_THROTTLE_INCREMENT;
+    para_config->postcopy = DEFAULT_POSTCOPY;
+    para_config->disk_postcopy = DEFAULT_DISK_POSTCOPY;
+    para_config->hot_rounds = DEFAULT_HOT_ROUNDS;
 
     return para_config;
 }
@@ -1,4 +1,7 @@
 #include <signal.h>
+#include <poll.h>
+#include <zlib.h>
+#include <limits.h>
 
 #include "qemu-common.h"
 #include "qemu_socket.h"
@@ -7,6 +10,8 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "migr-numa.h"
+#include "migr-postcopy.h"
 
 #define MULTI_TRY 100
 
@@ -48,6 +53,17 @@ static int socket_write_slave(FdMigrationStateSlave *s, const void * buf, size_t
     return send(s->fd, buf, size, 0);
 }
 
+static ssize_t socket_writev_slave(FdMigrationStateSlave *s, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(s->fd, &msg, 0);
+}
+
 static int tcp_close_slave(FdMigrationStateSlave *s)
 {
     DPRINTF("tcp_close\n");
@@ -66,6 +82,8 @@ static int tcp_close_slave(FdMigrationStateSlave *s)
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_ITER_END             0x07
+#define QEMU_VM_SECTION_COMPRESSED   0x08
+#define QEMU_VM_POSTCOPY             0x09
 //borrowed from block-migration.c
 #define BLK_MIG_FLAG_EOS                0x02
 
@@ -91,9 +109,10 @@ tcp_start_outgoing_migration_slave(Monitor *mon,
     /*
      * register SSL handler
      */
-    if (SSL_type == SSL_NO)
+    if (SSL_type == SSL_NO) {
         s->write = socket_write_slave;//write data to the target fd
-    else if (SSL_type == SSL_STRONG)
+        s->writev = socket_writev_slave;//send guest pages without copying
+    } else if (SSL_type == SSL_STRONG)
         s->write = socket_write_ssl;
     else {
         fprintf(stderr, "wrong ssl type use defult ssl solution");
@@ -113,23 +132,270 @@ tcp_start_outgoing_migration_slave(Monitor *mon,
 }
 
 extern unsigned long disk_save_block_slave(void *ptr, int iter_num, QEMUFile *f);
+extern void disk_free_block_slave(void *ptr);
 extern unsigned long ram_save_block_slave(unsigned offset, uint8_t *p, void *block_p,
-                                 struct FdMigrationStateSlave *s, int mem_vnum);
+                                 QEMUFile *f, int mem_vnum);
+extern unsigned long ram_postcopy_remaining(void);
+extern int ram_postcopy_claim(uint64_t addr);
+extern unsigned long ram_postcopy_save_page(QEMUFile *f, uint64_t addr, uint8_t *p);
+extern void ram_postcopy_put_eos(QEMUFile *f);
+extern void ram_postcopy_save_map(QEMUFile *f);
+extern int ram_postcopy_load(QEMUFile *f, int fd);
+extern void blk_postcopy_save_map(QEMUFile *f);
+extern long blk_postcopy_remaining(void);
+extern unsigned long blk_postcopy_save_chunk(QEMUFile *f, uint64_t key);
+extern unsigned long blk_postcopy_save_block(void *ptr, QEMUFile *f);
+
+/*
+ * start a section for one task
+ * with compression the task is serialized to the memory file
+ */
+static QEMUFile *slave_section_start(FdMigrationStateSlave *s, int section_id) {
+    if (s->compression) {
+        qemu_buffer_file_reset(s->cfile, NULL, 0);
+        return s->cfile;
+    }
+
+    qemu_put_byte(s->file, QEMU_VM_SECTION_PART);
+    qemu_put_be32(s->file, section_id);
+    return s->file;
+}
+
+/*
+ * send a section serialized by slave_section_start
+ * layout: QEMU_VM_SECTION_COMPRESSED, section id, raw len, compressed len, data
+ * a batch that does not shrink is sent as a plain QEMU_VM_SECTION_PART
+ */
+static void slave_section_end(FdMigrationStateSlave *s, int section_id) {
+    QEMUFile *f = s->file;
+    uint8_t *raw;
+    int64_t raw_len;
+    uLongf z_len;
+
+    if (!s->compression) {
+        qemu_fflush(f);
+        return;
+    }
+
+    raw = qemu_buffer_file_data(s->cfile, &raw_len);
+
+    if (compressBound(raw_len) > s->zbuf_size) {
+        s->zbuf_size = compressBound(raw_len);
+        s->zbuf = qemu_realloc(s->zbuf, s->zbuf_size);
+    }
+
+    z_len = s->zbuf_size;
+    if (compress2(s->zbuf, &z_len, raw, raw_len, s->compression) == Z_OK &&
+        z_len < raw_len) {
+        qemu_put_byte(f, QEMU_VM_SECTION_COMPRESSED);
+        qemu_put_be32(f, section_id);
+        qemu_put_be32(f, raw_len);
+        qemu_put_be32(f, z_len);
+        qemu_put_buffer(f, s->zbuf, z_len);
+    } else {
+        qemu_put_byte(f, QEMU_VM_SECTION_PART);
+        qemu_put_be32(f, section_id);
+        qemu_put_buffer(f, raw, raw_len);
+    }
+
+    qemu_fflush(f);
+}
+/* ack of the dest for an ITER_END */
+static void slave_read_ack(FdMigrationStateSlave *s) {
+    char buf[4];
+
+    if (read(s->fd, buf, sizeof("OK")) != sizeof("OK"))
+        fprintf(stderr, "slave %d lost the ack of iteration end\n", s->id);
+    s->ack_pending = 0;
+}
+
+/*
+ * classicsong
+ * close the iteration of the slave, the dest acks every ITER_END at once.
+ * The ack of the previous ITER_END is read here so a slave runs at most
+ * one iteration ahead of its dest, in strict mode the ack of this one is
+ * read before the masters may queue the next iteration
+ */
+static void slave_close_iter(FdMigrationStateSlave *s, QEMUFile *f) {
+    DPRINTF("slave %d iteration %d end\n", s->id, s->iter);
+    qemu_put_byte(f, QEMU_VM_ITER_END);
+    qemu_fflush(f);
+
+    if (s->ack_pending)
+        slave_read_ack(s);
+    s->ack_pending = 1;
+    if (s->sender_barr->strict)
+        slave_read_ack(s);
+
+    s->iter++;
+    migr_barrier_close_iter(s->sender_barr, s->id);
+}
+
+/*
+ * post-copy, slave 0: send the pages the dest faults on and the disk chunks
+ * it asks for, until every one is taken by it or by the others
+ */
+static void slave_serve_faults(FdMigrationStateSlave *s, QEMUFile *f) {
+    struct migration_barrier *barr = s->sender_barr;
+    struct pollfd pfd;
+    uint64_t req;
+    uint64_t addr;
+    int got = 0, n;
+
+    pfd.fd = s->fd;
+    pfd.events = POLLIN;
+
+    while ((barr->postcopy && ram_postcopy_remaining() > 0) ||
+           blk_postcopy_remaining() > 0) {
+        if (poll(&pfd, 1, POSTCOPY_POLL_MS) <= 0)
+            continue;
+
+        n = read(s->fd, (uint8_t *)&req + got, sizeof(req) - got);
+        if (n <= 0) {
+            fprintf(stderr, "slave %d lost the post-copy requests\n", s->id);
+            break;
+        }
+        got += n;
+        if (got < (int)sizeof(req))
+            continue;
+        got = 0;
+
+        addr = be64_to_cpu(req);
+        if (addr & POSTCOPY_DISK) {
+            atomic_add_long(blk_postcopy_save_chunk(f, addr),
+                            &s->disk_task_queue->slave_sent[s->id]);
+            qemu_fflush(f);
+            //the disk master goes on next to it
+            barr->disk_fault_hint = addr;
+            continue;
+        }
+
+        if (ram_postcopy_claim(addr)) {
+            atomic_add_long(ram_postcopy_save_page(f, addr, NULL),
+                            &s->mem_task_queue->slave_sent[s->id]);
+            qemu_fflush(f);
+        }
+        //the memory master goes on next to it
+        barr->fault_hint = (addr >> TARGET_PAGE_BITS) + 1;
+    }
+}
+
+/*
+ * post-copy, other slaves: send the pages the memory master queues and
+ * the disk chunks of the disk master
+ */
+static void slave_push_pages(FdMigrationStateSlave *s, QEMUFile *f) {
+    struct migration_barrier *barr = s->sender_barr;
+    struct task_body *body;
+    void *body_p;
+    unsigned long sent;
+    int i, seq;
+
+    for (;;) {
+        seq = task_event_prepare(&barr->event);
+        if (queue_pop_task_slave(s->mem_task_queue, s->id, &body_p) > 0) {
+            body = (struct task_body *)body_p;
+            sent = 0;
+            for (i = 0; i < body->len; i++)
+                sent += ram_postcopy_save_page(f, body->pages[i].addr, body->pages[i].ptr);
+            atomic_add_long(sent, &s->mem_task_queue->slave_sent[s->id]);
+            qemu_fflush(f);
+            task_body_free(body);
+            continue;
+        }
+        if (queue_pop_task(s->disk_task_queue, &body_p) > 0) {
+            body = (struct task_body *)body_p;
+            sent = 0;
+            for (i = 0; i < body->len; i++)
+                sent += blk_postcopy_save_block(body->blocks[i].ptr, f);
+            atomic_add_long(sent, &s->disk_task_queue->slave_sent[s->id]);
+            qemu_fflush(f);
+            for (i = 0; i < body->len; i++)
+                disk_free_block_slave(body->blocks[i].ptr);
+            task_body_free(body);
+            continue;
+        }
+
+        if (barr->postcopy_pushed && barr->disk_pushed &&
+            queue_task_pending(s->mem_task_queue) == 0 &&
+            queue_task_pending(s->disk_task_queue) == 0)
+            break;
+        task_event_wait(&barr->event, seq, TASK_EVENT_TIMEOUT_NS);
+    }
+}
+
+static void slave_postcopy(FdMigrationStateSlave *s, QEMUFile *f) {
+    DPRINTF("slave %d post-copy\n", s->id);
+    if (s->id == 0)
+        slave_serve_faults(s, f);
+    else
+        slave_push_pages(s, f);
+
+    ram_postcopy_put_eos(f);
+    qemu_fflush(f);
+
+    if (atomic_sub_and_test(1, &s->sender_barr->postcopy_slaves))
+        task_event_notify(&s->sender_barr->iter_event);
+    DPRINTF("slave %d post-copy end\n", s->id);
+}
+
+static void slave_send_disk(FdMigrationStateSlave *s, struct task_body *body) {
+    QEMUFile *out;
+    unsigned long sent = 0;
+    int i;
+
+    //DPRINTF("get disk task, %d, section id %d\n", s->mem_task_queue->iter_num,
+    //        s->mem_task_queue->section_id);
+
+    /* Section type */
+    out = slave_section_start(s, s->disk_task_queue->section_id);
+    /*
+     * handle disk
+     */
+    for (i = 0; i < body->len; i++) {
+        sent += disk_save_block_slave(body->blocks[i].ptr, 
+                                      body->iter_num, out);
+    }
+    atomic_add_long(sent, &s->disk_task_queue->slave_sent[s->id]);
+
+    /* End of the single task */
+    qemu_put_be64(out, BLK_MIG_FLAG_EOS);
+    slave_section_end(s, s->disk_task_queue->section_id);
+
+    //the blocks were sent by reference, free them after the flush
+    for (i = 0; i < body->len; i++)
+        disk_free_block_slave(body->blocks[i].ptr);
+
+    queue_body_done(s->disk_task_queue, body);
+    task_body_free(body);
+}
+
 void *
 start_host_slave(void *data) {
     FdMigrationStateSlave *s = (FdMigrationStateSlave *)data;
     struct task_body *body;
     struct sockaddr_in addr;
     int i, ret;
-    QEMUFile *f;
+    QEMUFile *f, *out;
     struct timespec slave_sleep = {0, 1000000};
-    unsigned long data_sent;
+    unsigned long data_sent, sent;
+    int hybrid = s->sender_barr->disk_postcopy;
     
     if (parse_host_port(&addr, s->dest_ip) < 0) {
         fprintf(stderr, "wrong dest ip %s\n", s->dest_ip);
         return NULL;
     }
 
+    /*
+     * read the guest pages and allocate the buffers on the node of the slave
+     */
+    if (s->numa_node >= 0) {
+        if (numa_bind_node(s->numa_node) < 0)
+            fprintf(stderr, "slave %d could not bind to node %d\n", s->id, s->numa_node);
+        else
+            DPRINTF("slave %d bound to node %d\n", s->id, s->numa_node);
+    }
+
     DPRINTF("Start host slave, begin creating connection, %s, %ld\n", s->dest_ip, s->bandwidth_limit);
     /*
      * create network connection
@@ -141,6 +407,22 @@ start_host_slave(void *data) {
         return NULL;
     }
 
+    /*
+     * leave on the NIC of the host ip, the port of h_ip is ignored
+     * so that a restarted migration does not hit TIME_WAIT
+     */
+    if (s->host_ip) {
+        struct sockaddr_in host_addr;
+
+        if (parse_host_port(&host_addr, s->host_ip) < 0) {
+            fprintf(stderr, "wrong host ip %s\n", s->host_ip);
+        } else {
+            host_addr.sin_port = 0;
+            if (bind(s->fd, (struct sockaddr *)&host_addr, sizeof(host_addr)) == -1)
+                fprintf(stderr, "slave %d could not bind to %s\n", s->id, s->host_ip);
+        }
+    }
+
     //socket_set_nonblock(s->fd);
     
     for (i = 0; i < MULTI_TRY; i++) {
@@ -166,12 +448,16 @@ start_host_slave(void *data) {
      */
     s->file = qemu_fopen_ops_buffered_slave(s,
                                             s->bandwidth_limit,
+                                            s->bucket, &s->reserve,
                                             migrate_fd_put_buffer_slave,
+                                            s->writev ? migrate_fd_writev_buffer_slave : NULL,
                                             migrate_fd_put_ready_slave,
                                             migrate_fd_wait_for_unfreeze,
                                             migrate_fd_close);
 
     f = s->file;
+    if (s->compression)
+        s->cfile = qemu_fopen_buffer_write();
     pthread_barrier_wait(&s->sender_barr->sender_iter_barr);
 
     DPRINTF("slave start migration, %lx, file %p\n", s->bandwidth_limit/1024, f);
@@ -183,93 +469,165 @@ start_host_slave(void *data) {
      */
     while (1) {
         void *body_p;
-        /* check for disk */
-        if (queue_pop_task(s->disk_task_queue, &body_p) > 0) {
-            body = (struct task_body *)body_p;
-            //DPRINTF("get disk task, %d, section id %d\n", s->mem_task_queue->iter_num,
-            //        s->mem_task_queue->section_id);
-
-            /* Section type */
-            qemu_put_byte(f, QEMU_VM_SECTION_PART);
-            qemu_put_be32(f, s->disk_task_queue->section_id);
-            /*
-             * handle disk
-             */
-            for (i = 0; i < body->len; i++) {
-                s->disk_task_queue->slave_sent[s->id] += 
-                    disk_save_block_slave(body->blocks[i].ptr, 
-                                          body->iter_num, s->file);
-            }
+        int seq = task_event_prepare(&s->sender_barr->event);
 
-            /* End of the single task */
-            qemu_put_be64(f, BLK_MIG_FLAG_EOS);
-            qemu_fflush(f);
+        /* the tasks of the iteration are all sent, by any of the slaves */
+        while (queue_iter_sent(s->sender_barr, s->mem_task_queue,
+                               s->disk_task_queue, s->iter))
+            slave_close_iter(s, f);
 
-            free(body);
+        /* check for disk, behind the memory in the disk post-copy */
+        if (!hybrid && queue_pop_task(s->disk_task_queue, &body_p) > 0) {
+            slave_send_disk(s, (struct task_body *)body_p);
         }
         /* check for memory */
-        else if (queue_pop_task(s->mem_task_queue, &body_p) > 0) {
+        else if (queue_pop_task_slave(s->mem_task_queue, s->id, &body_p) > 0) {
+            unsigned long start = task_clock_ns();
+
             body = (struct task_body *)body_p;
             //DPRINTF("get mem task, %lx: %p, %d, section id %d\n", body->pages[0].addr, 
             //       body->pages[0].ptr, 
             //       s->mem_task_queue->iter_num, s->mem_task_queue->section_id);
             /* Section type */
-            qemu_put_byte(f, QEMU_VM_SECTION_PART);
-            qemu_put_be32(f, s->mem_task_queue->section_id);
+            out = slave_section_start(s, s->mem_task_queue->section_id);
+            sent = 0;
             for (i = 0; i < body->len; i++) {
-                s->mem_task_queue->slave_sent[s->id] += 
-                    ram_save_block_slave(body->pages[i].addr, body->pages[i].ptr, 
-                                         body->pages[i].block, s, s->mem_task_queue->iter_num);
+                sent += ram_save_block_slave(body->pages[i].addr, body->pages[i].ptr, 
+                                             body->pages[i].block, out, body->iter_num);
             }
+            atomic_add_long(sent, &s->mem_task_queue->slave_sent[s->id]);
 
             /* End of the single task */
-            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-            qemu_fflush(f);
+            qemu_put_be64(out, RAM_SAVE_FLAG_EOS);
+            slave_section_end(s, s->mem_task_queue->section_id);
+            atomic_add_long(task_clock_ns() - start,
+                            &s->mem_task_queue->slave_busy_ns[s->id]);
 
-            free(body);
+            queue_body_done(s->mem_task_queue, body);
+            task_body_free(body);
+        }
+        else if (hybrid && queue_pop_task(s->disk_task_queue, &body_p) > 0) {
+            slave_send_disk(s, (struct task_body *)body_p);
         }
         /* no disk and memory task */
         else {
-            if (s->sender_barr->mem_state == BARR_STATE_ITER_END && 
-                s->sender_barr->disk_state == BARR_STATE_ITER_END) {
-                char buf[4];
-                int rret;
-                DPRINTF("Iteration End fall into barriers\n");
-                qemu_put_byte(f, QEMU_VM_ITER_END);
-                qemu_fflush(f);
-                rret = read(s->fd, buf, sizeof("OK"));
-                pthread_barrier_wait(&s->sender_barr->sender_iter_barr);
-                pthread_barrier_wait(&s->sender_barr->next_iter_barr);
-            }
-            else if (s->sender_barr->mem_state == BARR_STATE_ITER_TERMINATE &&
-                     s->sender_barr->disk_state == BARR_STATE_ITER_TERMINATE) {
+            if (s->sender_barr->mem_state == BARR_STATE_ITER_TERMINATE &&
+                s->sender_barr->disk_state == BARR_STATE_ITER_TERMINATE) {
                 DPRINTF("Last Iteration End\n");
-                qemu_put_byte(f, QEMU_VM_EOF);
+                if (s->ack_pending)
+                    slave_read_ack(s);
+                /*
+                 * post-copy: the dest resumes the guest once all slaves
+                 * got here, slave 0 tells it the pages and chunks left
+                 */
+                if (s->sender_barr->postcopy || hybrid) {
+                    int flags = 0;
+
+                    if (s->id == 0)
+                        flags = (s->sender_barr->postcopy ? POSTCOPY_MAP_RAM : 0) |
+                            (hybrid ? POSTCOPY_MAP_DISK : 0);
+                    qemu_put_byte(f, QEMU_VM_POSTCOPY);
+                    qemu_put_be32(f, flags);
+                    if (flags & POSTCOPY_MAP_RAM)
+                        ram_postcopy_save_map(f);
+                    if (flags & POSTCOPY_MAP_DISK)
+                        blk_postcopy_save_map(f);
+                } else
+                    qemu_put_byte(f, QEMU_VM_EOF);
                 qemu_fflush(f);
                 pthread_barrier_wait(&s->sender_barr->sender_iter_barr);
 
+                if (s->sender_barr->postcopy || hybrid)
+                    slave_postcopy(s, f);
+
                 data_sent = 0;
                 break;
             }
 
-            //get nothing, wait for a moment
-            nanosleep(&slave_sleep, NULL);
+            //get nothing, sleep until a task or a state change arrives
+            task_event_wait(&s->sender_barr->event, seq, TASK_EVENT_TIMEOUT_NS);
         }
     }
 
+    if (s->compression) {
+        qemu_fclose(s->cfile);
+        qemu_free(s->zbuf);
+    }
+
     DPRINTF("slave terminate\n");
     return NULL;
 }
 
 void init_host_slaves(struct FdMigrationState *s) {
-    struct ip_list *next_ip;
+    struct ip_list *next_ip, *host_ip;
     int i;
 
     DPRINTF("Start init slaves %d\n", s->para_config->num_slaves);
+    /*
+     * throughput is per connection, the slaves share the sum of it,
+     * default_throughput is in bits
+     */
+    token_bucket_init(&s->bucket, TOKEN_BURST_NS,
+                      s->para_config->num_slaves * (s->para_config->default_throughput / 8));
     s->sender_barr = (struct migration_barrier *)malloc(sizeof(struct migration_barrier));
     init_migr_barrier(s->sender_barr, s->para_config->num_slaves);
+    //the XBZRLE deltas need the previous version on the dest
+    s->sender_barr->strict = s->para_config->xbzrle_cache > 0;
+    /*
+     * post-copy: every page of the first round is placed before the
+     * switch, so no pre-copy page lands on a dropped one
+     */
+    if (s->para_config->postcopy) {
+        s->sender_barr->postcopy = 1;
+        s->sender_barr->strict = 1;
+    } else
+        s->sender_barr->postcopy_pushed = 1;
+    /*
+     * disk post-copy: the disk master does not iterate, its blocks belong
+     * to no iteration and the memory master passes the iteration barrier
+     * alone
+     */
+    if (s->para_config->disk_postcopy) {
+        s->sender_barr->disk_postcopy = 1;
+        s->sender_barr->disk_scanned = INT_MAX;
+        s->disk_task_queue->untracked = 1;
+        pthread_barrier_destroy(&s->sender_barr->next_iter_barr);
+        pthread_barrier_init(&s->sender_barr->next_iter_barr, NULL, 1);
+    } else
+        s->sender_barr->disk_pushed = 1;
+    if (s->para_config->postcopy || s->para_config->disk_postcopy)
+        atomic_set(&s->sender_barr->postcopy_slaves, s->para_config->num_slaves);
+    /*
+     * slaves consume both queues, so let them sleep on one event
+     */
+    queue_set_event(s->mem_task_queue, &s->sender_barr->event);
+    queue_set_event(s->disk_task_queue, &s->sender_barr->event);
+
+    /*
+     * shard mode: every slave owns a fixed part of the guest memory
+     * so all versions of a page go out on the same connection
+     */
+    if (s->para_config->shard_mode || s->para_config->slave_node) {
+        DPRINTF("Memory sharded among %d slaves\n", s->para_config->num_slaves);
+        queue_enable_shards(s->mem_task_queue, s->para_config->num_slaves);
+    }
+    /*
+     * work stealing: every slave has its own shard of batches sized to its
+     * rate and steals from the others when it runs dry
+     */
+    else if (s->para_config->work_stealing && s->para_config->num_slaves > 1) {
+        DPRINTF("Memory batches dealt among %d slaves\n", s->para_config->num_slaves);
+        queue_enable_stealing(s->mem_task_queue, s->para_config->num_slaves);
+    }
+
+    /*
+     * NUMA mode: the pages backed by node N are sent by the slaves on node N
+     */
+    if (s->para_config->slave_node)
+        queue_set_shard_nodes(s->mem_task_queue, s->para_config->slave_node);
 
     next_ip = s->para_config->dest_ip_list;
+    host_ip = s->para_config->host_ip_list;
     for (i = 0; i < s->para_config->num_slaves; i ++) {
         FdMigrationStateSlave *slave_s;
         pthread_t tid;
@@ -284,6 +642,19 @@ void init_host_slaves(struct FdMigrationState *s) {
         slave_s->disk_task_queue = s->disk_task_queue;
         slave_s->sender_barr = s->sender_barr;
         slave_s->id = i;
+        slave_s->iter = 0;
+        slave_s->ack_pending = 0;
+        slave_s->compression = s->para_config->compression;
+        slave_s->bucket = &s->bucket;
+        token_bucket_init(&slave_s->reserve, TOKEN_RESERVE_NS,
+                          (unsigned long)s->para_config->slave_min_throughput * 1024 * 1024);
+        slave_s->numa_node = s->para_config->slave_node ?
+            s->para_config->slave_node[i] : -1;
+        if (s->para_config->bind_host_ip && host_ip) {
+            slave_s->host_ip = (char *)host_ip->host_port;
+            //fewer host ips than slaves: they share the ips
+            host_ip = host_ip->next ? host_ip->next : s->para_config->host_ip_list;
+        }
 
         DPRINTF("slave_s is %p\n", slave_s);
         pthread_create(&tid, NULL, start_host_slave, slave_s);
@@ -310,7 +681,7 @@ struct dest_slave_para{
 //    return -1;
 //}
 
-extern void slave_process_incoming_migration(QEMUFile *f, void * loadvm_handlers, struct banner *banner, int fd);
+extern int slave_process_incoming_migration(QEMUFile *f, void * loadvm_handlers, struct banner *banner, int fd);
 
 void *start_dest_slave(void *data) {
     struct dest_slave_para * para = (struct dest_slave_para *)data;
@@ -320,6 +691,7 @@ void *start_dest_slave(void *data) {
     int fd;
     int con_fd;
     int val;
+    int postcopy;
     QEMUFile *f;
 
     if (parse_host_port(&addr, para->listen_ip) < 0) {
@@ -380,9 +752,12 @@ void *start_dest_slave(void *data) {
     /*
      * slave handle incoming data
      */
-    slave_process_incoming_migration(f, para->handlers, para->banner, con_fd);
+    postcopy = slave_process_incoming_migration(f, para->handlers, para->banner, con_fd);
 
     pthread_barrier_wait(para->end_barrier);    
+    //post-copy: the guest runs, the pages left come now
+    if (postcopy && ram_postcopy_load(f, con_fd) < 0)
+        fprintf(stderr, "post-copy load error on connection %d\n", con_fd);
     DPRINTF("Dest slave end\n");
     //slave_loadvm_state();
 
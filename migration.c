@@ -18,6 +18,7 @@
 #include "buffered_file.h"
 #include "sysemu.h"
 #include "block.h"
+#include "kvm.h"
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
@@ -163,6 +164,11 @@ int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data)
         qemu_file_set_rate_limit(s->file, max_throttle);
     }
 
+    /* classicsong: the slaves send the data, cap all of them */
+    if (s && s->para_config) {
+        token_bucket_set_rate(&s->bucket, max_throttle);
+    }
+
     return 0;
 }
 
@@ -295,6 +301,9 @@ int migrate_fd_cleanup(FdMigrationState *s)
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
+    //auto converge is over, let the vCPUs run at full speed
+    kvm_set_cpu_throttle(0);
+
     if (s->file) {
         DPRINTF("closing file\n");
         if (qemu_fclose(s->file) != 0) {
@@ -355,6 +364,33 @@ migrate_fd_put_buffer_slave(void *opaque, const void *data, size_t size) {
     return ret;
 }
 
+/*
+ * classicsong
+ * may write less than asked, buffered_writev_buffer_slave continues
+ */
+ssize_t
+migrate_fd_writev_buffer_slave(void *opaque, struct iovec *iov, int iovcnt) {
+    FdMigrationStateSlave *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+
+    if (ret < 0) {
+        if (s->mon) {
+            monitor_resume(s->mon);
+        }
+        s->state = MIG_STATE_ERROR;
+        notifier_list_notify(&migration_state_notifiers);
+    }
+
+    return ret;
+}
+
 ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
 {
     FdMigrationState *s = opaque;
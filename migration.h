@@ -21,6 +21,8 @@
 //classicsong
 #include "para-config.h"
 #include "migr-task.h"
+#include "migr-rate.h"
+#include "migr-conv.h"
 
 #define MIG_STATE_ERROR		-1
 #define MIG_STATE_COMPLETED	0
@@ -73,6 +75,10 @@ struct FdMigrationState
     pthread_barrier_t last_barr;
     volatile int laster_iter;
     int section_id;
+    /* rate limit of all the slaves, set by migrate_set_speed */
+    struct token_bucket bucket;
+    /* picks the last iteration, see migr-conv.h */
+    struct conv_ctl conv;
 };
 
 struct FdMigrationDestState
@@ -92,6 +98,7 @@ struct FdMigrationStateSlave
     int (*get_error)(struct FdMigrationStateSlave*);
     int (*close)(struct FdMigrationStateSlave*);
     int (*write)(struct FdMigrationStateSlave*, const void *, size_t);
+    ssize_t (*writev)(struct FdMigrationStateSlave*, struct iovec *, int);
     void *opaque;
     //    SSL_func;
     char *host_ip;
@@ -100,6 +107,22 @@ struct FdMigrationStateSlave
     struct migration_task_queue *disk_task_queue;
     struct migration_barrier *sender_barr;
     int id;
+    /* NUMA node the slave runs on, -1 if not bound */
+    int numa_node;
+    /*
+     * compression level, 0 is off
+     * a batch is serialized to cfile and compressed into zbuf
+     */
+    int compression;
+    QEMUFile *cfile;
+    uint8_t *zbuf;
+    unsigned long zbuf_size;
+    /* shared rate limit and the slave_min_throughput of this slave */
+    struct token_bucket *bucket;
+    struct token_bucket reserve;
+    /* first iteration not closed, the ack of the last ITER_END is unread */
+    int iter;
+    int ack_pending;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -169,6 +192,7 @@ void migrate_fd_put_notify(void *opaque);
 //classicsong
 void migrate_fd_put_ready_slave(void *opaque);
 ssize_t migrate_fd_put_buffer_slave(void *opaque, const void *data, size_t size);
+ssize_t migrate_fd_writev_buffer_slave(void *opaque, struct iovec *iov, int iovcnt);
 
 ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size);
 
@@ -8,6 +8,7 @@
 
 #include "read_config.h"
 #include "para-config.h"
+#include "migr-numa.h"
 
 /* Init Parallel Param */
 static void init_param(struct parallel_param *param) {
@@ -19,6 +20,24 @@ static void init_param(struct parallel_param *param) {
     param->max_iter = DEFAULT_MAX_ITER;
     param->max_factor = DEFAULT_MAX_FACTOR;
     param->max_downtime = DEFAULT_MAX_DOWNTIME;
+    param->num_scanners = DEFAULT_SCAN_THREADS;
+    param->compression = DEFAULT_COMPRESSION;
+    param->xbzrle_cache = DEFAULT_XBZRLE_CACHE;
+    param->shard_mode = DEFAULT_SHARD_MODE;
+    param->slave_node = NULL;
+    param->bind_host_ip = DEFAULT_BIND_HOST_IP;
+    param->num_disk_writers = DEFAULT_DISK_WRITERS;
+    param->disk_read_depth = DEFAULT_DISK_READ_DEPTH;
+    param->slave_min_throughput = DEFAULT_SLAVE_MIN_THROUGHPUT;
+    param->work_stealing = DEFAULT_WORK_STEALING;
+    param->conv_alpha = DEFAULT_CONV_ALPHA;
+    param->conv_min_gain = DEFAULT_CONV_MIN_GAIN;
+    param->auto_converge = DEFAULT_AUTO_CONVERGE;
+    param->throttle_initial = DEFAULT_THROTTLE_INITIAL;
+    param->throttle_increment = DEFAULT_THROTTLE_INCREMENT;
+    param->postcopy = DEFAULT_POSTCOPY;
+    param->disk_postcopy = DEFAULT_DISK_POSTCOPY;
+    param->hot_rounds = DEFAULT_HOT_ROUNDS;
 }
 
 /* Get Number from List */
@@ -33,6 +52,38 @@ static int get_one_num(const char *name, cfg_list *list, int *value, const char*
 	return 0;
 }
 
+/* Get Optional Number from List, keep the default if absent */
+static void get_opt_num(const char *name, cfg_list *list, int *value) {
+	num_list *n_list = get_num_list(name, list);
+
+	if (n_list != NULL)
+		*value = n_list->integer;
+}
+
+/*
+ * Get the NUMA node of every slave, in the order of the d_ip list
+ * slaves missing in the list or with a bad node are not bound
+ */
+static void get_slave_nodes(cfg_list *list, struct parallel_param *param) {
+	num_list *n_list = get_num_list("slave_node", list);
+	int i;
+
+	if (n_list == NULL || param->num_slaves <= 0)
+		return;
+
+	param->slave_node = (int *)malloc(param->num_slaves * sizeof(int));
+	for (i = 0; i < param->num_slaves; i++) {
+		param->slave_node[i] = -1;
+		if (n_list == NULL)
+			continue;
+		if (n_list->integer >= 0 && n_list->integer < MAX_NUMA_NODES)
+			param->slave_node[i] = n_list->integer;
+		else
+			fprintf(stderr, "slave %d: bad NUMA node %d\n", i, n_list->integer);
+		n_list = n_list->next;
+	}
+}
+
 /* Get IP Strings from List */
 static int get_multi_ip(const char *name, cfg_list *list, struct ip_list **ip, const char *error) {
 	str_list *s_list = NULL;
@@ -106,6 +157,99 @@ struct parallel_param *parse_file(const char *file) {
     if (get_one_num("throughput", list, &throughput_in_MB, "default_throughput error") < 0)
         goto error;
 
+    // Dirty bitmap scanner threads
+    get_opt_num("scan_threads", list, &para_config->num_scanners);
+    if (para_config->num_scanners < 1)
+        para_config->num_scanners = 1;
+    if (para_config->num_scanners > MAX_SCAN_THREADS)
+        para_config->num_scanners = MAX_SCAN_THREADS;
+
+    // Compression level of the slave streams
+    get_opt_num("compression", list, &para_config->compression);
+    if (para_config->compression < 0 || para_config->compression > MAX_COMPRESSION) {
+        fprintf(stderr, "compression level %d out of range, disabled\n",
+                para_config->compression);
+        para_config->compression = 0;
+    }
+
+    // XBZRLE page cache size
+    get_opt_num("xbzrle_cache", list, &para_config->xbzrle_cache);
+    if (para_config->xbzrle_cache < 0)
+        para_config->xbzrle_cache = 0;
+
+    // Memory sharding among slaves
+    get_opt_num("shard_mode", list, &para_config->shard_mode);
+
+    // NUMA placement of the slaves
+    get_slave_nodes(list, para_config);
+    get_opt_num("bind_h_ip", list, &para_config->bind_host_ip);
+
+    // Disk writer threads of the dest
+    get_opt_num("disk_writers", list, &para_config->num_disk_writers);
+    if (para_config->num_disk_writers < 1)
+        para_config->num_disk_writers = 1;
+    if (para_config->num_disk_writers > MAX_DISK_WRITERS)
+        para_config->num_disk_writers = MAX_DISK_WRITERS;
+
+    // Disk reads in flight on the source
+    get_opt_num("disk_read_depth", list, &para_config->disk_read_depth);
+    if (para_config->disk_read_depth < 1)
+        para_config->disk_read_depth = 1;
+    if (para_config->disk_read_depth > MAX_DISK_READ_DEPTH)
+        para_config->disk_read_depth = MAX_DISK_READ_DEPTH;
+
+    // Throughput every slave keeps when the others use the shared budget
+    get_opt_num("slave_min_throughput", list, &para_config->slave_min_throughput);
+    if (para_config->slave_min_throughput < 0)
+        para_config->slave_min_throughput = 0;
+
+    // Work stealing among the slaves
+    get_opt_num("work_stealing", list, &para_config->work_stealing);
+
+    // Convergence controller of the last iteration decision
+    get_opt_num("conv_alpha", list, &para_config->conv_alpha);
+    if (para_config->conv_alpha < 1)
+        para_config->conv_alpha = 1;
+    if (para_config->conv_alpha > 100)
+        para_config->conv_alpha = 100;
+    get_opt_num("conv_min_gain", list, &para_config->conv_min_gain);
+    if (para_config->conv_min_gain < 0)
+        para_config->conv_min_gain = 0;
+    if (para_config->conv_min_gain > 99)
+        para_config->conv_min_gain = 99;
+
+    // vCPU throttling of guests that do not converge
+    get_opt_num("auto_converge", list, &para_config->auto_converge);
+    get_opt_num("throttle_initial", list, &para_config->throttle_initial);
+    if (para_config->throttle_initial < 1)
+        para_config->throttle_initial = 1;
+    if (para_config->throttle_initial > 99)
+        para_config->throttle_initial = 99;
+    get_opt_num("throttle_increment", list, &para_config->throttle_increment);
+    if (para_config->throttle_increment < 1)
+        para_config->throttle_increment = 1;
+
+    // Post-copy, one slave serves the faults and the others push the pages
+    get_opt_num("postcopy", list, &para_config->postcopy);
+    if (para_config->postcopy && para_config->num_slaves < 2) {
+        fprintf(stderr, "postcopy needs at least 2 slaves, disabled\n");
+        para_config->postcopy = 0;
+    }
+
+    // Disk post-copy, the same split of the slaves
+    get_opt_num("disk_postcopy", list, &para_config->disk_postcopy);
+    if (para_config->disk_postcopy && para_config->num_slaves < 2) {
+        fprintf(stderr, "disk_postcopy needs at least 2 slaves, disabled\n");
+        para_config->disk_postcopy = 0;
+    }
+
+    // Hot pages wait for the last iteration
+    get_opt_num("hot_rounds", list, &para_config->hot_rounds);
+    if (para_config->hot_rounds < 0)
+        para_config->hot_rounds = 0;
+    if (para_config->hot_rounds > MAX_HOT_ROUNDS)
+        para_config->hot_rounds = MAX_HOT_ROUNDS;
+
     para_config->default_throughput = throughput_in_MB;
     reveal_param(para_config);
 
@@ -125,6 +269,30 @@ int reveal_param(struct parallel_param *param) {
 	printf("max_iter: %d\n", param->max_iter);
 	printf("max_factor: %d\n", param->max_factor);
 	printf("max_downtime: %d\n", param->max_downtime);
+	printf("scan_threads: %d\n", param->num_scanners);
+	printf("compression: %d\n", param->compression);
+	printf("xbzrle_cache: %dMB\n", param->xbzrle_cache);
+	printf("shard_mode: %d\n", param->shard_mode);
+	printf("bind_h_ip: %d\n", param->bind_host_ip);
+	printf("disk_writers: %d\n", param->num_disk_writers);
+	printf("disk_read_depth: %d\n", param->disk_read_depth);
+	printf("slave_min_throughput: %dMB\n", param->slave_min_throughput);
+	printf("work_stealing: %d\n", param->work_stealing);
+	printf("conv_alpha: %d%%\n", param->conv_alpha);
+	printf("conv_min_gain: %d%%\n", param->conv_min_gain);
+	printf("auto_converge: %d, throttle %d%% + %d%%\n", param->auto_converge,
+	       param->throttle_initial, param->throttle_increment);
+	printf("postcopy: %d\n", param->postcopy);
+	printf("disk_postcopy: %d\n", param->disk_postcopy);
+	printf("hot_rounds: %d\n", param->hot_rounds);
+	if (param->slave_node) {
+		int i;
+
+		printf("slave_node:");
+		for (i = 0; i < param->num_slaves; i++)
+			printf(" %d", param->slave_node[i]);
+		printf("\n");
+	}
 
 	printf("host_ip_list:\n");
 	for (list = param->host_ip_list; list != NULL; list = list->next) {
@@ -14,6 +14,28 @@ struct ip_list {
 #define DEFAULT_MAX_ITER 29 /*max 30 iterations*/
 #define DEFAULT_MAX_FACTOR 3 /*never send more than 3x p2m_size*/
 #define DEFAULT_MAX_DOWNTIME 30 /*max down time is 30ms*/
+#define DEFAULT_SCAN_THREADS 4 /*threads scanning the dirty bitmap*/
+#define MAX_SCAN_THREADS 32
+#define DEFAULT_COMPRESSION 0 /*zlib level of the slave streams, 0 is off*/
+#define MAX_COMPRESSION 9
+#define DEFAULT_XBZRLE_CACHE 0 /*XBZRLE page cache size in MB, 0 is off*/
+#define DEFAULT_SHARD_MODE 0 /*every slave owns a fixed memory range*/
+#define DEFAULT_BIND_HOST_IP 0 /*bind the slave sockets to the h_ip addresses*/
+#define DEFAULT_DISK_WRITERS 4 /*threads writing the disk chunks on the dest*/
+#define MAX_DISK_WRITERS 16
+#define DEFAULT_DISK_READ_DEPTH 4 /*disk chunks read at the same time on the source*/
+#define MAX_DISK_READ_DEPTH 32
+#define DEFAULT_SLAVE_MIN_THROUGHPUT 0 /*MB/s every slave may send on top of the shared budget*/
+#define DEFAULT_WORK_STEALING 1 /*idle slaves take batches queued for the others*/
+#define DEFAULT_CONV_ALPHA 50 /*percent weight of the newest iteration in the dirty rate*/
+#define DEFAULT_CONV_MIN_GAIN 10 /*percent an iteration must cut the downtime by*/
+#define DEFAULT_AUTO_CONVERGE 0 /*throttle the vCPUs of a guest dirtying faster than sent*/
+#define DEFAULT_THROTTLE_INITIAL 20 /*percent of the time the vCPUs sleep at first*/
+#define DEFAULT_THROTTLE_INCREMENT 10 /*percent added every iteration it does not converge*/
+#define DEFAULT_POSTCOPY 0 /*switch to the dest after one round, fetch the rest on demand*/
+#define DEFAULT_DISK_POSTCOPY 0 /*pre-copy the memory, fetch the disk on demand after the switch*/
+#define DEFAULT_HOT_ROUNDS 0 /*rounds in a row a page is dirty before it waits for the last one*/
+#define MAX_HOT_ROUNDS 7
 
 struct parallel_param {
     int SSL_type;
@@ -25,6 +47,24 @@ struct parallel_param {
     int max_factor;
 	int max_downtime;
     unsigned long default_throughput;
+    int num_scanners;
+    int compression;
+    int xbzrle_cache;
+    int shard_mode;
+    int *slave_node; /*NUMA node of every slave, NULL when not bound*/
+    int bind_host_ip;
+    int num_disk_writers;
+    int disk_read_depth;
+    int slave_min_throughput;
+    int work_stealing;
+    int conv_alpha;
+    int conv_min_gain;
+    int auto_converge;
+    int throttle_initial;
+    int throttle_increment;
+    int postcopy;
+    int disk_postcopy;
+    int hot_rounds;
 };
 
 extern struct parallel_param *parse_file(const char *file);
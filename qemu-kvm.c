@@ -1407,6 +1407,140 @@ static void process_irqchip_events(CPUState *env)
         env->halted = 0;
 }
 
+/*
+ * classicsong
+ * vCPU throttling of auto-converge migration
+ * while cpu_throttle_pct is set, a ticker thread kicks every vCPU out of
+ * KVM_RUN after CPU_THROTTLE_SLICE_NS of run time, the vCPU then sleeps
+ * without qemu_mutex, so the guest runs (100 - pct) percent of the time and
+ * dirties its memory that much slower
+ */
+#define CPU_THROTTLE_SLICE_NS 10000000 /* 10ms */
+
+static volatile int cpu_throttle_pct;
+static volatile unsigned long cpu_throttle_tick;
+static __thread unsigned long cpu_throttle_seen;
+/* the ticker runs only while the throttle is on */
+static int cpu_throttle_started;
+static pthread_t cpu_throttle_tid;
+static pthread_mutex_t cpu_throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cpu_throttle_cond = PTHREAD_COND_INITIALIZER;
+
+static long cpu_throttle_sleep_ns(int pct)
+{
+    return (long)CPU_THROTTLE_SLICE_NS * pct / (100 - pct);
+}
+
+static void *cpu_throttle_ticker(void *data)
+{
+    CPUState *penv;
+    struct timespec ts;
+    sigset_t signals;
+    long ns;
+    int pct;
+
+    sigfillset(&signals);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_mutex_lock(&cpu_throttle_lock);
+    while ((pct = cpu_throttle_pct) != 0) {
+        ns = CPU_THROTTLE_SLICE_NS + cpu_throttle_sleep_ns(pct);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ns += ts.tv_nsec;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        //kvm_set_cpu_throttle(0) wakes it up to leave
+        if (pthread_cond_timedwait(&cpu_throttle_cond, &cpu_throttle_lock, &ts) != ETIMEDOUT)
+            continue;
+        if (cpu_throttle_pct == 0)
+            break;
+
+        cpu_throttle_tick++;
+        for (penv = first_cpu; penv; penv = (CPUState *) penv->next_cpu)
+            if (penv->created)
+                pthread_kill(penv->kvm_cpu_state.thread, SIG_IPI);
+    }
+    pthread_mutex_unlock(&cpu_throttle_lock);
+
+    return NULL;
+}
+
+/*
+ * called by the memory master with auto_converge on, the ticker is
+ * started with the throttle, migrate_fd_cleanup turns it off and stops it
+ */
+void kvm_set_cpu_throttle(int pct)
+{
+    if (!kvm_enabled())
+        return;
+    if (pct < 0)
+        pct = 0;
+    if (pct > 99)
+        pct = 99;
+
+    pthread_mutex_lock(&cpu_throttle_lock);
+    cpu_throttle_pct = pct;
+    pthread_cond_signal(&cpu_throttle_cond);
+    pthread_mutex_unlock(&cpu_throttle_lock);
+
+    if (pct && !cpu_throttle_started) {
+        cpu_throttle_started = 1;
+        pthread_create(&cpu_throttle_tid, NULL, cpu_throttle_ticker, NULL);
+    } else if (!pct && cpu_throttle_started) {
+        pthread_join(cpu_throttle_tid, NULL);
+        cpu_throttle_started = 0;
+    }
+}
+
+/*
+ * sleep off the throttle once per tick, called with qemu_mutex held
+ * SIG_IPI is blocked here, so the sleep waits for it as kvm_main_loop_wait
+ * does: pause_all_threads and on_vcpu kick the vCPU once and wait for it,
+ * they must not wait for the throttle too
+ */
+static void kvm_cpu_throttle(CPUState *env)
+{
+    unsigned long tick = cpu_throttle_tick;
+    int pct = cpu_throttle_pct;
+    struct timespec ts, now;
+    sigset_t waitset;
+    siginfo_t siginfo;
+    long ns, end;
+    int r;
+
+    if (tick == cpu_throttle_seen)
+        return;
+    cpu_throttle_seen = tick;
+    if (pct == 0)
+        return;
+
+    sigemptyset(&waitset);
+    sigaddset(&waitset, SIG_IPI);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    end = now.tv_sec * 1000000000L + now.tv_nsec + cpu_throttle_sleep_ns(pct);
+    for (;;) {
+        ns = end - (now.tv_sec * 1000000000L + now.tv_nsec);
+        if (ns <= 0)
+            break;
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+
+        pthread_mutex_unlock(&qemu_mutex);
+        r = sigtimedwait(&waitset, &siginfo, &ts);
+        pthread_mutex_lock(&qemu_mutex);
+
+        //the kick is taken, handle what it was for right away
+        if (r == SIG_IPI && (env->stop || env->stopped ||
+                             env->kvm_cpu_state.queued_work_first)) {
+            kvm_main_loop_wait(env, 0);
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    cpu_single_env = env;
+}
+
 static int kvm_main_loop_cpu(CPUState *env)
 {
     while (1) {
@@ -1418,8 +1552,11 @@ static int kvm_main_loop_cpu(CPUState *env)
         if (run_cpu) {
             kvm_cpu_exec(env);
             kvm_main_loop_wait(env, 0);
+            kvm_cpu_throttle(env);
         } else {
             kvm_main_loop_wait(env, 1000);
+            //a stopped or halted vCPU dirties nothing, skip its ticks
+            cpu_throttle_seen = cpu_throttle_tick;
         }
     }
     pthread_mutex_unlock(&qemu_mutex);
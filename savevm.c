@@ -86,6 +86,7 @@
 
 //classicsong
 #include "migration-negotiate.h"
+#include "migr-postcopy.h"
 
 //classicsong debug use
 #define DEBUG_MIGRATION_SAVEVM
@@ -171,6 +172,7 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE 64
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
@@ -188,6 +190,23 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /*
+     * classicsong
+     * buffers queued by qemu_put_buffer_async are not copied, they are
+     * kept in iov together with the parts of buf written in between and
+     * go out with one writev_buffer call in qemu_fflush.
+     * buf[0, iov_buf_start) is already in iov
+     */
+    QEMUFileWritevBufferFunc *writev_buffer;
+    struct iovec iov[MAX_IOV_SIZE];
+    int iovcnt;
+    int iov_buf_start;
+    /*
+     * reading: qemu_get_buffer_direct receives the part of the data
+     * that is not buffered straight into the caller's buffer
+     */
+    QEMUFileGetBuffervFunc *get_bufferv;
+
     int has_error;
 };
 
@@ -225,6 +244,26 @@ static int socket_get_buffer_ssl(void *opaque, uint8_t *buf, int64_t pos, int si
     return len;
 }
 
+static int socket_get_bufferv(void *opaque, struct iovec *iov, int iovcnt)
+{
+    QEMUFileSocket *s = opaque;
+    struct msghdr msg;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    do {
+        len = recvmsg(s->fd, &msg, 0);
+    } while (len == -1 && socket_error() == EINTR);
+
+    if (len == -1)
+        len = -socket_error();
+
+    return len;
+}
+
 static int socket_close_ssl(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -387,6 +426,7 @@ QEMUFile *qemu_fopen_socket(int fd)
     s->fd = fd;
     s->file = qemu_fopen_ops(s, NULL, socket_get_buffer, socket_close, 
 			     NULL, NULL, NULL);
+    qemu_file_set_readv(s->file, socket_get_bufferv);
     return s->file;
 }
 
@@ -460,6 +500,108 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
 }
 
+/*
+ * classicsong
+ * memory backed QEMUFile
+ * slaves serialize a batch into it before compressing, the dest slaves
+ * load decompressed batches from it
+ */
+typedef struct QEMUFileBuffer
+{
+    uint8_t *data;
+    int64_t size;
+    int64_t capacity;
+    int owned;
+    QEMUFile *file;
+} QEMUFileBuffer;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos + size > s->capacity) {
+        s->capacity = MAX(s->capacity * 2, pos + size);
+        s->data = qemu_realloc(s->data, s->capacity);
+    }
+    memcpy(s->data + pos, buf, size);
+    s->size = MAX(s->size, pos + size);
+
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->size)
+        return 0;
+    if (size > s->size - pos)
+        size = s->size - pos;
+    memcpy(buf, s->data + pos, size);
+
+    return size;
+}
+
+static int buffer_close(void *opaque)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (s->owned)
+        qemu_free(s->data);
+    qemu_free(s);
+    return 0;
+}
+
+QEMUFile *qemu_fopen_buffer_write(void)
+{
+    QEMUFileBuffer *s = qemu_mallocz(sizeof(QEMUFileBuffer));
+
+    s->owned = 1;
+    s->file = qemu_fopen_ops(s, buffer_put_buffer, NULL, buffer_close,
+                             NULL, NULL, NULL);
+    return s->file;
+}
+
+QEMUFile *qemu_fopen_buffer_read(void)
+{
+    QEMUFileBuffer *s = qemu_mallocz(sizeof(QEMUFileBuffer));
+
+    s->file = qemu_fopen_ops(s, NULL, buffer_get_buffer, buffer_close,
+                             NULL, NULL, NULL);
+    return s->file;
+}
+
+/* flush a write buffer file and get the bytes written since the last reset */
+uint8_t *qemu_buffer_file_data(QEMUFile *f, int64_t *size)
+{
+    QEMUFileBuffer *s = f->opaque;
+
+    qemu_fflush(f);
+    *size = s->size;
+    return s->data;
+}
+
+/*
+ * rewind a buffer file, a read file is pointed at data (not copied)
+ * a write file ignores data and starts over
+ */
+void qemu_buffer_file_reset(QEMUFile *f, uint8_t *data, int64_t size)
+{
+    QEMUFileBuffer *s = f->opaque;
+
+    if (!s->owned) {
+        s->data = data;
+        s->size = size;
+    } else
+        s->size = 0;
+
+    f->buf_offset = 0;
+    f->buf_index = 0;
+    f->buf_size = 0;
+    f->has_error = 0;
+}
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,
@@ -493,11 +635,53 @@ void qemu_file_set_error(QEMUFile *f)
     f->has_error = 1;
 }
 
+void qemu_file_set_writev(QEMUFile *f, QEMUFileWritevBufferFunc *writev_buffer)
+{
+    f->writev_buffer = writev_buffer;
+}
+
+static void qemu_iov_add(QEMUFile *f, const uint8_t *buf, int size)
+{
+    f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+    f->iov[f->iovcnt].iov_len = size;
+    f->iovcnt++;
+}
+
+/* queue what was put to buf since the last queued buffer */
+static void qemu_iov_add_inline(QEMUFile *f)
+{
+    if (f->buf_index > f->iov_buf_start) {
+        qemu_iov_add(f, f->buf + f->iov_buf_start, f->buf_index - f->iov_buf_start);
+        f->iov_buf_start = f->buf_index;
+    }
+}
+
+static void qemu_fflush_iov(QEMUFile *f)
+{
+    ssize_t len;
+
+    qemu_iov_add_inline(f);
+
+    len = f->writev_buffer(f->opaque, f->iov, f->iovcnt);
+    if (len > 0)
+        f->buf_offset += len;
+    else
+        f->has_error = 1;
+    f->iovcnt = 0;
+    f->iov_buf_start = 0;
+    f->buf_index = 0;
+}
+
 void qemu_fflush(QEMUFile *f)
 {
     if (!f->put_buffer)
         return;
 
+    if (f->is_write && f->iovcnt > 0) {
+        qemu_fflush_iov(f);
+        return;
+    }
+
     if (f->is_write && f->buf_index > 0) {
         int len;
 
@@ -568,6 +752,30 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+/*
+ * classicsong
+ * put buf without copying it, buf must not be freed before the next
+ * qemu_fflush; files without writev_buffer copy it as usual
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (f->has_error)
+        return;
+
+    /* room for the inline bytes before buf, buf and the ones after it */
+    if (f->iovcnt > MAX_IOV_SIZE - 3)
+        qemu_fflush(f);
+
+    f->is_write = 1;
+    qemu_iov_add_inline(f);
+    qemu_iov_add(f, buf, size);
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
@@ -608,6 +816,95 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size1)
     return size1 - size;
 }
 
+void qemu_file_set_readv(QEMUFile *f, QEMUFileGetBuffervFunc *get_bufferv)
+{
+    f->get_bufferv = get_bufferv;
+}
+
+/*
+ * classicsong
+ * like qemu_get_buffer, but what is not buffered yet is received into buf
+ * directly, the read ahead after it goes to f->buf with the same recvmsg
+ */
+int qemu_get_buffer_direct(QEMUFile *f, uint8_t *buf, int size1)
+{
+    struct iovec iov[2];
+    int size, l, len;
+
+    if (!f->get_bufferv)
+        return qemu_get_buffer(f, buf, size1);
+
+    if (f->is_write)
+        abort();
+
+    size = size1;
+    l = f->buf_size - f->buf_index;
+    if (l > size)
+        l = size;
+    memcpy(buf, f->buf + f->buf_index, l);
+    f->buf_index += l;
+    buf += l;
+    size -= l;
+
+    if (size == 0)
+        return size1;
+
+    /* f->buf is drained */
+    f->buf_index = 0;
+    f->buf_size = 0;
+    while (size > 0) {
+        iov[0].iov_base = buf;
+        iov[0].iov_len = size;
+        iov[1].iov_base = f->buf;
+        iov[1].iov_len = IO_BUF_SIZE;
+
+        len = f->get_bufferv(f->opaque, iov, 2);
+        if (len <= 0) {
+            if (len != -EAGAIN)
+                f->has_error = 1;
+            break;
+        }
+
+        f->buf_offset += len;
+        if (len > size) {
+            f->buf_size = len - size;
+            len = size;
+        }
+        buf += len;
+        size -= len;
+    }
+
+    return size1 - size;
+}
+
+/*
+ * classicsong
+ * drop size bytes of the stream, f->buf is the sink so nothing is copied
+ */
+int qemu_skip_buffer(QEMUFile *f, int size1)
+{
+    int size, l;
+
+    if (f->is_write)
+        abort();
+
+    size = size1;
+    while (size > 0) {
+        l = f->buf_size - f->buf_index;
+        if (l == 0) {
+            qemu_fill_buffer(f);
+            l = f->buf_size - f->buf_index;
+            if (l == 0)
+                break;
+        }
+        if (l > size)
+            l = size;
+        f->buf_index += l;
+        size -= l;
+    }
+    return size1 - size;
+}
+
 static int qemu_peek_byte(QEMUFile *f)
 {
     if (f->is_write)
@@ -1489,6 +1786,8 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_SECTION_NEGOTIATE    0x06
 #define QEMU_VM_ITER_END             0x07
+#define QEMU_VM_SECTION_COMPRESSED   0x08
+#define QEMU_VM_POSTCOPY             0x09
 
 
 bool qemu_savevm_state_blocked(Monitor *mon)
@@ -1545,6 +1844,7 @@ qemu_migrate_savevm_state_begin(void *opaque, Monitor *mon, QEMUFile *f,
      */
     s->mem_task_queue = new_task_queue();
     s->disk_task_queue = new_task_queue();
+    task_body_pool_init();
 
     DPRINTF("task_queue created\n");
 
@@ -1556,8 +1856,10 @@ qemu_migrate_savevm_state_begin(void *opaque, Monitor *mon, QEMUFile *f,
     /*
      * initiate slave threads
      */
-    if (s->para_config != NULL)
+    if (s->para_config != NULL) {
+        conv_init(&s->conv, s->para_config->conv_alpha, s->para_config->conv_min_gain);
         init_host_slaves(s);
+    }
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1897,17 +2199,37 @@ typedef struct LoadStateEntry {
 struct FdMigrationDestState *dest_state;
 typedef QLIST_HEAD(migr_handler, LoadStateEntry) migr_handler;
                                                  
-void slave_process_incoming_migration(QEMUFile *f, void * loadvm_handlers, 
-                                      struct banner *banner, int fd);
-void 
+//from arch_init.c
+extern void postcopy_set_channel(int fd);
+extern int ram_postcopy_load_map(QEMUFile *f);
+extern int ram_postcopy_start(void);
+extern void ram_postcopy_cancel(void);
+
+//from block-migration.c
+extern int blk_postcopy_load_map(QEMUFile *f);
+extern int blk_postcopy_start(struct banner *banner);
+
+int slave_process_incoming_migration(QEMUFile *f, void * loadvm_handlers, 
+                                     struct banner *banner, int fd);
+/*
+ * returns 1 when the stream goes on with the pages of post-copy,
+ * they are placed after the switch by ram_postcopy_load
+ */
+int 
 slave_process_incoming_migration(QEMUFile *f, void *loadvm_handlers, 
                                  struct banner *banner, int fd) {
     LoadStateEntry *le;
     uint8_t section_type;
     uint32_t section_id;
     int ret;
-
-    while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
+    int postcopy = 0;
+    uint32_t flags;
+    /* decompression state, allocated on the first compressed section */
+    QEMUFile *zfile = NULL;
+    uint8_t *zbuf = NULL, *raw = NULL;
+    uint32_t zbuf_size = 0, raw_size = 0;
+
+    while (!postcopy && (section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         /*
          * start modifying here tomorrow
          */
@@ -1940,24 +2262,102 @@ slave_process_incoming_migration(QEMUFile *f, void *loadvm_handlers,
                 goto out;
             }
             break;
+        case QEMU_VM_SECTION_COMPRESSED: {
+            uint32_t raw_len, z_len;
+            uLongf out_len;
+
+            section_id = qemu_get_be32(f);
+            raw_len = qemu_get_be32(f);
+            z_len = qemu_get_be32(f);
+
+            QLIST_FOREACH(le, (migr_handler *)loadvm_handlers, entry) {
+                if (le->section_id == section_id) {
+                    break;
+                }
+            }
+
+            if (le == NULL) {
+                fprintf(stderr, "Unknown savevm section %d\n", section_id);
+                ret = -EINVAL;
+                goto out;
+            }
+
+            if (z_len > zbuf_size) {
+                zbuf_size = z_len;
+                zbuf = qemu_realloc(zbuf, zbuf_size);
+            }
+            if (raw_len > raw_size) {
+                raw_size = raw_len;
+                raw = qemu_realloc(raw, raw_size);
+            }
+            if (zfile == NULL)
+                zfile = qemu_fopen_buffer_read();
+
+            qemu_get_buffer(f, zbuf, z_len);
+            out_len = raw_len;
+            if (uncompress(raw, &out_len, zbuf, z_len) != Z_OK || out_len != raw_len) {
+                fprintf(stderr, "decompress error in section %d\n", section_id);
+                ret = -EINVAL;
+                goto out;
+            }
+
+            qemu_buffer_file_reset(zfile, raw, raw_len);
+            ret = vmstate_load(zfile, le->se, le->version_id);
+            if (ret < 0) {
+                fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
+                        section_id);
+                goto out;
+            }
+            break;
+        }
         case QEMU_VM_ITER_END:
-            atomic_inc(&banner->slave_done);
+            /*
+             * the iterations overlap, the disk writers order the versions
+             * of a chunk, so the end of an iteration is acked at once
+             */
+            atomic_inc(&banner->iter_done);
+            task_event_notify(&banner->event);
             fprintf(stderr, "receive end\n");
-            pthread_barrier_wait(&banner->end_barrier);
-            write(fd, "OK", sizeof("OK"));
+            if (write(fd, "OK", sizeof("OK")) != sizeof("OK"))
+                fprintf(stderr, "error acking iteration end\n");
+            break;
+        case QEMU_VM_POSTCOPY:
+            /*
+             * the pre-copy part of the stream ends here, the stream of
+             * slave 0 carries the pages to drop and the chunks missing
+             */
+            flags = qemu_get_be32(f);
+            if (flags)
+                postcopy_set_channel(fd);
+            if ((flags & POSTCOPY_MAP_RAM) && ram_postcopy_load_map(f) < 0) {
+                fprintf(stderr, "error loading the post-copy map\n");
+                ret = -EINVAL;
+                goto out;
+            }
+            if ((flags & POSTCOPY_MAP_DISK) && blk_postcopy_load_map(f) < 0) {
+                fprintf(stderr, "error loading the disk post-copy map\n");
+                ret = -EINVAL;
+                goto out;
+            }
+            postcopy = 1;
             break;
         }
     }
 
     atomic_inc(&banner->slave_done);
     banner->end = 1;
+    task_event_notify(&banner->event);
  out:
-    return;
+    if (zfile)
+        qemu_fclose(zfile);
+    qemu_free(zbuf);
+    qemu_free(raw);
+    return postcopy;
 }
 
 extern pthread_t create_dest_slave(char *listen_ip, int ssl_type, void *loadvm_handlers, 
                                    struct banner *banner, pthread_barrier_t *end_barrier);
-extern void create_dest_disk_master(int nr_slaves, struct banner *banner);
+extern void create_dest_disk_master(int nr_slaves, int nr_writers, struct banner *banner);
 
 static struct migration_slave *dest_slave_list = NULL;
 
@@ -1970,7 +2370,7 @@ int qemu_loadvm_state(QEMUFile *f)
     unsigned int v;
     int ret;
     pthread_barrier_t end_barrier;
-    struct banner *disk_banner;
+    struct banner *disk_banner = NULL;
 
     if (qemu_savevm_state_blocked(default_mon)) {
         return -EINVAL;
@@ -2000,7 +2400,7 @@ int qemu_loadvm_state(QEMUFile *f)
         int len;
 
         //classicsong add this
-        int num_slaves, num_ips, ssl_type, i;
+        int num_slaves, num_ips, ssl_type, compression, nr_writers, i;
         uint8_t *ip_buf;               //32 bytes is enough for dest_ip:port
 
         //DPRINTF("section type %d\n", section_type);
@@ -2078,18 +2478,25 @@ int qemu_loadvm_state(QEMUFile *f)
             num_slaves = qemu_get_be32(f);
             num_ips = qemu_get_be32(f);
             ssl_type = qemu_get_be32(f);
+            compression = qemu_get_be32(f);
+            DPRINTF("slave streams compressed at level %d\n", compression);
+            nr_writers = qemu_get_be32(f);
+            if (nr_writers < 1 || nr_writers > MAX_DISK_WRITERS)
+                nr_writers = 1;
+            DPRINTF("%d disk writers\n", nr_writers);
 
             /*
              * Init sync point of the end of all end in the dest
              * We have one master and several slaves in the dest
              */
             disk_banner = (struct banner *)malloc(sizeof(struct banner));
-            pthread_barrier_init(&disk_banner->end_barrier, NULL, num_slaves + 1);
             pthread_barrier_init(&end_barrier, NULL, num_slaves + 1);
+            atomic_set(&disk_banner->iter_done, 0);
             atomic_set(&disk_banner->slave_done, 0);
             disk_banner->end = 0;
+            task_event_init(&disk_banner->event);
             
-            create_dest_disk_master(num_slaves, disk_banner);
+            create_dest_disk_master(num_slaves, nr_writers, disk_banner);
             /*
              * creating dest slaves
              */
@@ -2122,6 +2529,14 @@ int qemu_loadvm_state(QEMUFile *f)
     DPRINTF("Hit End Barrier Master %d\n", section_type);
     pthread_barrier_wait(&end_barrier);
 
+    //post-copy: the pages and chunks left are fetched while the guest runs
+    if (blk_postcopy_start(disk_banner) < 0)
+        ram_postcopy_cancel();
+    if (ram_postcopy_start() < 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+
     cpu_synchronize_all_post_init();
 
     ret = 0;
@@ -0,0 +1,85 @@
+/*
+ * speed test of the duplicate page detection used by migration slaves
+ * reports GB/s of every is_dup_page variant on pages it has to read in full:
+ * zero and uniform pages, and pages differing only in their last byte, the
+ * worst case of a page that is not a dup. A page differing early costs one
+ * line, so it says nothing about the throughput
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "migr-dup.h"
+
+#define NR_PAGES 4096 /* 16M working set */
+#define NR_ROUNDS 64
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, is_dup_page_fn fn, uint8_t *pages,
+                  const char *kind, int expect)
+{
+    double start, t;
+    long dup = 0;
+    int i, r;
+
+    start = now();
+    for (r = 0; r < NR_ROUNDS; r++) {
+        for (i = 0; i < NR_PAGES; i++) {
+            uint8_t *p = pages + (long)i * DUP_PAGE_SIZE;
+            dup += fn(p, *p);
+        }
+    }
+    t = now() - start;
+
+    if (dup != (expect ? (long)NR_PAGES * NR_ROUNDS : 0))
+        printf("%-8s %-8s WRONG RESULT\n", name, kind);
+    printf("%-8s %-8s %8.2f GB/s\n", name, kind,
+           (double)NR_PAGES * NR_ROUNDS * DUP_PAGE_SIZE / t / 1e9);
+}
+
+static void bench_all(uint8_t *pages, const char *kind, int expect)
+{
+    bench("generic", is_dup_page_generic, pages, kind, expect);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        bench("sse2", is_dup_page_sse2, pages, kind, expect);
+    if (__builtin_cpu_supports("avx2"))
+        bench("avx2", is_dup_page_avx2, pages, kind, expect);
+#endif
+    bench("selected", select_is_dup_page(), pages, kind, expect);
+}
+
+int main(void)
+{
+    uint8_t *pages;
+    long i;
+
+    if (posix_memalign((void **)&pages, DUP_PAGE_SIZE, (long)NR_PAGES * DUP_PAGE_SIZE)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    memset(pages, 0, (long)NR_PAGES * DUP_PAGE_SIZE);
+    bench_all(pages, "zero", 1);
+
+    for (i = 0; i < NR_PAGES; i++)
+        memset(pages + i * DUP_PAGE_SIZE, i & 0xff, DUP_PAGE_SIZE);
+    bench_all(pages, "uniform", 1);
+
+    /* uniform but the last byte, found only in the last line */
+    for (i = 0; i < NR_PAGES; i++)
+        pages[(i + 1) * DUP_PAGE_SIZE - 1] = ~(i & 0xff);
+    bench_all(pages, "last", 0);
+
+    free(pages);
+    return 0;
+}